@@ -0,0 +1,251 @@
+/*!\file atlas.c
+ *
+ * \brief atlas de textures : plusieurs images rangées dans une seule.
+ *
+ * Chaque image de l'atlas est désignée par un texture_t, son
+ * sous-rectangle dans l'image de l'atlas, que la surface garde (voir
+ * set_texture_handle) : l'échantillonnage ne dépend plus que de la
+ * surface, sans texture courante à changer entre deux dessins, si
+ * bien que des dessins enregistrés ou rastérisés ensemble (display
+ * lists, bandes en parallèle) peuvent mélanger les textures. Les
+ * coordonnées de texture se répètent à l'intérieur du sous-rectangle
+ * (voir rasterize.c), pas dans l'atlas entier : les images n'ont donc
+ * pas besoin de marge entre elles.
+ *
+ * Le rangement est fait par étagères : les images, triées par
+ * hauteur décroissante, sont posées de gauche à droite sur une
+ * étagère de la hauteur de la première, une nouvelle étagère étant
+ * ouverte au-dessus quand la largeur de l'atlas est atteinte. Cette
+ * largeur est la plus petite puissance de 2 qui dépasse à la fois la
+ * plus large des images et la racine de leur aire totale. Les images
+ * sont placées sur des multiples de 4 texels, si bien que chaque
+ * bloc de 4x4 texels n'appartient qu'à une image.
+ *
+ * atlas_compress remplace l'image de l'atlas par sa version
+ * compressée BC1 (DXT1) : chaque bloc de 4x4 texels tient en 64 bits,
+ * deux couleurs RGB565 et un indice de 2 bits par texel dans la
+ * palette qu'elles définissent, soit 8 fois moins de mémoire (et de
+ * trafic mémoire à l'échantillonnage) qu'en RGBA. Le codeur, exécuté
+ * au chargement, prend pour couleurs les coins de la boîte englobante
+ * des couleurs du bloc, resserrée d'un seizième ; le décodage se fait
+ * à l'échantillonnage (voir texel dans rasterize.c). L'alpha n'est
+ * pas gardé : les textures compressées sont opaques.
+ *
+ * \author VILFEU Vincent
+ */
+#include "rasterize.h"
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+
+static void bc1_encode(const GLuint * p, int stride, GLuint * out);
+
+/*!\brief fabrique un atlas rangeant les \a n images \a images, de
+ * dimensions \a w[i] x \a h[i] ; les images sont recopiées et peuvent
+ * être libérées ensuite. À libérer avec \ref atlas_free. */
+atlas_t * atlas_new(const GLuint * const * images, const int * w, const int * h, int n) {
+  int i, j, k, x, y, shelf, maxw = 0, *order;
+  double area = 0.0;
+  atlas_t * a = malloc(sizeof *a);
+  assert(a && n > 0);
+  a->n = n;
+  a->tex = malloc(n * sizeof *a->tex);
+  order = malloc(n * sizeof *order);
+  assert(a->tex && order);
+  for(i = 0; i < n; ++i) {
+    maxw = MAX(maxw, w[i]);
+    area += (double)w[i] * h[i];
+    /* tri par insertion, par hauteur décroissante */
+    for(j = i; j > 0 && h[order[j - 1]] < h[i]; --j)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  for(a->w = 4; a->w < maxw || (double)a->w * a->w < area; a->w <<= 1)
+    ;
+  for(k = x = y = shelf = 0; k < n; ++k) {
+    i = order[k];
+    if(x + w[i] > a->w) {
+      y += shelf;
+      x = shelf = 0;
+    }
+    a->tex[i].x = x;
+    a->tex[i].y = y;
+    a->tex[i].w = w[i];
+    a->tex[i].h = h[i];
+    a->tex[i].stride = a->w;
+    a->tex[i].format = TF_RGBA;
+    x += (w[i] + 3) & ~3;
+    shelf = MAX(shelf, (h[i] + 3) & ~3);
+  }
+  a->h = y + shelf;
+  a->format = TF_RGBA;
+  a->pixels = calloc(a->w * a->h, sizeof *a->pixels);
+  assert(a->pixels);
+  for(i = 0; i < n; ++i) {
+    a->tex[i].pixels = a->pixels;
+    for(y = 0; y < h[i]; ++y)
+      memcpy(&a->pixels[(a->tex[i].y + y) * a->w + a->tex[i].x], &images[i][y * w[i]], w[i] * sizeof *a->pixels);
+  }
+  free(order);
+  return a;
+}
+
+/*!\brief renvoie la texture de la \a i-ème image de \a a, valable
+ * jusqu'à \ref atlas_free */
+texture_t atlas_texture(const atlas_t * a, int i) {
+  assert(i >= 0 && i < a->n);
+  return a->tex[i];
+}
+
+/*!\brief compresse l'image de \a a au format BC1 (voir l'en-tête du
+ * fichier) ; les textures de \a a doivent être reprises par \ref
+ * atlas_texture, les précédentes ne sont plus valables */
+void atlas_compress(atlas_t * a) {
+  int bx, by, i;
+  GLuint * blocks;
+  if(a->format == TF_BC1)
+    return;
+  blocks = malloc((a->w >> 2) * (a->h >> 2) * 2 * sizeof *blocks);
+  assert(blocks);
+  for(by = 0; by < a->h >> 2; ++by)
+    for(bx = 0; bx < a->w >> 2; ++bx)
+      bc1_encode(&a->pixels[(by << 2) * a->w + (bx << 2)], a->w, &blocks[(by * (a->w >> 2) + bx) << 1]);
+  free(a->pixels);
+  a->pixels = blocks;
+  a->format = TF_BC1;
+  for(i = 0; i < a->n; ++i) {
+    a->tex[i].pixels = blocks;
+    a->tex[i].format = TF_BC1;
+  }
+}
+
+/*!\brief étend le RGB565 \a c en RGBA opaque */
+static GLuint rgb565_to_rgba(GLuint c) {
+  GLuint r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  return RGBA((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2), 255);
+}
+
+/*!\brief remplit \a pal avec la palette d'un bloc BC1 dont les deux
+ * couleurs RGB565 sont \a c01 (la première dans les 16 bits de poids
+ * faible) : quatre couleurs opaques si la première est plus grande,
+ * sinon trois et un noir transparent */
+void bc1_palette(GLuint c01, GLuint * pal) {
+  GLuint c0 = c01 & 0xFFFF, c1 = c01 >> 16;
+  pal[0] = rgb565_to_rgba(c0);
+  pal[1] = rgb565_to_rgba(c1);
+  if(c0 > c1) {
+    pal[2] = RGBA((2 * RED(pal[0]) + RED(pal[1])) / 3, (2 * GREEN(pal[0]) + GREEN(pal[1])) / 3, (2 * BLUE(pal[0]) + BLUE(pal[1])) / 3, 255);
+    pal[3] = RGBA((RED(pal[0]) + 2 * RED(pal[1])) / 3, (GREEN(pal[0]) + 2 * GREEN(pal[1])) / 3, (BLUE(pal[0]) + 2 * BLUE(pal[1])) / 3, 255);
+  } else {
+    pal[2] = RGBA((RED(pal[0]) + RED(pal[1])) / 2, (GREEN(pal[0]) + GREEN(pal[1])) / 2, (BLUE(pal[0]) + BLUE(pal[1])) / 2, 255);
+    pal[3] = RGBA(0, 0, 0, 0);
+  }
+}
+
+/*!\brief calcule dans \a idx les indices des 16 texels du bloc \a p
+ * (image de \a stride texels de large) dans la palette BC1 des deux
+ * couleurs \a c01 ; renvoie l'erreur quadratique totale */
+static int bc1_indices(const GLuint * p, int stride, GLuint c01, GLuint * idx) {
+  int i, k, err = 0;
+  GLuint pal[4];
+  bc1_palette(c01, pal);
+  *idx = 0;
+  for(i = 0; i < 16; ++i) {
+    GLuint t = p[(i >> 2) * stride + (i & 3)];
+    int best = 0, dbest = INT_MAX;
+    for(k = 0; k < 4; ++k) {
+      int dr = (int)RED(t) - RED(pal[k]), dg = (int)GREEN(t) - GREEN(pal[k]), db = (int)BLUE(t) - BLUE(pal[k]);
+      int d = dr * dr + dg * dg + db * db;
+      if(d < dbest) {
+	dbest = d;
+	best = k;
+      }
+    }
+    *idx |= (GLuint)best << (i << 1);
+    err += dbest;
+  }
+  return err;
+}
+
+/*!\brief arrondit la couleur \a v (composantes dans [0, 255]) en
+ * RGB565 */
+static GLuint to_rgb565(const float * v) {
+  int c[3], i;
+  for(i = 0; i < 3; ++i)
+    c[i] = (int)(MIN(MAX(v[i], 0.0f), 255.0f) * (i == 1 ? 63.0f : 31.0f) / 255.0f + 0.5f);
+  return (c[0] << 11) | (c[1] << 5) | c[2];
+}
+
+/*!\brief code en BC1 dans \a out[0] et \a out[1] le bloc de 4x4
+ * texels \a p, pris dans une image de \a stride texels de large */
+void bc1_encode(const GLuint * p, int stride, GLuint * out) {
+  /* poids de la première couleur pour chaque indice de la palette */
+  static const float w0[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+  int i, c, lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 }, err;
+  float aa = 0.0f, bb = 0.0f, ab = 0.0f, ax[3] = { 0 }, bx[3] = { 0 }, det, e0[3], e1[3];
+  GLuint c0, c1, idx, ridx, r01;
+  for(i = 0; i < 16; ++i) {
+    GLuint t = p[(i >> 2) * stride + (i & 3)];
+    int v[3] = { RED(t), GREEN(t), BLUE(t) };
+    for(c = 0; c < 3; ++c) {
+      lo[c] = MIN(lo[c], v[c]);
+      hi[c] = MAX(hi[c], v[c]);
+    }
+  }
+  /* la boîte resserrée d'un seizième est moins sensible aux texels
+     isolés */
+  for(c = 0; c < 3; ++c) {
+    int d = (hi[c] - lo[c]) >> 4;
+    lo[c] += d;
+    hi[c] -= d;
+  }
+  c0 = ((hi[0] >> 3) << 11) | ((hi[1] >> 2) << 5) | (hi[2] >> 3);
+  c1 = ((lo[0] >> 3) << 11) | ((lo[1] >> 2) << 5) | (lo[2] >> 3);
+  /* hi >= lo sur chaque composante, donc c0 >= c1 : quatre couleurs,
+     sauf si elles sont égales et que l'indice 0 suffit */
+  out[0] = c0 | (c1 << 16);
+  out[1] = 0;
+  if(c0 == c1)
+    return;
+  err = bc1_indices(p, stride, out[0], &idx);
+  out[1] = idx;
+  /* les indices étant choisis, les deux couleurs qui minimisent
+     l'erreur (moindres carrés) remplacent les coins de la boîte si
+     elles font mieux */
+  for(i = 0; i < 16; ++i) {
+    GLuint t = p[(i >> 2) * stride + (i & 3)];
+    float a = w0[(idx >> (i << 1)) & 3], b = 1.0f - a, v[3] = { RED(t), GREEN(t), BLUE(t) };
+    aa += a * a;
+    bb += b * b;
+    ab += a * b;
+    for(c = 0; c < 3; ++c) {
+      ax[c] += a * v[c];
+      bx[c] += b * v[c];
+    }
+  }
+  if(fabsf(det = aa * bb - ab * ab) < 1e-6f)
+    return;
+  for(c = 0; c < 3; ++c) {
+    e0[c] = (ax[c] * bb - bx[c] * ab) / det;
+    e1[c] = (bx[c] * aa - ax[c] * ab) / det;
+  }
+  c0 = to_rgb565(e0);
+  c1 = to_rgb565(e1);
+  if(c0 == c1)
+    return;
+  /* la plus grande en premier, pour garder quatre couleurs */
+  r01 = c0 > c1 ? c0 | (c1 << 16) : c1 | (c0 << 16);
+  if(bc1_indices(p, stride, r01, &ridx) < err) {
+    out[0] = r01;
+    out[1] = ridx;
+  }
+}
+
+/*!\brief libère l'atlas \a a ; ses textures ne doivent plus servir */
+void atlas_free(atlas_t * a) {
+  if(!a)
+    return;
+  free(a->pixels);
+  free(a->tex);
+  free(a);
+}
@@ -0,0 +1,187 @@
+/*!\file bench.c
+ *
+ * \brief mesure reproductible des performances du moteur de rendu,
+ * sans fenêtre : chaque scène de scenes.c est rendue N frames à
+ * plusieurs résolutions et le débit obtenu est écrit au format JSON
+ * Lines (un objet par scène et par résolution).
+ *
+ * Usage : rasterizer_bench [-f frames] [-r WxH]... [-s scene]... [-j threads] [-v] [-S] [-a pas] [-c] [-q] [-m fichier.obj [-O]] [-o fichier]
+ * -j fixe le nombre de threads de l'ordonnanceur de tâches (voir
+ * jobs.c) : 1 par défaut, 0 pour un par cœur. -v enregistre chaque
+ * frame dans une display list jouée avec le visibility buffer (voir
+ * set_visibility_buffer). -S active le S-buffer (voir
+ * set_span_buffer). -a n'interpole exactement les attributs que tous
+ * les \a pas pixels (voir set_affine_span). -c compresse les textures
+ * en BC1 (voir atlas_compress), -q rend les maillages compacts (voir
+ * compact_surface). -m charge le maillage de la scène model (voir
+ * load_OBJ), réordonné avec -O ; une première ligne donne alors son
+ * temps de chargement.
+ *
+ * \author Farès BELHADJ, amsi@up8.edu
+ * \date November 2021.
+*/
+
+#include "scenes.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*!\brief nombre de frames rendues avant de commencer à mesurer */
+#define WARMUP_FRAMES 3
+/*!\brief nombre maximum de résolutions passées en argument */
+#define MAX_RES 16
+
+/*!\brief display list des frames rendues avec le visibility buffer
+ * (option -v), NULL pour un rendu direct */
+static dlist_t * _vlist = NULL;
+/*!\brief rendu avec le S-buffer (option -S), pas de
+ * l'interpolation exacte (option -a), textures compressées (option
+ * -c) et maillages compacts (option -q) */
+static int _sbuffer = 0, _affine = 0, _compress = 0, _compact = 0;
+
+/*!\brief rend la frame \a frame de la scène \a scene dans \a pixels
+ * (\a w x \a h), directement ou avec le visibility buffer ; renvoie
+ * le nombre de triangles soumis */
+static int draw(int scene, int frame, GLuint * pixels, int w, int h) {
+  int n;
+  if(!_vlist)
+    return scene_draw(scene, frame, pixels, w, h);
+  dlist_record(_vlist, w, h);
+  n = scene_draw(scene, frame, pixels, w, h);
+  dlist_record(NULL, 0, 0);
+  dlist_play(_vlist, pixels, w, h);
+  return n;
+}
+
+/*!\brief tri des durées de frames */
+static int cmp_double(const void * a, const void * b) {
+  double d = *(const double *)a - *(const double *)b;
+  return d < 0 ? -1 : d > 0;
+}
+
+/*!\brief renvoie le percentile \a p (de 0 à 100) des \a n valeurs
+ * triées \a v */
+static double percentile(const double * v, int n, double p) {
+  int i = (int)(p / 100.0 * (n - 1) + 0.5);
+  return v[MIN(MAX(i, 0), n - 1)];
+}
+
+/*!\brief rend \a nframes frames de la scène \a scene en \a w x \a h et
+ * écrit le résultat dans \a out */
+static void bench(FILE * out, int scene, int w, int h, int nframes) {
+  GLuint * pixels = malloc(w * h * sizeof *pixels);
+  double * ms = malloc(nframes * sizeof *ms), total = 0.0, freq = (double)SDL_GetPerformanceFrequency();
+  long long ntris = 0;
+  int i;
+  assert(pixels && ms);
+  for(i = 0; i < WARMUP_FRAMES; ++i)
+    draw(scene, i, pixels, w, h);
+  for(i = 0; i < nframes; ++i) {
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    ntris += draw(scene, i, pixels, w, h);
+    ms[i] = 1000.0 * (SDL_GetPerformanceCounter() - t0) / freq;
+    total += ms[i];
+  }
+  qsort(ms, nframes, sizeof *ms, cmp_double);
+  fprintf(out, "{\"scene\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, \"threads\": %d, \"visibility\": %d, \"sbuffer\": %d, \"affine\": %d, \"bc1\": %d, \"compact\": %d, "
+	  "\"ms_mean\": %.4f, \"ms_min\": %.4f, \"ms_p50\": %.4f, \"ms_p90\": %.4f, \"ms_p99\": %.4f, \"ms_max\": %.4f, "
+	  "\"triangles_per_frame\": %lld, \"triangles_per_s\": %.0f, \"pixels_per_s\": %.0f}\n",
+	  scene_name(scene), w, h, nframes, jobs_threads(), _vlist != NULL, _sbuffer, _affine, _compress, _compact,
+	  total / nframes, ms[0], percentile(ms, nframes, 50), percentile(ms, nframes, 90),
+	  percentile(ms, nframes, 99), ms[nframes - 1],
+	  ntris / nframes, ntris / (total / 1000.0), (double)w * h * nframes / (total / 1000.0));
+  fflush(out);
+  free(ms);
+  free(pixels);
+}
+
+/*!\brief affiche l'usage et quitte */
+static void usage(const char * prog) {
+  int i;
+  fprintf(stderr, "usage : %s [-f frames] [-r WxH]... [-s scene]... [-j threads] [-v] [-S] [-a pas] [-c] [-q] [-m fichier.obj [-O]] [-o fichier]\n  scènes :", prog);
+  for(i = 0; i < SCENE_COUNT; ++i)
+    fprintf(stderr, " %s", scene_name(i));
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+int main(int argc, char ** argv) {
+  int i, j, nframes = 60, nres = 0, res[MAX_RES][2], scenes[SCENE_COUNT], nscenes = 0, nthreads = 1, mflags = OBJ_NONE;
+  const char * model = NULL;
+  FILE * out = stdout;
+  for(i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "-f") && i + 1 < argc) {
+      if((nframes = atoi(argv[++i])) <= 0) usage(argv[0]);
+    } else if(!strcmp(argv[i], "-r") && i + 1 < argc && nres < MAX_RES) {
+      if(sscanf(argv[++i], "%dx%d", &res[nres][0], &res[nres][1]) != 2 || res[nres][0] <= 0 || res[nres][1] <= 0)
+	usage(argv[0]);
+      ++nres;
+    } else if(!strcmp(argv[i], "-s") && i + 1 < argc && nscenes < SCENE_COUNT) {
+      if((scenes[nscenes++] = scene_from_name(argv[++i])) < 0) usage(argv[0]);
+    } else if(!strcmp(argv[i], "-j") && i + 1 < argc) {
+      if((nthreads = atoi(argv[++i])) < 0) usage(argv[0]);
+    } else if(!strcmp(argv[i], "-v")) {
+      if(!_vlist) {
+	_vlist = dlist_new();
+	set_visibility_buffer(1);
+      }
+    } else if(!strcmp(argv[i], "-S")) {
+      _sbuffer = 1;
+      set_span_buffer(1);
+    } else if(!strcmp(argv[i], "-a") && i + 1 < argc) {
+      if((_affine = atoi(argv[++i])) < 0) usage(argv[0]);
+      set_affine_span(_affine);
+    } else if(!strcmp(argv[i], "-c")) {
+      _compress = 1;
+    } else if(!strcmp(argv[i], "-q")) {
+      _compact = 1;
+    } else if(!strcmp(argv[i], "-m") && i + 1 < argc) {
+      model = argv[++i];
+    } else if(!strcmp(argv[i], "-O")) {
+      mflags |= OBJ_OPTIMIZE;
+    } else if(!strcmp(argv[i], "-o") && i + 1 < argc) {
+      if(!(out = fopen(argv[++i], "w"))) {
+	perror(argv[i]);
+	return 1;
+      }
+    } else
+      usage(argv[0]);
+  }
+  if(!nres) {
+    const int def[][2] = { { 320, 240 }, { 800, 600 }, { 1280, 960 } };
+    for(nres = 0; nres < 3; ++nres) {
+      res[nres][0] = def[nres][0];
+      res[nres][1] = def[nres][1];
+    }
+  }
+  if(!nscenes)
+    for(i = 0; i < SCENE_COUNT; ++i)
+      if(i != SCENE_MODEL || model)
+	scenes[nscenes++] = i;
+  for(i = 0; i < nscenes; ++i)
+    if(scenes[i] == SCENE_MODEL && !model)
+      usage(argv[0]);
+  jobs_init(nthreads);
+  scenes_init();
+  if(model) {
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    int n = scenes_load_model(model, mflags | (_compact ? OBJ_COMPACT : OBJ_NONE));
+    if(!n)
+      return 1;
+    fprintf(out, "{\"model\": \"%s\", \"optimize\": %d, \"triangles\": %d, \"load_ms\": %.1f}\n", model, (mflags & OBJ_OPTIMIZE) != 0, n,
+	    1000.0 * (SDL_GetPerformanceCounter() - t0) / (double)SDL_GetPerformanceFrequency());
+  }
+  if(_compress)
+    scenes_compress_textures();
+  if(_compact)
+    scenes_compact_meshes();
+  for(i = 0; i < nscenes; ++i)
+    for(j = 0; j < nres; ++j)
+      bench(out, scenes[i], res[j][0], res[j][1], nframes);
+  scenes_quit();
+  jobs_quit();
+  dlist_free(_vlist);
+  if(out != stdout)
+    fclose(out);
+  return 0;
+}
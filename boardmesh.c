@@ -0,0 +1,248 @@
+/*!\file boardmesh.c
+ *
+ * \brief rendu du plateau par chunks aux maillages précalculés.
+ *
+ * Chaque chunk de CHUNK x CHUNK cases garde l'état de ses cases
+ * compacté sur 2 bits, sa boîte englobante et, par type de case
+ * (murs, briques), un maillage "cuit" : les cubes de ses cases déjà
+ * placés dans le repère du plateau, sans les faces du dessous ni
+ * celles collées à une case voisine de même type. Un chunk se dessine
+ * donc en un appel à transform_n_rasterize par type au lieu d'un par
+ * case, et seuls les chunks non vides et dans le frustum sont
+ * dessinés. Les maillages des chunks visibles sont refaits puis
+ * transformés en parallèle (voir jobs.c) avant d'être rastérisés dans
+ * l'ordre.
+ *
+ * bmesh_update compare les versions des chunks du plateau (voir
+ * level.c) à celles déjà vues : un chunk modifié est recompacté et
+ * marqué sale, ainsi que ses voisins si l'une de ses cases de bord a
+ * changé (leurs faces communes en dépendent). Le maillage d'un chunk
+ * sale n'est refait qu'au moment de le dessiner, s'il est visible.
+ *
+ * Compactés (voir compact_surface), les maillages de tous les chunks
+ * sont quantifiés sur un même réseau, centré sur le plateau et de pas
+ * une puissance de 2 : les coordonnées des sommets, entières, y sont
+ * exactes, et les chunks voisins restent jointifs.
+ *
+ * \author VILFEU Vincent
+ */
+#include "game.h"
+#include <assert.h>
+
+/*!\brief hauteur (y) du centre des cubes de chaque type de case */
+static const float _ycell[] = { 0.0f, 0.0f, -1.0f };
+
+static int  chunk_pack(bmesh_t * m, const board_t * b, int ci, int cj);
+static int  chunk_get(const bmesh_t * m, int i, int j);
+static void chunk_bake(bmesh_t * m, int ci, int cj);
+static void bake_range(void * data, int i0, int i1);
+
+/*!\brief initialise \a m, vide ; il prendra les dimensions du
+ * plateau au premier bmesh_update */
+void bmesh_init(bmesh_t * m) {
+  memset(m, 0, sizeof *m);
+  m->cube = mk_cube();
+}
+
+/*!\brief libère les chunks et les maillages de \a m */
+void bmesh_free(bmesh_t * m) {
+  int k, t;
+  for(k = 0; k < m->cw * m->ch; ++k)
+    for(t = 0; t < 2; ++t)
+      if(m->chunks[k].mesh[t])
+	free_surface(m->chunks[k].mesh[t]);
+  free(m->chunks);
+  free(m->todo);
+  free(m->draw);
+  if(m->cube)
+    free_surface(m->cube);
+  memset(m, 0, sizeof *m);
+}
+
+/*!\brief met \a m à jour d'après le plateau \a b : les chunks dont la
+ * version a changé sont recompactés et marqués sales (voir l'en-tête
+ * du fichier) ; tout est refait si les dimensions ont changé. Renvoie
+ * le nombre de chunks modifiés, dont le flag changed est levé
+ * jusqu'à l'appel suivant. */
+int bmesh_update(bmesh_t * m, const board_t * b) {
+  int ci, cj, k, t, n = 0;
+  if(m->w != b->w || m->h != b->h) {
+    for(k = 0; k < m->cw * m->ch; ++k)
+      for(t = 0; t < 2; ++t)
+	if(m->chunks[k].mesh[t])
+	  free_surface(m->chunks[k].mesh[t]);
+    free(m->chunks);
+    free(m->todo);
+    free(m->draw);
+    m->w = b->w;
+    m->h = b->h;
+    m->cw = b->cw;
+    m->ch = b->ch;
+    /* le plus petit pas en puissance de 2 pour lequel 16 bits
+       couvrent le plateau, cubes du bord compris */
+    m->qscale = 1.0f / 65536.0f;
+    while(32767.0f * m->qscale < MAX(m->w, m->h) + 2.0f)
+      m->qscale *= 2.0f;
+    m->chunks = calloc(m->cw * m->ch, sizeof *m->chunks);
+    m->todo = malloc(m->cw * m->ch * sizeof *m->todo);
+    m->draw = malloc(m->cw * m->ch * sizeof *m->draw);
+    assert(m->chunks && m->todo && m->draw);
+    for(k = 0; k < m->cw * m->ch; ++k) {
+      m->chunks[k].version = b->cversion[k] - 1;
+      m->chunks[k].dirty = 1;
+    }
+  }
+  for(ci = 0; ci < m->ch; ++ci)
+    for(cj = 0; cj < m->cw; ++cj) {
+      k = ci * m->cw + cj;
+      m->chunks[k].changed = m->chunks[k].version != b->cversion[k];
+      if(!m->chunks[k].changed)
+	continue;
+      ++n;
+      m->chunks[k].version = b->cversion[k];
+      m->chunks[k].dirty = 1;
+      if(chunk_pack(m, b, ci, cj)) {
+	if(ci > 0)          m->chunks[k - m->cw].dirty = 1;
+	if(ci < m->ch - 1)  m->chunks[k + m->cw].dirty = 1;
+	if(cj > 0)          m->chunks[k - 1].dirty = 1;
+	if(cj < m->cw - 1)  m->chunks[k + 1].dirty = 1;
+      }
+    }
+  return n;
+}
+
+/*!\brief dessine les cases de type \a type (CELL_WALL ou CELL_BRICK)
+ * des chunks non vides et visibles de \a m, avec l'apparence
+ * (texture, couleurs, options) de la surface \a look ; renvoie le
+ * nombre de triangles soumis */
+int bmesh_draw(bmesh_t * m, int type, const surface_t * look, float * view, float * proj) {
+  int k, nv = 0, nd = 0, n = 0;
+  assert(type == CELL_WALL || type == CELL_BRICK);
+  for(k = 0; k < m->cw * m->ch; ++k) {
+    chunk_t * c = &m->chunks[k];
+    if(!c->count[type] || !box_in_frustum(view, proj, c->bmin, c->bmax))
+      continue;
+    m->todo[nv++] = k;
+    nd += c->dirty;
+  }
+  /* un maillage ne dépend que des cases compactées, qui ne changent
+     pas pendant la cuisson : les chunks sales sont refaits en
+     parallèle */
+  if(nd)
+    jobs_parallel_for(nv, 1, bake_range, m);
+  for(k = 0; k < nv; ++k) {
+    surface_t * s = m->chunks[m->todo[k]].mesh[type - CELL_WALL];
+    if(!s->n)
+      continue;
+    s->tex_id = look->tex_id;
+    s->tex = look->tex;
+    s->dcolor = look->dcolor;
+    s->scolor = look->scolor;
+    s->shininess = look->shininess;
+    if(s->options != look->options) {
+      s->options = look->options;
+      updatesfuncs(s);
+    }
+    m->draw[n++] = s;
+  }
+  return transform_n_rasterize_surfaces(m->draw, n, view, proj);
+}
+
+/*!\brief la tâche de \ref bmesh_draw : refait les maillages des
+ * chunks sales parmi m->todo[\a i0] à m->todo[\a i1 - 1] */
+void bake_range(void * data, int i0, int i1) {
+  bmesh_t * m = data;
+  int i;
+  for(i = i0; i < i1; ++i)
+    if(m->chunks[m->todo[i]].dirty)
+      chunk_bake(m, m->todo[i] / m->cw, m->todo[i] % m->cw);
+}
+
+/*!\brief compacte dans le chunk (\a ci, \a cj) de \a m l'état de ses
+ * cases dans \a b et met à jour ses compteurs et sa boîte englobante ;
+ * renvoie 1 si une case du bord du chunk a changé */
+int chunk_pack(bmesh_t * m, const board_t * b, int ci, int cj) {
+  chunk_t * c = &m->chunks[ci * m->cw + cj];
+  int i, j, i0 = ci << CHUNK_SHIFT, j0 = cj << CHUNK_SHIFT, border = 0, imin = CHUNK, imax = -1, jmin = CHUNK, jmax = -1;
+  float ylo = 1.0f, yhi = -2.0f;
+  c->count[CELL_EMPTY] = c->count[CELL_WALL] = c->count[CELL_BRICK] = 0;
+  for(i = 0; i < CHUNK; ++i)
+    for(j = 0; j < CHUNK; ++j) {
+      int o = i * CHUNK + j, v = 0, old = (c->packed[o >> 2] >> ((o & 3) << 1)) & 3;
+      if(i0 + i < b->h && j0 + j < b->w)
+	v = b->cells[(i0 + i) * b->w + j0 + j];
+      if(v != old) {
+	c->packed[o >> 2] = (unsigned char)((c->packed[o >> 2] & ~(3 << ((o & 3) << 1))) | (v << ((o & 3) << 1)));
+	border |= i == 0 || j == 0 || i == CHUNK - 1 || j == CHUNK - 1;
+      }
+      ++c->count[v];
+      if(v == CELL_EMPTY)
+	continue;
+      imin = MIN(imin, i); imax = MAX(imax, i);
+      jmin = MIN(jmin, j); jmax = MAX(jmax, j);
+      ylo = MIN(ylo, _ycell[v] - 1.0f);
+      yhi = MAX(yhi, _ycell[v] + 1.0f);
+    }
+  if(imax >= 0) {
+    c->bmin[0] = 2.0f * (j0 + jmin) - b->w - 1.0f;
+    c->bmax[0] = 2.0f * (j0 + jmax) - b->w + 1.0f;
+    c->bmin[1] = ylo;
+    c->bmax[1] = yhi;
+    c->bmin[2] = 2.0f * (i0 + imin) - b->h - 1.0f;
+    c->bmax[2] = 2.0f * (i0 + imax) - b->h + 1.0f;
+  }
+  return border;
+}
+
+/*!\brief renvoie l'état compacté de la case (\a i, \a j) du plateau,
+ * CELL_EMPTY hors du plateau */
+int chunk_get(const bmesh_t * m, int i, int j) {
+  const chunk_t * c;
+  int o;
+  if(i < 0 || j < 0 || i >= m->h || j >= m->w)
+    return CELL_EMPTY;
+  c = &m->chunks[(i >> CHUNK_SHIFT) * m->cw + (j >> CHUNK_SHIFT)];
+  o = (i & (CHUNK - 1)) * CHUNK + (j & (CHUNK - 1));
+  return (c->packed[o >> 2] >> ((o & 3) << 1)) & 3;
+}
+
+/*!\brief refait les maillages du chunk (\a ci, \a cj) de \a m : pour
+ * chaque case pleine, les faces du cube unitaire translaté, hormis
+ * celle du dessous (le plateau est toujours vu d'en haut) et celles
+ * qui touchent une case de même type */
+void chunk_bake(bmesh_t * m, int ci, int cj) {
+  chunk_t * c = &m->chunks[ci * m->cw + cj];
+  int t, i, j, f, k, n;
+  for(t = CELL_WALL; t <= CELL_BRICK; ++t) {
+    surface_t * s = c->mesh[t - CELL_WALL];
+    if(!s)
+      s = c->mesh[t - CELL_WALL] = new_surface(NULL, 0, 0, 1);
+    s->t = realloc(s->t, MAX(c->count[t], 1) * m->cube->n * sizeof *s->t);
+    assert(s->t);
+    for(n = 0, i = ci << CHUNK_SHIFT; i < MIN((ci + 1) << CHUNK_SHIFT, m->h); ++i)
+      for(j = cj << CHUNK_SHIFT; j < MIN((cj + 1) << CHUNK_SHIFT, m->w); ++j) {
+	float x = 2.0f * j - m->w, y = _ycell[t], z = 2.0f * i - m->h;
+	if(chunk_get(m, i, j) != t)
+	  continue;
+	for(f = 0; f < m->cube->n; ++f) {
+	  const vec3 * nf = &m->cube->t[f].v[0].normal;
+	  int ni = i + (nf->z > 0.5f) - (nf->z < -0.5f), nj = j + (nf->x > 0.5f) - (nf->x < -0.5f);
+	  if(nf->y < -0.5f || ((ni != i || nj != j) && chunk_get(m, ni, nj) == t))
+	    continue;
+	  s->t[n] = m->cube->t[f];
+	  for(k = 0; k < 3; ++k) {
+	    s->t[n].v[k].position.x += x;
+	    s->t[n].v[k].position.y += y;
+	    s->t[n].v[k].position.z += z;
+	  }
+	  ++n;
+	}
+      }
+    s->n = n;
+    if(m->compact) {
+      static const float origin[3] = { 0.0f, 0.0f, 0.0f };
+      compact_surface_lattice(s, origin, m->qscale);
+    }
+  }
+  c->dirty = 0;
+}
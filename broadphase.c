@@ -0,0 +1,238 @@
+/*!\file broadphase.c
+ *
+ * \brief stockage des balles en structure de tableaux et phase large
+ * des collisions balle-balle par grille uniforme.
+ *
+ * La grille est reconstruite à chaque pas par un tri par comptage :
+ * un histogramme des cases, sa somme préfixe, puis la dispersion des
+ * indices de balles ; le tout est linéaire en nombre de balles et ne
+ * fait aucune allocation une fois la capacité atteinte. Avec des
+ * cases d'au moins un diamètre de balle, deux balles en contact sont
+ * dans la même case ou dans deux cases voisines.
+ *
+ * La recherche des paires est découpée en bandes de lignes de cases
+ * traitées en parallèle (voir jobs.c) ; les paires de chaque bande
+ * sont gardées puis passées dans l'ordre, le même qu'en mono-thread,
+ * si bien que la simulation ne dépend pas du nombre de threads.
+ *
+ * \author VILFEU Vincent
+ */
+#include "game.h"
+#include <assert.h>
+
+/*!\brief lignes de cases par bande de \ref grid_pairs */
+#define PAIRS_ROWS 8
+
+/*!\brief une bande de lignes de cases de \ref grid_pairs et les
+ * paires qu'on y a trouvées */
+struct gpairs_t {
+  const grid_t * g;
+  const float * x, * z;
+  float d2;
+  int * p;        /* n paires (i, j) */
+  int n, cap;
+};
+
+static int  rows_pairs(const grid_t * g, const float * x, const float * z, float d2, int cz0, int cz1, void (*f)(int, int, void *), void * data);
+static void keep_pair(int i, int j, void * data);
+static void bands_pairs(void * data, int b0, int b1);
+
+/*!\brief agrandit les tableaux de \a b pour contenir au moins \a n
+ * balles */
+void balls_reserve(balls_t * b, int n) {
+  int cap = b->cap ? b->cap : 64;
+  if(n <= b->cap)
+    return;
+  while(cap < n)
+    cap *= 2;
+  b->x  = realloc(b->x,  cap * sizeof *b->x);
+  b->z  = realloc(b->z,  cap * sizeof *b->z);
+  b->px = realloc(b->px, cap * sizeof *b->px);
+  b->pz = realloc(b->pz, cap * sizeof *b->pz);
+  b->vx = realloc(b->vx, cap * sizeof *b->vx);
+  b->vz = realloc(b->vz, cap * sizeof *b->vz);
+  assert(b->x && b->z && b->px && b->pz && b->vx && b->vz);
+  b->cap = cap;
+}
+
+/*!\brief ajoute une balle en (\a x, \a z) de vitesse (\a vx, \a vz) ;
+ * renvoie son indice */
+int balls_add(balls_t * b, float x, float z, float vx, float vz) {
+  balls_reserve(b, b->n + 1);
+  b->x[b->n] = b->px[b->n] = x;
+  b->z[b->n] = b->pz[b->n] = z;
+  b->vx[b->n] = vx;
+  b->vz[b->n] = vz;
+  return b->n++;
+}
+
+/*!\brief retire la balle \a i, remplacée par la dernière */
+void balls_remove(balls_t * b, int i) {
+  int l = --b->n;
+  b->x[i]  = b->x[l];
+  b->z[i]  = b->z[l];
+  b->px[i] = b->px[l];
+  b->pz[i] = b->pz[l];
+  b->vx[i] = b->vx[l];
+  b->vz[i] = b->vz[l];
+}
+
+/*!\brief libère les tableaux de \a b */
+void balls_free(balls_t * b) {
+  free(b->x);
+  free(b->z);
+  free(b->px);
+  free(b->pz);
+  free(b->vx);
+  free(b->vz);
+  memset(b, 0, sizeof *b);
+}
+
+/*!\brief initialise une grille de \a w x \a h cases de côté \a cell
+ * dont le coin est en (\a ox, \a oz) ; les positions hors de la
+ * grille sont ramenées dans les cases du bord */
+void grid_init(grid_t * g, int w, int h, float ox, float oz, float cell) {
+  memset(g, 0, sizeof *g);
+  g->w = w;
+  g->h = h;
+  g->ox = ox;
+  g->oz = oz;
+  g->cell = cell;
+  g->start = calloc(w * h + 1, sizeof *g->start);
+  g->nbands = (h + PAIRS_ROWS - 1) / PAIRS_ROWS;
+  g->bands = calloc(g->nbands, sizeof *g->bands);
+  assert(g->start && g->bands);
+}
+
+/*!\brief libère la grille \a g */
+void grid_free(grid_t * g) {
+  int i;
+  free(g->start);
+  free(g->idx);
+  free(g->cellof);
+  for(i = 0; i < g->nbands; ++i)
+    free(g->bands[i].p);
+  free(g->bands);
+  memset(g, 0, sizeof *g);
+}
+
+/*!\brief range les \a n positions (\a x, \a z) dans la grille \a g
+ * (tri par comptage) : les balles de la case c sont alors g->idx[
+ * g->start[c] ] à g->idx[ g->start[c + 1] - 1 ] */
+void grid_build(grid_t * g, const float * x, const float * z, int n) {
+  int i, c, nc = g->w * g->h;
+  float ic = 1.0f / g->cell;
+  if(n > g->cap) {
+    g->cap = n;
+    g->idx = realloc(g->idx, n * sizeof *g->idx);
+    g->cellof = realloc(g->cellof, n * sizeof *g->cellof);
+    assert(g->idx && g->cellof);
+  }
+  memset(g->start, 0, (nc + 1) * sizeof *g->start);
+  for(i = 0; i < n; ++i) {
+    int cx = (int)((x[i] - g->ox) * ic), cz = (int)((z[i] - g->oz) * ic);
+    cx = MIN(MAX(cx, 0), g->w - 1);
+    cz = MIN(MAX(cz, 0), g->h - 1);
+    g->cellof[i] = c = cz * g->w + cx;
+    ++g->start[c + 1];
+  }
+  for(c = 0; c < nc; ++c)
+    g->start[c + 1] += g->start[c];
+  /* dispersion : start[c] sert de curseur puis est rétabli */
+  for(i = 0; i < n; ++i)
+    g->idx[g->start[g->cellof[i]]++] = i;
+  for(c = nc; c > 0; --c)
+    g->start[c] = g->start[c - 1];
+  g->start[0] = 0;
+}
+
+/*!\brief appelle \a f(i, j, data) pour chaque paire de balles dont
+ * les centres sont à moins de \a d l'un de l'autre (\a d ne doit pas
+ * dépasser le côté d'une case). Chaque case n'est comparée qu'à
+ * elle-même et à quatre de ses voisines (est, sud-ouest, sud et
+ * sud-est), chaque paire est donc produite une seule fois ; renvoie
+ * le nombre de paires. */
+int grid_pairs(const grid_t * g, const float * x, const float * z, float d, void (*f)(int, int, void *), void * data) {
+  int b, k, np = 0;
+  if(jobs_threads() <= 1 || g->nbands <= 1)
+    return rows_pairs(g, x, z, d * d, 0, g->h, f, data);
+  for(b = 0; b < g->nbands; ++b) {
+    g->bands[b].g = g;
+    g->bands[b].x = x;
+    g->bands[b].z = z;
+    g->bands[b].d2 = d * d;
+  }
+  jobs_parallel_for(g->nbands, 1, bands_pairs, g->bands);
+  for(b = 0; b < g->nbands; ++b) {
+    for(k = 0; k < g->bands[b].n; ++k)
+      f(g->bands[b].p[2 * k], g->bands[b].p[2 * k + 1], data);
+    np += g->bands[b].n;
+  }
+  return np;
+}
+
+/*!\brief la tâche de \ref grid_pairs : cherche les paires des bandes
+ * [\a b0, \a b1[ */
+void bands_pairs(void * data, int b0, int b1) {
+  gpairs_t * bp = data;
+  int b;
+  for(b = b0; b < b1; ++b) {
+    gpairs_t * p = &bp[b];
+    p->n = 0;
+    rows_pairs(p->g, p->x, p->z, p->d2, b * PAIRS_ROWS, MIN((b + 1) * PAIRS_ROWS, p->g->h), keep_pair, p);
+  }
+}
+
+/*!\brief garde la paire (\a i, \a j) dans la bande \a data */
+void keep_pair(int i, int j, void * data) {
+  gpairs_t * p = data;
+  if(p->n == p->cap) {
+    p->cap = p->cap ? 2 * p->cap : 64;
+    p->p = realloc(p->p, 2 * p->cap * sizeof *p->p);
+    assert(p->p);
+  }
+  p->p[2 * p->n] = i;
+  p->p[2 * p->n + 1] = j;
+  ++p->n;
+}
+
+/*!\brief le travail de \ref grid_pairs sur les lignes de cases [\a
+ * cz0, \a cz1[, \a d2 étant le carré de la distance */
+int rows_pairs(const grid_t * g, const float * x, const float * z, float d2, int cz0, int cz1, void (*f)(int, int, void *), void * data) {
+  static const int nb[4][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+  int cx, cz, k, a, b, np = 0;
+  for(cz = cz0; cz < cz1; ++cz)
+    for(cx = 0; cx < g->w; ++cx) {
+      int c = cz * g->w + cx, s0 = g->start[c], e0 = g->start[c + 1];
+      if(s0 == e0)
+	continue;
+      for(a = s0; a < e0; ++a) {
+	int i = g->idx[a];
+	/* dans la case */
+	for(b = a + 1; b < e0; ++b) {
+	  int j = g->idx[b];
+	  float dx = x[j] - x[i], dz = z[j] - z[i];
+	  if(dx * dx + dz * dz < d2) {
+	    f(i, j, data);
+	    ++np;
+	  }
+	}
+	/* avec les voisines "en avant" */
+	for(k = 0; k < 4; ++k) {
+	  int nx = cx + nb[k][0], nz = cz + nb[k][1], c2;
+	  if(nx < 0 || nx >= g->w || nz >= g->h)
+	    continue;
+	  c2 = nz * g->w + nx;
+	  for(b = g->start[c2]; b < g->start[c2 + 1]; ++b) {
+	    int j = g->idx[b];
+	    float dx = x[j] - x[i], dz = z[j] - z[i];
+	    if(dx * dx + dz * dz < d2) {
+	      f(i, j, data);
+	      ++np;
+	    }
+	  }
+	}
+      }
+    }
+  return np;
+}
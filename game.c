@@ -0,0 +1,622 @@
+/*!\file game.c
+ *
+ * \brief simulation du casse-briques à pas de temps fixe.
+ *
+ * La simulation avance par pas de GAME_DT quel que soit le rythme
+ * du rendu : game_update accumule le temps écoulé et enchaîne autant
+ * de pas que nécessaire. Le rendu lit un état interpolé entre les
+ * deux derniers pas (game_get_state). Dans le mode "threadé", la
+ * simulation tourne dans son propre thread et publie ses états sous
+ * mutex ; game_update ne fait alors rien.
+ *
+ * Les collisions sont continues : la balle (un cercle dans le plan
+ * x-z) est balayée le long de sa trajectoire contre les boîtes des
+ * cases du plateau et de la raquette, ce qui donne l'instant exact
+ * de l'impact ; seules les cases traversées (parcours DDA de la
+ * grille) et leurs voisines sont testées.
+ *
+ * Les balles supplémentaires (multiballe) sont rangées en structure
+ * de tableaux ; chacune suit le même balayage contre le plateau et
+ * la raquette, et leurs paires en contact sont produites par la
+ * grille uniforme de broadphase.c.
+ *
+ * Le plateau (niveau d'origine ou fichier, voir level.c) est découpé
+ * en chunks ; le rendu n'en reçoit que les chunks modifiés.
+ *
+ * \author VILFEU Vincent
+ */
+#include "game.h"
+#include <assert.h>
+
+/*!\brief taille de la file des entrées en attente */
+#define INPUT_QUEUE 64
+
+/*!\brief les deux derniers états produits */
+static game_state_t _prev, _cur;
+/*!\brief temps accumulé non encore simulé, en secondes */
+static double _acc = 0.0;
+/*!\brief instant du dernier game_update et du dernier pas */
+static Uint64 _t0 = 0, _tstep = 0;
+/*!\brief nombre maximum de cases de la grille de phase large par
+ * côté */
+#define GRID_MAX 256
+
+/*!\brief le plateau modifié par la simulation, sa dernière version
+ * publiée et la copie lue par le rendu */
+static board_t _board, _pboard, _rboard;
+/*!\brief les balles supplémentaires, leur grille de phase large,
+ * leur dernière version publiée et leurs positions interpolées pour
+ * le rendu (x, y, z par balle) */
+static balls_t _balls, _pballs;
+static grid_t _grid;
+static float * _rxyz = NULL;
+static int _rn = 0, _rcap = 0;
+/*!\brief graine du générateur (déterministe) des balles ajoutées */
+static unsigned _seed = 1;
+/*!\brief l'enregistrement en cours (NULL si aucun) */
+static replay_t * _rec = NULL;
+/*!\brief la simulation est menée par game_steps, sans horloge */
+static int _headless = 0;
+/*!\brief entrées en attente du prochain pas */
+static ginput_t _inputs[INPUT_QUEUE];
+static int _ninputs = 0;
+/*!\brief protège les états publiés et les entrées */
+static SDL_mutex * _mutex = NULL;
+/*!\brief le thread de simulation (mode threadé) et son drapeau de fin */
+static SDL_Thread * _thread = NULL;
+static SDL_atomic_t _quit;
+
+static void advance(void);
+static int  sim_thread(void * data);
+static int  sweep_box(vec2 p, vec2 v, float r, float x0, float z0, float x1, float z1, float tmax, float * t, vec2 * n);
+static int  sweep_board(const board_t * b, vec2 p, vec2 v, float r, float tmax, float * t, vec2 * n, int * cell);
+static int  move_ball(game_state_t * s, vec2 * p, vec2 * v, float r, float dt);
+static void spawn_balls(int n);
+static void collide(int i, int j, void * data);
+static void publish_balls(void);
+static void sim_step(const ginput_t * in, int n, float dt);
+static unsigned fnv1a(unsigned h, const void * data, size_t n);
+
+/*!\brief initialise la simulation sur le niveau \a level (fichier
+ * binaire, voir level.c ; le niveau d'origine si NULL ou vide), avec
+ * \a nballs balles supplémentaires ; si \a threaded est vrai, la
+ * simulation tourne dans son propre thread. Renvoie 0 si le niveau
+ * n'a pu être chargé. */
+int game_init(const char * level, int threaded, int nballs) {
+  game_state_t s = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, 0, 0, 0 };
+  float cell;
+  if(level && *level) {
+    if(!level_load(&_board, level))
+      return 0;
+  } else
+    level_builtin(&_board);
+  board_copy(&_pboard, &_board);
+  board_copy(&_rboard, &_board);
+  /* balle et raquette au même endroit par rapport au bas du plateau
+     que sur le niveau d'origine */
+  s.balle.y = _board.h - 12.0f;
+  s.raquette.y = _board.h - 5.0f;
+  s.bricks = board_count(&_board, CELL_BRICK);
+  _prev = _cur = s;
+  /* des cases de deux diamètres de balle, alignées sur le plateau,
+     agrandies si le plateau en demanderait plus de GRID_MAX par côté */
+  cell = MAX(4.0f * GAME_MBALL_R, MAX(_board.w, _board.h) * GAME_CELL / GRID_MAX);
+  grid_init(&_grid, (int)ceilf(_board.w * GAME_CELL / cell), (int)ceilf(_board.h * GAME_CELL / cell),
+	    -_board.w - GAME_CELL / 2.0f, -_board.h - GAME_CELL / 2.0f, cell);
+  _seed = 1;
+  spawn_balls(nballs);
+  publish_balls();
+  _acc = 0.0;
+  _t0 = _tstep = 0;
+  _ninputs = 0;
+  _headless = 0;
+  _rec = NULL;
+  _mutex = SDL_CreateMutex();
+  assert(_mutex);
+  if(threaded) {
+    SDL_AtomicSet(&_quit, 0);
+    _thread = SDL_CreateThread(sim_thread, "simulation", NULL);
+    assert(_thread);
+  }
+  return 1;
+}
+
+/*!\brief arrête le thread de simulation s'il existe */
+void game_quit(void) {
+  if(_thread) {
+    SDL_AtomicSet(&_quit, 1);
+    SDL_WaitThread(_thread, NULL);
+    _thread = NULL;
+  }
+  if(_mutex) {
+    SDL_DestroyMutex(_mutex);
+    _mutex = NULL;
+  }
+  board_free(&_board);
+  board_free(&_pboard);
+  board_free(&_rboard);
+  balls_free(&_balls);
+  balls_free(&_pballs);
+  grid_free(&_grid);
+  free(_rxyz);
+  _rxyz = NULL;
+  _rn = _rcap = 0;
+}
+
+/*!\brief met l'entrée \a in en attente du prochain pas */
+void game_input(ginput_t in) {
+  SDL_LockMutex(_mutex);
+  if(_ninputs < INPUT_QUEUE)
+    _inputs[_ninputs++] = in;
+  SDL_UnlockMutex(_mutex);
+}
+
+/*!\brief fait avancer la simulation du temps écoulé depuis le
+ * dernier appel (sans effet dans le mode threadé) */
+void game_update(void) {
+  if(!_thread)
+    advance();
+}
+
+/*!\brief renvoie dans \a out l'état à afficher, interpolé entre les
+ * deux derniers pas selon le temps écoulé depuis le dernier */
+void game_get_state(game_state_t * out) {
+  game_state_t p, c;
+  double a;
+  SDL_LockMutex(_mutex);
+  p = _prev;
+  c = _cur;
+  a = _headless ? 1.0 : _thread ? (SDL_GetPerformanceCounter() - _tstep) / (double)SDL_GetPerformanceFrequency() / GAME_DT : _acc / GAME_DT;
+  a = MIN(MAX(a, 0.0), 1.0);
+  if(_rboard.version != _pboard.version)
+    board_copy(&_rboard, &_pboard);
+  if(_pballs.n > _rcap) {
+    _rcap = _pballs.cap;
+    _rxyz = realloc(_rxyz, 3 * _rcap * sizeof *_rxyz);
+    assert(_rxyz);
+  }
+  for(_rn = 0; _rn < _pballs.n; ++_rn) {
+    _rxyz[3 * _rn]     = _pballs.px[_rn] + (float)a * (_pballs.x[_rn] - _pballs.px[_rn]);
+    _rxyz[3 * _rn + 1] = -1.0f;
+    _rxyz[3 * _rn + 2] = _pballs.pz[_rn] + (float)a * (_pballs.z[_rn] - _pballs.pz[_rn]);
+  }
+  SDL_UnlockMutex(_mutex);
+  *out = c;
+  if(c.teleport)
+    return;
+  out->balle.x = p.balle.x + a * (c.balle.x - p.balle.x);
+  out->balle.y = p.balle.y + a * (c.balle.y - p.balle.y);
+  out->raquette.x = p.raquette.x + a * (c.raquette.x - p.raquette.x);
+  out->raquette.y = p.raquette.y + a * (c.raquette.y - p.raquette.y);
+}
+
+/*!\brief renvoie le plateau à afficher, tel qu'au dernier appel à
+ * game_get_state */
+const board_t * game_board(void) {
+  return &_rboard;
+}
+
+/*!\brief renvoie les positions (x, y, z) des \a n balles
+ * supplémentaires à afficher, telles qu'au dernier appel à
+ * game_get_state */
+const float * game_balls(int * n) {
+  *n = _rn;
+  return _rxyz;
+}
+
+/*!\brief applique l'entrée \a in à l'état \a s */
+void game_apply_input(game_state_t * s, ginput_t in) {
+  switch(in) {
+  case GI_RIGHT:
+    if (s->raquette.x <= _board.w - 6)
+      s->raquette.x += 0.7f;
+    break;
+  case GI_LEFT:
+    if (s->raquette.x >= -_board.w + 4)
+      s->raquette.x -= 0.7f;
+    break;
+  case GI_LAUNCH:
+    s->vitesse.x = -15.0f;
+    s->vitesse.y = -15.0f;
+    break;
+  case GI_MULTIBALL:
+    spawn_balls(GAME_MULTIBALL);
+    break;
+  }
+}
+
+/*!\brief avance l'état \a s de \a dt secondes : les balles
+ * avancent (voir move_ball), celles qui ont franchi le bas du
+ * plateau sont perdues, puis les balles supplémentaires en contact
+ * échangent leurs vitesses */
+void game_step(game_state_t * s, float dt) {
+  vec2 p = { s->balle.x, s->balle.y }, v = s->vitesse;
+  int i;
+  s->teleport = 0;
+  ++s->step;
+  if(!move_ball(s, &p, &v, GAME_BALL_R, dt)) {
+    s->balle.x = 0.0f;
+    s->balle.y = _board.h - 12.0f;
+    s->vitesse.y = 0.0;
+    s->vitesse.x = 0.0;
+    s->teleport = 1;
+  } else {
+    s->balle.x = p.x;
+    s->balle.y = p.y;
+    s->vitesse = v;
+  }
+  /* à rebours, une balle perdue est remplacée par une balle déjà
+     traitée */
+  for(i = _balls.n - 1; i >= 0; --i) {
+    p.x = _balls.px[i] = _balls.x[i];
+    p.y = _balls.pz[i] = _balls.z[i];
+    v.x = _balls.vx[i];
+    v.y = _balls.vz[i];
+    if(!move_ball(s, &p, &v, GAME_MBALL_R, dt)) {
+      balls_remove(&_balls, i);
+      continue;
+    }
+    _balls.x[i] = p.x;
+    _balls.z[i] = p.y;
+    _balls.vx[i] = v.x;
+    _balls.vz[i] = v.y;
+  }
+  if(_balls.n > 1) {
+    grid_build(&_grid, _balls.x, _balls.z, _balls.n);
+    grid_pairs(&_grid, _balls.x, _balls.z, 2.0f * GAME_MBALL_R, collide, &_balls);
+  }
+}
+
+/*!\brief avance la balle de rayon \a r, en \a p et de vitesse \a v,
+ * de \a dt secondes : elle avance jusqu'au premier impact (case du
+ * plateau ou raquette de \a s), rebondit (une brique touchée est
+ * détruite) et repart avec le temps restant, dans la limite de
+ * GAME_MAX_BOUNCES rebonds ; renvoie 0 si la balle a franchi le bas
+ * du plateau. */
+int move_ball(game_state_t * s, vec2 * p, vec2 * v, float r, float dt) {
+  vec2 n = { 0.0f, 0.0f }, np;
+  float rem = dt, t, tp, vn;
+  int k, hit, cell = -1;
+  for(k = 0; k < GAME_MAX_BOUNCES && rem > 0.0f; ++k) {
+    hit = sweep_board(&_board, *p, *v, r, rem, &t, &n, &cell);
+    if(sweep_box(*p, *v, r, s->raquette.x - GAME_PADDLE_HW, s->raquette.y - GAME_PADDLE_HD,
+		 s->raquette.x + GAME_PADDLE_HW, s->raquette.y + GAME_PADDLE_HD, hit ? t : rem, &tp, &np)) {
+      t = tp;
+      n = np;
+      cell = -1;
+      hit = 1;
+    }
+    if(!hit) {
+      p->x += v->x * rem;
+      p->y += v->y * rem;
+      break;
+    }
+    p->x += v->x * t;
+    p->y += v->y * t;
+    vn = v->x * n.x + v->y * n.y;
+    v->x -= 2.0f * vn * n.x;
+    v->y -= 2.0f * vn * n.y;
+    rem -= t;
+    if(cell >= 0 && _board.cells[cell] == CELL_BRICK) {
+      board_set(&_board, cell / _board.w, cell % _board.w, CELL_EMPTY);
+      --s->bricks;
+    }
+  }
+  return p->y - r <= _board.h - 1;
+}
+
+/*!\brief ajoute \a n balles supplémentaires, placées et lancées au
+ * hasard (générateur congruentiel, reproductible) dans la zone vide
+ * au-dessus de la raquette */
+void spawn_balls(int n) {
+  int i;
+  balls_reserve(&_balls, _balls.n + n);
+  for(i = 0; i < n; ++i) {
+    float u[3];
+    int k;
+    for(k = 0; k < 3; ++k) {
+      _seed = _seed * 1664525u + 1013904223u;
+      u[k] = (_seed >> 8) / (float)(1 << 24);
+    }
+    balls_add(&_balls, 2.0f - _board.w + (2.0f * _board.w - 6.0f) * u[0], _board.h - 20.0f + 10.0f * u[1],
+	      15.0f * cosf((float)M_PI * (1.1f + 0.8f * u[2])), 15.0f * sinf((float)M_PI * (1.1f + 0.8f * u[2])));
+  }
+}
+
+/*!\brief choc élastique entre les balles \a i et \a j de même masse
+ * : si elles se rapprochent, elles échangent la composante de leurs
+ * vitesses selon la normale du contact. Les positions ne sont pas
+ * corrigées, ce qui pourrait pousser une balle dans un mur ; deux
+ * balles qui s'éloignent se séparent d'elles-mêmes. */
+void collide(int i, int j, void * data) {
+  balls_t * b = data;
+  float dx = b->x[j] - b->x[i], dz = b->z[j] - b->z[i], d = sqrtf(dx * dx + dz * dz), rv;
+  if(d <= 0.0f)
+    return;
+  dx /= d;
+  dz /= d;
+  rv = (b->vx[j] - b->vx[i]) * dx + (b->vz[j] - b->vz[i]) * dz;
+  if(rv >= 0.0f)
+    return;
+  b->vx[i] += rv * dx;
+  b->vz[i] += rv * dz;
+  b->vx[j] -= rv * dx;
+  b->vz[j] -= rv * dz;
+}
+
+/*!\brief copie les positions courantes et précédentes des balles dans
+ * leur version publiée (appelée mutex pris ou avant le thread) */
+void publish_balls(void) {
+  balls_reserve(&_pballs, _balls.n);
+  _pballs.n = _balls.n;
+  memcpy(_pballs.x,  _balls.x,  _balls.n * sizeof *_balls.x);
+  memcpy(_pballs.z,  _balls.z,  _balls.n * sizeof *_balls.z);
+  memcpy(_pballs.px, _balls.px, _balls.n * sizeof *_balls.px);
+  memcpy(_pballs.pz, _balls.pz, _balls.n * sizeof *_balls.pz);
+}
+
+/*!\brief instant d'impact du cercle de rayon \a r, de centre \a p et
+ * de vitesse \a v, contre la boîte [\a x0, \a x1] x [\a z0, \a z1].
+ *
+ * C'est le lancer du rayon \a p + t \a v contre la boîte agrandie de
+ * \a r aux coins arrondis : les faces de la boîte agrandie sont
+ * testées par la méthode des "slabs", puis, si le point d'entrée
+ * tombe dans un coin, le disque de rayon \a r centré sur ce coin.
+ * Un cercle qui chevauche déjà la boîte en s'en rapprochant est
+ * touché à t = 0.
+ *
+ * \return 1 s'il y a impact dans [0, \a tmax], avec l'instant dans \a
+ * t et la normale sortante dans \a n ; 0 sinon. */
+int sweep_box(vec2 p, vec2 v, float r, float x0, float z0, float x1, float z1, float tmax, float * t, vec2 * n) {
+  float te = -FLT_MAX, tx = FLT_MAX, t0, t1, cx, cz, dx, dz, b, c, d;
+  int axe = 0;
+  vec2 h;
+  /* slab x */
+  if(v.x != 0.0f) {
+    t0 = (x0 - r - p.x) / v.x;
+    t1 = (x1 + r - p.x) / v.x;
+    if(t0 > t1) { d = t0; t0 = t1; t1 = d; }
+    if(t0 > te) { te = t0; axe = 0; }
+    tx = MIN(tx, t1);
+  } else if(p.x < x0 - r || p.x > x1 + r)
+    return 0;
+  /* slab z */
+  if(v.y != 0.0f) {
+    t0 = (z0 - r - p.y) / v.y;
+    t1 = (z1 + r - p.y) / v.y;
+    if(t0 > t1) { d = t0; t0 = t1; t1 = d; }
+    if(t0 > te) { te = t0; axe = 1; }
+    tx = MIN(tx, t1);
+  } else if(p.y < z0 - r || p.y > z1 + r)
+    return 0;
+  if(te > tx || tx < 0.0f || te > tmax)
+    return 0;
+  if(te < 0.0f) {
+    /* le centre est déjà dans la boîte agrandie */
+    dx = p.x - MIN(MAX(p.x, x0), x1);
+    dz = p.y - MIN(MAX(p.y, z0), z1);
+    d = dx * dx + dz * dz;
+    if(d < r * r) {
+      if(d > 0.0f) {
+	d = sqrtf(d);
+	n->x = dx / d;
+	n->y = dz / d;
+      } else { /* centre dans la boîte : la face la plus proche */
+	float m[4] = { p.x - x0, x1 - p.x, p.y - z0, z1 - p.y };
+	int i, im = 0;
+	for(i = 1; i < 4; ++i)
+	  if(m[i] < m[im]) im = i;
+	n->x = im == 0 ? -1.0f : im == 1 ? 1.0f : 0.0f;
+	n->y = im == 2 ? -1.0f : im == 3 ? 1.0f : 0.0f;
+      }
+      if(v.x * n->x + v.y * n->y >= 0.0f)
+	return 0;
+      *t = 0.0f;
+      return 1;
+    }
+    h = p; /* dans un coin, sans chevauchement */
+  } else {
+    h.x = p.x + te * v.x;
+    h.y = p.y + te * v.y;
+    if((h.x >= x0 && h.x <= x1) || (h.y >= z0 && h.y <= z1)) {
+      /* impact sur une face */
+      *t = te;
+      n->x = axe == 0 ? (v.x > 0.0f ? -1.0f : 1.0f) : 0.0f;
+      n->y = axe == 1 ? (v.y > 0.0f ? -1.0f : 1.0f) : 0.0f;
+      return 1;
+    }
+  }
+  /* impact éventuel sur le coin le plus proche de h */
+  cx = h.x < x0 ? x0 : x1;
+  cz = h.y < z0 ? z0 : z1;
+  dx = p.x - cx;
+  dz = p.y - cz;
+  c = v.x * v.x + v.y * v.y;
+  b = dx * v.x + dz * v.y;
+  d = b * b - c * (dx * dx + dz * dz - r * r);
+  if(c == 0.0f || d < 0.0f || b >= 0.0f)
+    return 0;
+  t0 = (-b - sqrtf(d)) / c;
+  if(t0 > tmax)
+    return 0;
+  t0 = MAX(t0, 0.0f);
+  *t = t0;
+  n->x = (dx + t0 * v.x) / r;
+  n->y = (dz + t0 * v.y) / r;
+  return 1;
+}
+
+/*!\brief premier impact du cercle (\a p, \a v, \a r), pendant \a
+ * tmax, contre les cases pleines du plateau \a b.
+ *
+ * Le centre parcourt la grille par DDA : pour chaque case traversée,
+ * les cases pleines du voisinage 3x3 sont testées par sweep_box (le
+ * rayon ne dépasse pas une demi-case, un cercle dont le centre est
+ * dans une case ne peut toucher que ses voisines). Les cases étant
+ * visitées dans l'ordre du temps, le parcours s'arrête dès que le
+ * meilleur impact précède la sortie de la case courante : le coût
+ * est proportionnel au nombre de cases traversées.
+ *
+ * \return 1 s'il y a impact, avec l'instant dans \a t, la normale dans
+ * \a n et l'indice de la case touchée dans \a cell ; 0 sinon. */
+int sweep_board(const board_t * b, vec2 p, vec2 v, float r, float tmax, float * t, vec2 * n, int * cell) {
+  float ox = -b->w - GAME_CELL / 2.0f, oz = -b->h - GAME_CELL / 2.0f;
+  float gx = (p.x - ox) / GAME_CELL, gz = (p.y - oz) / GAME_CELL;
+  int j = (int)floorf(gx), i = (int)floorf(gz), di, dj, sj, si, hit = 0;
+  float tmx, tmz, tdx, tdz, best = tmax, tc;
+  vec2 nc;
+  sj = v.x > 0.0f ? 1 : -1;
+  si = v.y > 0.0f ? 1 : -1;
+  tdx = v.x != 0.0f ? GAME_CELL / fabsf(v.x) : FLT_MAX;
+  tdz = v.y != 0.0f ? GAME_CELL / fabsf(v.y) : FLT_MAX;
+  tmx = v.x != 0.0f ? ((sj > 0 ? j + 1 - gx : gx - j) * tdx) : FLT_MAX;
+  tmz = v.y != 0.0f ? ((si > 0 ? i + 1 - gz : gz - i) * tdz) : FLT_MAX;
+  for(;;) {
+    for(di = -1; di <= 1; ++di)
+      for(dj = -1; dj <= 1; ++dj) {
+	int ci = i + di, cj = j + dj;
+	float x0, z0;
+	if(ci < 0 || ci >= b->h || cj < 0 || cj >= b->w || b->cells[ci * b->w + cj] == CELL_EMPTY)
+	  continue;
+	x0 = ox + cj * GAME_CELL;
+	z0 = oz + ci * GAME_CELL;
+	if(sweep_box(p, v, r, x0, z0, x0 + GAME_CELL, z0 + GAME_CELL, best, &tc, &nc) && (!hit || tc < best)) {
+	  best = tc;
+	  *n = nc;
+	  *cell = ci * b->w + cj;
+	  hit = 1;
+	}
+      }
+    /* case suivante le long de la trajectoire */
+    if(tmx < tmz) {
+      if(tmx > best) break;
+      j += sj;
+      tmx += tdx;
+    } else {
+      if(tmz > best) break;
+      i += si;
+      tmz += tdz;
+    }
+    /* au-delà du plateau, il n'y a plus rien à toucher */
+    if((si > 0 ? i > b->h : i < -1) || (sj > 0 ? j > b->w : j < -1))
+      break;
+  }
+  if(hit)
+    *t = best;
+  return hit;
+}
+
+/*!\brief accumule le temps écoulé et enchaîne les pas de GAME_DT ;
+ * chaque pas consomme les entrées en attente */
+void advance(void) {
+  Uint64 t = SDL_GetPerformanceCounter();
+  ginput_t in[INPUT_QUEUE];
+  int n;
+  if(!_t0)
+    _t0 = t;
+  _acc += MIN((t - _t0) / (double)SDL_GetPerformanceFrequency(), GAME_MAX_FRAME);
+  _t0 = t;
+  while(_acc >= GAME_DT) {
+    SDL_LockMutex(_mutex);
+    n = _ninputs;
+    memcpy(in, _inputs, n * sizeof *in);
+    _ninputs = 0;
+    SDL_UnlockMutex(_mutex);
+    sim_step(in, n, (float)GAME_DT);
+    SDL_LockMutex(_mutex);
+    _acc -= GAME_DT;
+    _tstep = SDL_GetPerformanceCounter();
+    SDL_UnlockMutex(_mutex);
+  }
+}
+
+/*!\brief un pas de simulation de \a dt : applique les \a n entrées
+ * \a in (en les enregistrant au besoin), avance l'état puis publie le
+ * nouvel état */
+void sim_step(const ginput_t * in, int n, float dt) {
+  game_state_t next;
+  int i;
+  SDL_LockMutex(_mutex);
+  next = _cur;
+  SDL_UnlockMutex(_mutex);
+  for(i = 0; i < n; ++i) {
+    if(_rec)
+      replay_push(_rec, next.step + 1, in[i]);
+    game_apply_input(&next, in[i]);
+  }
+  game_step(&next, dt);
+  if(_rec)
+    _rec->nsteps = next.step;
+  SDL_LockMutex(_mutex);
+  _prev = _cur;
+  _cur = next;
+  if(_pboard.version != _board.version)
+    board_copy(&_pboard, &_board);
+  publish_balls();
+  SDL_UnlockMutex(_mutex);
+}
+
+/*!\brief enregistre dans \a r (initialisé par replay_init, NULL pour
+ * arrêter) les entrées de la partie et son nombre de pas */
+void game_record(replay_t * r) {
+  SDL_LockMutex(_mutex);
+  _rec = r;
+  SDL_UnlockMutex(_mutex);
+}
+
+/*!\brief avance la simulation de \a n pas de \a dt sans horloge,
+ * aussi vite que possible, en appliquant les entrées de \a r (peut
+ * être NULL) datées du pas joué ; \a cursor est la position courante
+ * dans \a r, à mettre à 0 avant le premier appel. L'état affiché
+ * (game_get_state) est alors celui du dernier pas, sans
+ * interpolation. À n'utiliser que sans thread de simulation. */
+void game_steps(unsigned long n, float dt, const replay_t * r, int * cursor) {
+  ginput_t in[INPUT_QUEUE];
+  unsigned long k;
+  int m;
+  assert(!_thread);
+  _headless = 1;
+  for(k = 0; k < n; ++k) {
+    m = 0;
+    while(r && *cursor < r->n && r->ev[*cursor].step <= _cur.step + 1) {
+      if(m < INPUT_QUEUE)
+	in[m++] = r->ev[*cursor].in;
+      ++*cursor;
+    }
+    sim_step(in, m, dt);
+  }
+}
+
+/*!\brief empreinte (FNV-1a) de l'état complet de la simulation :
+ * deux parties identiques ont la même empreinte */
+unsigned game_checksum(void) {
+  unsigned h = 2166136261u;
+  float f[7] = { _cur.balle.x, _cur.balle.y, _cur.vitesse.x, _cur.vitesse.y, _cur.raquette.x, _cur.raquette.y, (float)_cur.bricks };
+  h = fnv1a(h, f, sizeof f);
+  h = fnv1a(h, &_cur.step, sizeof _cur.step);
+  h = fnv1a(h, _board.cells, _board.w * _board.h * sizeof *_board.cells);
+  h = fnv1a(h, _balls.x, _balls.n * sizeof *_balls.x);
+  h = fnv1a(h, _balls.z, _balls.n * sizeof *_balls.z);
+  h = fnv1a(h, _balls.vx, _balls.n * sizeof *_balls.vx);
+  h = fnv1a(h, _balls.vz, _balls.n * sizeof *_balls.vz);
+  return h;
+}
+
+/*!\brief poursuit le hachage FNV-1a \a h sur les \a n octets de \a
+ * data */
+unsigned fnv1a(unsigned h, const void * data, size_t n) {
+  const unsigned char * p = data;
+  size_t i;
+  for(i = 0; i < n; ++i)
+    h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+/*!\brief boucle du thread de simulation */
+int sim_thread(void * data) {
+  while(!SDL_AtomicGet(&_quit)) {
+    advance();
+    SDL_Delay(1);
+  }
+  return 0;
+}
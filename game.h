@@ -0,0 +1,214 @@
+/*!\file game.h
+ *
+ * \brief simulation du casse-briques à pas de temps fixe, découplée
+ * du rendu.
+ *
+ * \author VILFEU Vincent
+*/
+
+#ifndef GAME_H_SEEN
+#  define GAME_H_SEEN
+
+#  include "rasterize.h"
+
+#  ifdef __cplusplus
+extern "C" {
+#  endif
+
+  /*!\brief pas de temps fixe de la simulation, en secondes */
+#  define GAME_DT (1.0 / 120.0)
+  /*!\brief temps maximum simulé par appel à game_update, pour ne pas
+   * s'enliser après une longue frame */
+#  define GAME_MAX_FRAME 0.25
+  /*!\brief côté d'une case du plateau, en unités du monde */
+#  define GAME_CELL 2.0f
+  /*!\brief rayon de la balle */
+#  define GAME_BALL_R 1.0f
+  /*!\brief demi-dimensions de la raquette (x, z) */
+#  define GAME_PADDLE_HW 2.0f
+#  define GAME_PADDLE_HD 1.0f
+  /*!\brief nombre maximum de rebonds traités en un pas */
+#  define GAME_MAX_BOUNCES 8
+  /*!\brief rayon des balles supplémentaires (multiballe) */
+#  define GAME_MBALL_R 0.25f
+  /*!\brief nombre de balles ajoutées par GI_MULTIBALL */
+#  define GAME_MULTIBALL 256
+  /*!\brief au-delà de ce nombre de cases de côté, le plateau ne
+   * tient plus à l'écran et la vue suit la balle */
+#  define GAME_VIEW_CELLS 32
+  /*!\brief côté d'un chunk du plateau, en cases (puissance de 2) */
+#  define CHUNK_SHIFT 4
+#  define CHUNK (1 << CHUNK_SHIFT)
+
+  typedef enum ginput_t ginput_t;
+  typedef struct game_state_t game_state_t;
+  typedef struct board_t board_t;
+  typedef struct balls_t balls_t;
+  typedef struct grid_t grid_t;
+  typedef struct gpairs_t gpairs_t;
+  typedef struct replay_event_t replay_event_t;
+  typedef struct replay_t replay_t;
+  typedef struct chunk_t chunk_t;
+  typedef struct bmesh_t bmesh_t;
+
+  /*!\brief contenu d'une case du plateau */
+  enum {
+	CELL_EMPTY = 0,
+	CELL_WALL,
+	CELL_BRICK
+  };
+
+  /*!\brief le plateau : \a w x \a h cases, ligne par ligne. La case
+   * (i, j) occupe [2j - w - 1, 2j - w + 1] en x et [2i - h - 1, 2i -
+   * h + 1] en z. Il est découpé en \a cw x \a ch chunks de CHUNK x
+   * CHUNK cases (voir level.c). */
+  struct board_t {
+    int w, h;
+    unsigned char * cells;
+    unsigned version;    /* incrémentée à chaque case modifiée */
+    int cw, ch;          /* nombre de chunks en x et en z */
+    unsigned short * cfill;  /* cases non vides de chaque chunk */
+    unsigned * cversion; /* version de chaque chunk */
+    unsigned char * map; /* projection du fichier de niveau (NULL si
+			    les cases sont allouées) */
+    size_t mapsize;
+  };
+
+  /*!\brief entrées du joueur, appliquées au pas de simulation
+   * suivant */
+  enum ginput_t {
+		 GI_LEFT = 0, /* raquette vers la gauche */
+		 GI_RIGHT, /* raquette vers la droite */
+		 GI_LAUNCH, /* lancer la balle */
+		 GI_MULTIBALL /* ajouter GAME_MULTIBALL balles */
+  };
+
+  /*!\brief l'état de la simulation */
+  struct game_state_t {
+    vec3 balle;          /* position de la balle (y porte le z du
+			    plateau) */
+    vec2 vitesse;        /* vitesse de la balle */
+    vec3 raquette;       /* position de la raquette */
+    int bricks;          /* nombre de briques restantes */
+    int teleport;        /* la balle a été replacée à ce pas, ne pas
+			    interpoler */
+    unsigned long step;  /* numéro du pas */
+  };
+
+  /*!\brief les balles, en structure de tableaux : positions,
+   * positions au pas précédent (pour l'interpolation) et vitesses */
+  struct balls_t {
+    int n, cap;
+    float * x, * z, * px, * pz, * vx, * vz;
+  };
+
+  /*!\brief grille uniforme de la phase large, reconstruite à chaque
+   * pas ; les indices des balles y sont triés par case */
+  struct grid_t {
+    int w, h;
+    float ox, oz, cell;
+    int * start;   /* w x h + 1 débuts de case dans idx */
+    int * idx;     /* indices des balles, case par case */
+    int * cellof;  /* case de chaque balle */
+    int cap;
+    gpairs_t * bands; /* paires trouvées par bandes de lignes, voir
+			 grid_pairs */
+    int nbands;
+  };
+
+  /*!\brief une entrée datée en numéro de pas */
+  struct replay_event_t {
+    unsigned long step;
+    ginput_t in;
+  };
+
+  /*!\brief une partie enregistrée (voir record.c pour le format) */
+  struct replay_t {
+    char level[256];      /* fichier de niveau ("" : niveau d'origine) */
+    float dt;             /* pas de temps */
+    int nballs;           /* balles supplémentaires au départ */
+    unsigned long nsteps; /* nombre total de pas */
+    int n, cap;
+    replay_event_t * ev;  /* entrées, par pas croissants */
+  };
+
+  /*!\brief un chunk du plateau tel que vu par le rendu (voir
+   * boardmesh.c) */
+  struct chunk_t {
+    unsigned char packed[CHUNK * CHUNK / 4]; /* cases sur 2 bits */
+    int count[3];          /* nombre de cases de chaque type */
+    float bmin[3], bmax[3];/* boîte englobante des cases pleines */
+    surface_t * mesh[2];   /* maillages des murs et des briques */
+    unsigned version;      /* version du chunk du plateau compactée */
+    int dirty;             /* maillages à refaire */
+    int changed;           /* modifié au dernier bmesh_update */
+  };
+
+  /*!\brief le plateau découpé en chunks pour le rendu */
+  struct bmesh_t {
+    int w, h, cw, ch;
+    chunk_t * chunks;
+    surface_t * cube;      /* le cube dont sont faites les cases */
+    int * todo;            /* chunks à refaire puis maillages à
+			      dessiner, voir bmesh_draw */
+    surface_t ** draw;
+    int compact;           /* maillages compactés après cuisson (voir
+			      compact_surface_lattice) */
+    float qscale;          /* pas du réseau de quantification commun
+			      aux chunks compacts, une puissance de 2 */
+  };
+
+  /* dans game.c */
+  extern int  game_init(const char * level, int threaded, int nballs);
+  extern void game_quit(void);
+  extern void game_input(ginput_t in);
+  extern void game_update(void);
+  extern void game_get_state(game_state_t * out);
+  extern const board_t * game_board(void);
+  extern void game_apply_input(game_state_t * s, ginput_t in);
+  extern void game_step(game_state_t * s, float dt);
+  extern const float * game_balls(int * n);
+  extern void game_record(replay_t * r);
+  extern void game_steps(unsigned long n, float dt, const replay_t * r, int * cursor);
+  extern unsigned game_checksum(void);
+
+  /* dans record.c */
+  extern const char * ginput_name(ginput_t in);
+  extern int          ginput_from_name(const char * name);
+  extern void         replay_init(replay_t * r, float dt, int nballs);
+  extern void         replay_push(replay_t * r, unsigned long step, ginput_t in);
+  extern void         replay_free(replay_t * r);
+  extern int          replay_save(const replay_t * r, const char * filename);
+  extern int          replay_load(replay_t * r, const char * filename);
+
+  /* dans level.c */
+  extern void board_init(board_t * b, int w, int h, const unsigned char * cells);
+  extern void board_free(board_t * b);
+  extern void board_set(board_t * b, int i, int j, unsigned char v);
+  extern int  board_count(const board_t * b, unsigned char v);
+  extern void board_copy(board_t * dst, const board_t * src);
+  extern void level_builtin(board_t * b);
+  extern int  level_load(board_t * b, const char * filename);
+  extern int  level_save(const board_t * b, const char * filename);
+
+  /* dans boardmesh.c */
+  extern void bmesh_init(bmesh_t * m);
+  extern void bmesh_free(bmesh_t * m);
+  extern int  bmesh_update(bmesh_t * m, const board_t * b);
+  extern int  bmesh_draw(bmesh_t * m, int type, const surface_t * look, float * view, float * proj);
+
+  /* dans broadphase.c */
+  extern void balls_reserve(balls_t * b, int n);
+  extern int  balls_add(balls_t * b, float x, float z, float vx, float vz);
+  extern void balls_remove(balls_t * b, int i);
+  extern void balls_free(balls_t * b);
+  extern void grid_init(grid_t * g, int w, int h, float ox, float oz, float cell);
+  extern void grid_free(grid_t * g);
+  extern void grid_build(grid_t * g, const float * x, const float * z, int n);
+  extern int  grid_pairs(const grid_t * g, const float * x, const float * z, float d, void (*f)(int, int, void *), void * data);
+
+#  ifdef __cplusplus
+}
+#  endif
+
+#endif
@@ -13,6 +13,12 @@
 #endif
 #include <math.h>
 
+/*!\brief longueur minimale, en pixels, des côtés d'un niveau de
+ * détail de sphère à l'écran (voir \ref mk_sphere_lod) */
+#define LOD_SEGMENT_PX 3.0f
+
+static triangle_t * sphere_triangles(int longitudes, int latitudes);
+
 /*!\brief fabrique et renvoie une surface représentant un
  * quadrilatère "debout" et à la profondeur 0. Il fait la hauteur et
  * la largeur du cube unitaire (-1 à 1).*/
@@ -104,6 +110,32 @@ surface_t * mk_cube(void) {
  * centrée en zéro et de rayon 1. Elle est découpée en \a longitudes
  * longitudes et \a latitudes latitudes. */
 surface_t * mk_sphere(int longitudes, int latitudes) {
+  return new_surface(sphere_triangles(longitudes, latitudes), 2 * longitudes * latitudes, 0, 1);
+}
+
+/*!\brief comme \ref mk_sphere, avec des niveaux de détail : chaque
+ * niveau divise par deux les longitudes et les latitudes du précédent
+ * (jusqu'à 4 x 3) et est utilisé quand ses côtés restent longs d'au
+ * moins LOD_SEGMENT_PX pixels à l'écran. */
+surface_t * mk_sphere_lod(int longitudes, int latitudes) {
+  surface_t * s = mk_sphere(longitudes, latitudes);
+  int k, lo = longitudes, la = latitudes;
+  for(k = 1; k < LOD_MAX; ++k) {
+    int nlo = MAX(lo / 2, 4), nla = MAX(la / 2, 3);
+    if(nlo == lo && nla == la)
+      break;
+    /* un équateur de lo côtés de LOD_SEGMENT_PX pixels au moins fait
+       un rayon de lo LOD_SEGMENT_PX / 2pi pixels */
+    add_surface_lod(s, sphere_triangles(nlo, nla), 2 * nlo * nla, lo * LOD_SEGMENT_PX / (2.0f * (float)M_PI));
+    lo = nlo;
+    la = nla;
+  }
+  return s;
+}
+
+/*!\brief les triangles (alloués) d'une sphère de rayon 1 découpée en
+ * \a longitudes longitudes et \a latitudes latitudes */
+triangle_t * sphere_triangles(int longitudes, int latitudes) {
   triangle_t * t;
   vertex_t * data;
   double phi, theta, r, y;
@@ -153,5 +185,5 @@ surface_t * mk_sphere(int longitudes, int latitudes) {
     }
   }
   free(data);
-  return new_surface(t, n, 0, 1);
+  return t;
 }
@@ -0,0 +1,195 @@
+/*!\file golden.c
+ *
+ * \brief vérification de non-régression du rendu, sans fenêtre :
+ * des frames fixes des scènes de scenes.c sont rendues et comparées
+ * pixel à pixel à des images de référence (golden/ *.ppm).
+ *
+ * Un pixel diffère quand l'écart sur l'une de ses composantes
+ * dépasse la tolérance (-t) ; une image échoue quand la proportion
+ * de pixels différents dépasse le seuil (-p, en pour cent). En cas
+ * d'échec, l'image obtenue et une image des différences (pixels
+ * fautifs en rouge sur l'image obtenue assombrie) sont écrites dans
+ * le répertoire de sortie (-o).
+ *
+ * Usage : rasterizer_golden [-u] [-v] [-S] [-a pas] [-c] [-q] [-t tolérance] [-p pourcentage] [-g répertoire] [-o répertoire]
+ * -u (ré)écrit les références au lieu de comparer, -v rend les frames
+ * par une display list jouée avec le visibility buffer (voir
+ * set_visibility_buffer), -S avec le S-buffer (voir set_span_buffer) ;
+ * les images doivent être les mêmes. -a n'interpole exactement les
+ * attributs que tous les \a pas pixels (voir set_affine_span), -c
+ * compresse les textures en BC1 (voir atlas_compress), -q rend les
+ * maillages compacts (voir compact_surface) : les images restent
+ * dans la tolérance.
+ *
+ * La scène model rend le maillage \a répertoire/model.obj (voir -g),
+ * qui exerce le chargeur OBJ (voir load_OBJ), une fois tel quel et
+ * une fois réordonné (OBJ_OPTIMIZE, images suffixées _opt).
+ *
+ * \author Farès BELHADJ, amsi@up8.edu
+ * \date November 2021.
+*/
+
+#include "scenes.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*!\brief dimensions des images comparées */
+#define GW 160
+#define GH 120
+
+/*!\brief les frames de référence : une scène, un numéro de frame et,
+ * pour la scène model, les options de chargement du maillage */
+static const int _cases[][3] = {
+  { SCENE_BOARD, 0, 0 }, { SCENE_BOARD, 40, 0 }, { SCENE_SPHERES, 10, 0 },
+  { SCENE_NEAR_QUADS, 0, 0 }, { SCENE_NEAR_QUADS, 50, 0 }, { SCENE_OVERDRAW, 0, 0 },
+  { SCENE_BALLS, 20, 0 }, { SCENE_MODEL, 15, OBJ_NONE }, { SCENE_MODEL, 15, OBJ_OPTIMIZE }
+};
+
+/*!\brief lit le fichier PPM (binaire, 8 bits) \a filename de
+ * dimensions \a w x \a h dans \a p ; renvoie 0 en cas d'échec */
+static int read_ppm(const char * filename, GLuint * p, int w, int h) {
+  int x, y, fw, fh, max;
+  unsigned char rgb[3];
+  FILE * f = fopen(filename, "rb");
+  if(!f)
+    return 0;
+  if(fscanf(f, "P6 %d %d %d", &fw, &fh, &max) != 3 || fw != w || fh != h || max != 255 || fgetc(f) == EOF) {
+    fclose(f);
+    return 0;
+  }
+  for(y = h - 1; y >= 0; --y)
+    for(x = 0; x < w; ++x) {
+      if(fread(rgb, 1, 3, f) != 3) {
+	fclose(f);
+	return 0;
+      }
+      p[y * w + x] = RGBA(rgb[0], rgb[1], rgb[2], 255);
+    }
+  fclose(f);
+  return 1;
+}
+
+/*!\brief compare \a a à la référence \a b, remplit \a diff et renvoie
+ * le nombre de pixels dont une composante s'écarte de plus de \a
+ * tol */
+static int compare(const GLuint * a, const GLuint * b, GLuint * diff, int n, int tol) {
+  int i, bad = 0;
+  for(i = 0; i < n; ++i) {
+    int dr = abs((int)RED(a[i]) - (int)RED(b[i]));
+    int dg = abs((int)GREEN(a[i]) - (int)GREEN(b[i]));
+    int db = abs((int)BLUE(a[i]) - (int)BLUE(b[i]));
+    if(dr > tol || dg > tol || db > tol) {
+      diff[i] = RGBA(255, 0, 0, 255);
+      ++bad;
+    } else
+      diff[i] = RGBA(RED(a[i]) / 4, GREEN(a[i]) / 4, BLUE(a[i]) / 4, 255);
+  }
+  return bad;
+}
+
+/*!\brief affiche l'usage et quitte */
+static void usage(const char * prog) {
+  fprintf(stderr, "usage : %s [-u] [-v] [-S] [-a pas] [-c] [-q] [-t tolérance] [-p pourcentage] [-g répertoire] [-o répertoire]\n", prog);
+  exit(1);
+}
+/*!\brief rend la frame \a frame de la scène \a scene dans \a img,
+ * directement ou, si \a l n'est pas NULL, en l'enregistrant dans la
+ * display list \a l jouée ensuite avec le visibility buffer */
+static void draw(int scene, int frame, GLuint * img, dlist_t * l) {
+  if(!l) {
+    scene_draw(scene, frame, img, GW, GH);
+    return;
+  }
+  set_visibility_buffer(1);
+  dlist_record(l, GW, GH);
+  scene_draw(scene, frame, img, GW, GH);
+  dlist_record(NULL, 0, 0);
+  set_visibility_buffer(0);
+  dlist_play(l, img, GW, GH);
+}
+
+int main(int argc, char ** argv) {
+  int i, update = 0, sbuffer = 0, affine = 0, compress = 0, compact = 0, tol = 16, failures = 0, n = GW * GH;
+  dlist_t * l = NULL;
+  double maxp = 0.2;
+  const char * gdir = "golden", * odir = "golden_out";
+  char name[512];
+  GLuint * img = malloc(n * sizeof *img), * ref = malloc(n * sizeof *ref), * diff = malloc(n * sizeof *diff);
+  assert(img && ref && diff);
+  for(i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "-u"))
+      update = 1;
+    else if(!strcmp(argv[i], "-v") && !l)
+      l = dlist_new();
+    else if(!strcmp(argv[i], "-S"))
+      sbuffer = 1;
+    else if(!strcmp(argv[i], "-a") && i + 1 < argc)
+      affine = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-c"))
+      compress = 1;
+    else if(!strcmp(argv[i], "-q"))
+      compact = 1;
+    else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+      tol = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+      maxp = atof(argv[++i]);
+    else if(!strcmp(argv[i], "-g") && i + 1 < argc)
+      gdir = argv[++i];
+    else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+      odir = argv[++i];
+    else
+      usage(argv[0]);
+  }
+  if(update && (l || sbuffer || affine || compress || compact))
+    usage(argv[0]);
+  set_span_buffer(sbuffer);
+  set_affine_span(affine);
+  scenes_init();
+  if(compress)
+    scenes_compress_textures();
+  if(compact)
+    scenes_compact_meshes();
+  for(i = 0; i < (int)(sizeof _cases / sizeof *_cases); ++i) {
+    const char * sn = scene_name(_cases[i][0]), * sfx = _cases[i][2] & OBJ_OPTIMIZE ? "_opt" : "";
+    int bad;
+    if(_cases[i][0] == SCENE_MODEL) {
+      snprintf(name, sizeof name, "%s/model.obj", gdir);
+      if(!scenes_load_model(name, _cases[i][2] | (compact ? OBJ_COMPACT : OBJ_NONE))) {
+	printf("%-24s ÉCHEC : maillage absent ou illisible\n", name);
+	++failures;
+	continue;
+      }
+    }
+    draw(_cases[i][0], _cases[i][1], img, l);
+    snprintf(name, sizeof name, "%s/%s%s_%03d.ppm", gdir, sn, sfx, _cases[i][1]);
+    if(update) {
+      if(!write_ppm(name, img, GW, GH))
+	++failures;
+      else
+	printf("%-24s mis à jour\n", name);
+      continue;
+    }
+    if(!read_ppm(name, ref, GW, GH)) {
+      printf("%-24s ÉCHEC : référence absente ou illisible (make golden-update)\n", name);
+      ++failures;
+      continue;
+    }
+    bad = compare(img, ref, diff, n, tol);
+    if(100.0 * bad / n > maxp) {
+      printf("%-24s ÉCHEC : %d pixels différents (%.3f%%)\n", name, bad, 100.0 * bad / n);
+      snprintf(name, sizeof name, "%s/%s%s_%03d.ppm", odir, sn, sfx, _cases[i][1]);
+      write_ppm(name, img, GW, GH);
+      snprintf(name, sizeof name, "%s/%s%s_%03d.diff.ppm", odir, sn, sfx, _cases[i][1]);
+      write_ppm(name, diff, GW, GH);
+      ++failures;
+    } else
+      printf("%-24s ok (%d pixels différents)\n", name, bad);
+  }
+  scenes_quit();
+  dlist_free(l);
+  free(img);
+  free(ref);
+  free(diff);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,350 @@
+/*!\file jobs.c
+ *
+ * \brief ordonnanceur de tâches partagé par le rendu et la
+ * simulation : un thread par cœur, une file double (deque) par
+ * thread et vol de tâches.
+ *
+ * Une tâche (job_t) est une fonction et son argument. Elle peut
+ * dépendre d'autres tâches (job_after) : elle n'est lancée, une fois
+ * soumise (job_submit), qu'après la fin de toutes. Un thread range les
+ * tâches qu'il lance au bas de sa deque et y reprend d'abord la
+ * dernière rangée ; un thread sans travail en vole une en haut de la
+ * deque d'un autre. Un thread qui attend une tâche (job_wait) en
+ * exécute d'autres en attendant, si bien qu'une tâche peut en lancer
+ * et en attendre d'autres sans bloquer l'ordonnanceur.
+ * jobs_parallel_for découpe un intervalle en morceaux lancés en
+ * tâches.
+ *
+ * Un seul ordonnanceur pour tout le programme évite que chaque
+ * partie parallélisée ne crée ses propres threads et que leur total
+ * ne dépasse le nombre de cœurs. Avec un seul thread (jobs_init(1),
+ * ou tant que jobs_init n'a pas été appelé), toute tâche s'exécute
+ * dans le thread qui la soumet, dans l'ordre : c'est le mode de
+ * débogage.
+ *
+ * \author VILFEU Vincent
+ */
+#include "rasterize.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/*!\brief nombre maximal de threads ayant une deque : les threads de
+ * l'ordonnanceur et ceux, extérieurs (affichage, simulation,
+ * rastérisation en pipeline), qui soumettent des tâches */
+#define JOBS_MAX_THREADS 64
+/*!\brief capacité d'une deque ; une tâche qui n'y tient pas est
+ * exécutée sur place */
+#define JOBS_DEQUE 1024
+/*!\brief nombre maximal de tâches qui dépendent d'une même tâche */
+#define JOB_SUCC_MAX 16
+
+struct job_t {
+  void (*fn)(void *);
+  void * arg;
+  SDL_atomic_t pending;  /* dépendances pas encore terminées, plus
+			    un tant que la tâche n'est pas soumise */
+  SDL_atomic_t refs;     /* l'ordonnanceur et le créateur */
+  SDL_SpinLock lock;     /* protège done et succ */
+  int done;
+  job_t * succ[JOB_SUCC_MAX]; /* tâches qui dépendent de celle-ci */
+  int nsucc;
+};
+
+/*!\brief une deque : le thread propriétaire pousse et reprend en bas
+ * (bottom), les voleurs prennent en haut (top) */
+typedef struct deque_t deque_t;
+struct deque_t {
+  SDL_SpinLock lock;
+  int top, bottom;
+  job_t * q[JOBS_DEQUE];
+};
+
+/*!\brief nombre de threads de l'ordonnanceur, thread appelant de
+ * jobs_init compris (1 : mode mono-thread) */
+static int _nthreads = 1;
+static SDL_Thread * _threads[JOBS_MAX_THREADS];
+/*!\brief les deques, une par thread qui a soumis une tâche */
+static deque_t _deques[JOBS_MAX_THREADS];
+static SDL_atomic_t _ndeques;
+/*!\brief la deque du thread courant (-1 : pas encore attribuée) */
+static THREAD_LOCAL int _me = -1;
+/*!\brief nombre de tâches en deque, nombre de threads endormis faute
+ * de tâches, et de quoi les réveiller */
+static SDL_atomic_t _queued, _sleeping;
+static SDL_mutex * _mutex = NULL;
+static SDL_cond * _cond = NULL;
+static int _quit = 0;
+
+static int   worker(void * data);
+static int   my_deque(void);
+static void  push(job_t * j);
+static int   run_one(void);
+static void  run(job_t * j);
+
+/*!\brief lance l'ordonnanceur avec \a n threads, le thread appelant
+ * compris : 0 pour le nombre de cœurs, 1 pour le mode mono-thread */
+void jobs_init(int n) {
+  int i;
+  assert(_nthreads == 1 && !_mutex);
+  if(n <= 0)
+    n = SDL_GetCPUCount();
+  n = MAX(1, MIN(n, JOBS_MAX_THREADS / 2));
+  SDL_AtomicSet(&_queued, 0);
+  SDL_AtomicSet(&_sleeping, 0);
+  _quit = 0;
+  _mutex = SDL_CreateMutex();
+  _cond = SDL_CreateCond();
+  assert(_mutex && _cond);
+  _me = my_deque();
+  _nthreads = n;
+  for(i = 1; i < n; ++i) {
+    _threads[i] = SDL_CreateThread(worker, "jobs", NULL);
+    assert(_threads[i]);
+  }
+}
+
+/*!\brief arrête les threads de l'ordonnanceur (les tâches doivent
+ * être terminées) ; on revient au mode mono-thread */
+void jobs_quit(void) {
+  int i;
+  if(!_mutex)
+    return;
+  SDL_LockMutex(_mutex);
+  _quit = 1;
+  SDL_CondBroadcast(_cond);
+  SDL_UnlockMutex(_mutex);
+  for(i = 1; i < _nthreads; ++i)
+    SDL_WaitThread(_threads[i], NULL);
+  SDL_DestroyCond(_cond);
+  SDL_DestroyMutex(_mutex);
+  _mutex = NULL;
+  _cond = NULL;
+  _nthreads = 1;
+}
+
+/*!\brief renvoie le nombre de threads de l'ordonnanceur (1 en mode
+ * mono-thread) */
+int jobs_threads(void) {
+  return _nthreads;
+}
+
+/*!\brief crée la tâche \a fn(\a arg), qui ne sera lancée qu'une fois
+ * soumise par \ref job_submit et ses dépendances terminées. Le
+ * créateur doit ensuite l'attendre (\ref job_wait) ou la lâcher
+ * (\ref job_release). */
+job_t * job_new(void (*fn)(void *), void * arg) {
+  job_t * j = calloc(1, sizeof *j);
+  assert(j);
+  j->fn = fn;
+  j->arg = arg;
+  SDL_AtomicSet(&j->pending, 1);
+  SDL_AtomicSet(&j->refs, 2);
+  return j;
+}
+
+/*!\brief la tâche \a j, pas encore soumise, ne sera lancée qu'après
+ * la fin de \a dep */
+void job_after(job_t * j, job_t * dep) {
+  SDL_AtomicLock(&dep->lock);
+  if(!dep->done) {
+    assert(dep->nsucc < JOB_SUCC_MAX);
+    dep->succ[dep->nsucc++] = j;
+    SDL_AtomicAdd(&j->pending, 1);
+  }
+  SDL_AtomicUnlock(&dep->lock);
+}
+
+/*!\brief soumet la tâche \a j : elle est lancée dès que ses
+ * dépendances sont terminées (tout de suite, dans le thread appelant,
+ * en mode mono-thread) */
+void job_submit(job_t * j) {
+  if(SDL_AtomicAdd(&j->pending, -1) == 1)
+    push(j);
+}
+
+/*!\brief attend la fin de la tâche \a j, en exécutant d'autres
+ * tâches en attendant, puis la lâche.
+ *
+ * \a j et toutes les tâches dont elle dépend, directement ou non,
+ * doivent avoir été soumises avant l'appel : une dépendance jamais
+ * soumise ne se termine jamais. En mode mono-thread, où une tâche
+ * soumise est lancée sur-le-champ, une tâche pas encore terminée ne
+ * peut être que dans ce cas et le programme s'arrête au lieu de
+ * boucler sans fin. */
+void job_wait(job_t * j) {
+  for(;;) {
+    int done;
+    SDL_AtomicLock(&j->lock);
+    done = j->done;
+    SDL_AtomicUnlock(&j->lock);
+    if(done)
+      break;
+    if(_nthreads <= 1) {
+      fprintf(stderr, "job_wait : tâche ou dépendance attendue avant d'être soumise\n");
+      abort();
+    }
+    if(!run_one())
+      SDL_Delay(0);
+  }
+  job_release(j);
+}
+
+/*!\brief lâche la tâche \a j sans l'attendre ; elle est libérée dès
+ * qu'elle est terminée */
+void job_release(job_t * j) {
+  if(SDL_AtomicAdd(&j->refs, -1) == 1)
+    free(j);
+}
+
+/*!\brief la tâche d'un morceau de \ref jobs_parallel_for */
+typedef struct pfor_t pfor_t;
+struct pfor_t {
+  void (*fn)(void *, int, int);
+  void * arg;
+  int i0, i1;
+};
+
+static void pfor_run(void * data) {
+  pfor_t * p = data;
+  p->fn(p->arg, p->i0, p->i1);
+}
+
+/*!\brief appelle \a fn(\a arg, i0, i1) sur les morceaux [i0, i1[ de
+ * [0, \a n[, de \a grain indices (le dernier excepté), en parallèle, et
+ * attend leur fin. Les morceaux sont toujours les mêmes quel que
+ * soit le nombre de threads ; en mode mono-thread ils sont traités
+ * dans l'ordre. */
+void jobs_parallel_for(int n, int grain, void (*fn)(void *, int, int), void * arg) {
+  int i, m;
+  pfor_t * p;
+  job_t ** j;
+  if(n <= 0)
+    return;
+  grain = MAX(grain, 1);
+  m = (n + grain - 1) / grain;
+  if(_nthreads <= 1 || m == 1) {
+    for(i = 0; i < n; i += grain)
+      fn(arg, i, MIN(i + grain, n));
+    return;
+  }
+  p = malloc(m * sizeof *p);
+  j = malloc(m * sizeof *j);
+  assert(p && j);
+  for(i = 0; i < m; ++i) {
+    p[i].fn = fn;
+    p[i].arg = arg;
+    p[i].i0 = i * grain;
+    p[i].i1 = MIN(n, (i + 1) * grain);
+    j[i] = job_new(pfor_run, &p[i]);
+  }
+  /* soumis à rebours : le thread appelant reprend d'abord le premier
+     morceau, les voleurs prennent les derniers */
+  for(i = m - 1; i >= 0; --i)
+    job_submit(j[i]);
+  for(i = 0; i < m; ++i)
+    job_wait(j[i]);
+  free(j);
+  free(p);
+}
+
+/*!\brief la boucle d'un thread de l'ordonnanceur */
+int worker(void * data) {
+  (void)data;
+  _me = my_deque();
+  for(;;) {
+    if(run_one())
+      continue;
+    SDL_LockMutex(_mutex);
+    SDL_AtomicAdd(&_sleeping, 1);
+    while(!SDL_AtomicGet(&_queued) && !_quit)
+      SDL_CondWait(_cond, _mutex);
+    SDL_AtomicAdd(&_sleeping, -1);
+    if(_quit && !SDL_AtomicGet(&_queued)) {
+      SDL_UnlockMutex(_mutex);
+      break;
+    }
+    SDL_UnlockMutex(_mutex);
+  }
+  /* les bandes de display list jouées ont alloué un buffer de
+     profondeur (voir dlist_play) */
+  free_depth_map();
+  return 0;
+}
+
+/*!\brief renvoie la deque du thread courant, attribuée à son premier
+ * appel */
+int my_deque(void) {
+  if(_me < 0) {
+    _me = SDL_AtomicAdd(&_ndeques, 1);
+    assert(_me < JOBS_MAX_THREADS);
+  }
+  return _me;
+}
+
+/*!\brief range la tâche prête \a j au bas de la deque du thread
+ * courant (l'exécute sur place en mode mono-thread ou si la deque est
+ * pleine) et réveille au besoin un thread endormi */
+void push(job_t * j) {
+  deque_t * d;
+  if(_nthreads <= 1) {
+    run(j);
+    return;
+  }
+  d = &_deques[my_deque()];
+  SDL_AtomicLock(&d->lock);
+  if(d->bottom - d->top == JOBS_DEQUE) {
+    SDL_AtomicUnlock(&d->lock);
+    run(j);
+    return;
+  }
+  d->q[d->bottom++ % JOBS_DEQUE] = j;
+  SDL_AtomicUnlock(&d->lock);
+  SDL_AtomicAdd(&_queued, 1);
+  if(SDL_AtomicGet(&_sleeping)) {
+    SDL_LockMutex(_mutex);
+    SDL_CondSignal(_cond);
+    SDL_UnlockMutex(_mutex);
+  }
+}
+
+/*!\brief exécute une tâche prête : la dernière rangée par le thread
+ * courant, sinon la plus ancienne d'une autre deque ; renvoie 0 s'il
+ * n'y en avait aucune */
+int run_one(void) {
+  int i, k, me = my_deque(), nd = SDL_AtomicGet(&_ndeques);
+  job_t * j = NULL;
+  for(k = 0; k < nd && !j; ++k) {
+    deque_t * d = &_deques[(me + k) % nd];
+    SDL_AtomicLock(&d->lock);
+    if(d->bottom > d->top) {
+      i = k ? d->top++ : --d->bottom;
+      j = d->q[i % JOBS_DEQUE];
+      if(d->top == d->bottom)
+	d->top = d->bottom = 0;
+    }
+    SDL_AtomicUnlock(&d->lock);
+  }
+  if(!j)
+    return 0;
+  SDL_AtomicAdd(&_queued, -1);
+  run(j);
+  return 1;
+}
+
+/*!\brief exécute la tâche \a j puis lance celles qui n'attendaient
+ * plus qu'elle */
+void run(job_t * j) {
+  job_t * succ[JOB_SUCC_MAX];
+  int i, n;
+  j->fn(j->arg);
+  SDL_AtomicLock(&j->lock);
+  j->done = 1;
+  n = j->nsucc;
+  memcpy(succ, j->succ, n * sizeof *succ);
+  SDL_AtomicUnlock(&j->lock);
+  for(i = 0; i < n; ++i)
+    if(SDL_AtomicAdd(&succ[i]->pending, -1) == 1)
+      push(succ[i]);
+  job_release(j);
+}
@@ -0,0 +1,271 @@
+/*!\file level.c
+ *
+ * \brief le plateau (board_t), découpé en chunks, et son format de
+ * fichier binaire.
+ *
+ * Un niveau est enregistré en binaire, un octet par case après un
+ * en-tête de 16 octets :
+ *
+ * \verbatim
+ octets 0-3   "CBLV"
+ octet  4     version (1)
+ octets 5-7   réservés (0)
+ octets 8-11  largeur w (entier non signé, petit-boutiste)
+ octets 12-15 hauteur h (idem)
+ octets 16-   w x h cases, ligne par ligne (0 vide, 1 mur, 2 brique)
+ \endverbatim
+ *
+ * Le fichier est projeté en mémoire (mmap, en copie privée : la
+ * simulation peut détruire des briques sans toucher au fichier) et
+ * ses cases sont utilisées sur place ; sous Windows il est lu d'un
+ * bloc. Le plateau tient à jour, pour chaque chunk de CHUNK x CHUNK
+ * cases, le nombre de cases non vides et une version : le rendu
+ * saute les chunks vides et la copie d'un plateau vers un autre ne
+ * recopie que les chunks modifiés.
+ *
+ * \author VILFEU Vincent
+ */
+#include "game.h"
+#include <assert.h>
+#include <stdio.h>
+#ifdef _WIN32
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+/*!\brief taille de l'en-tête d'un fichier de niveau */
+#define LEVEL_HEADER 16
+
+/*!\brief le niveau d'origine (la rangée du bas est ouverte, la balle
+ * qui la franchit est perdue) */
+static const unsigned char _builtin[] = {
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+};
+#define BUILTIN_W 15
+#define BUILTIN_H 18
+
+static void board_chunks(board_t * b);
+static unsigned rd32(const unsigned char * p);
+static void wr32(unsigned char * p, unsigned v);
+
+/*!\brief (re)calcule le remplissage des chunks de \a b, dont les cases
+ * sont déjà en place */
+void board_chunks(board_t * b) {
+  int i, j;
+  b->cw = (b->w + CHUNK - 1) >> CHUNK_SHIFT;
+  b->ch = (b->h + CHUNK - 1) >> CHUNK_SHIFT;
+  free(b->cfill);
+  free(b->cversion);
+  b->cfill = calloc(b->cw * b->ch, sizeof *b->cfill);
+  b->cversion = calloc(b->cw * b->ch, sizeof *b->cversion);
+  assert(b->cfill && b->cversion);
+  for(i = 0; i < b->h; ++i)
+    for(j = 0; j < b->w; ++j)
+      b->cfill[(i >> CHUNK_SHIFT) * b->cw + (j >> CHUNK_SHIFT)] += b->cells[i * b->w + j] != CELL_EMPTY;
+  b->version = 1;
+}
+
+/*!\brief initialise \a b en un plateau de \a w x \a h cases, copiées
+ * depuis \a cells (vides si NULL) */
+void board_init(board_t * b, int w, int h, const unsigned char * cells) {
+  memset(b, 0, sizeof *b);
+  b->w = w;
+  b->h = h;
+  b->cells = calloc(w * h, sizeof *b->cells);
+  assert(b->cells);
+  if(cells)
+    memcpy(b->cells, cells, w * h * sizeof *b->cells);
+  board_chunks(b);
+}
+
+/*!\brief libère \a b (et la projection de son fichier s'il y en a
+ * une) */
+void board_free(board_t * b) {
+  if(b->map) {
+#ifdef _WIN32
+    free(b->map);
+#else
+    munmap(b->map, b->mapsize);
+#endif
+  } else
+    free(b->cells);
+  free(b->cfill);
+  free(b->cversion);
+  memset(b, 0, sizeof *b);
+}
+
+/*!\brief donne la valeur \a v à la case (\a i, \a j) de \a b en tenant
+ * à jour son chunk */
+void board_set(board_t * b, int i, int j, unsigned char v) {
+  unsigned char * c = &b->cells[i * b->w + j];
+  int k = (i >> CHUNK_SHIFT) * b->cw + (j >> CHUNK_SHIFT);
+  if(*c == v)
+    return;
+  b->cfill[k] += (v != CELL_EMPTY) - (*c != CELL_EMPTY);
+  *c = v;
+  ++b->cversion[k];
+  ++b->version;
+}
+
+/*!\brief renvoie le nombre de cases de \a b valant \a v */
+int board_count(const board_t * b, unsigned char v) {
+  int i, n = 0;
+  for(i = 0; i < b->w * b->h; ++i)
+    n += b->cells[i] == v;
+  return n;
+}
+
+/*!\brief recopie le plateau \a src dans \a dst ; si les dimensions
+ * sont les mêmes, seuls les chunks dont la version a changé sont
+ * recopiés */
+void board_copy(board_t * dst, const board_t * src) {
+  int ci, cj, i;
+  if(!dst->cells || dst->w != src->w || dst->h != src->h) {
+    board_free(dst);
+    board_init(dst, src->w, src->h, src->cells);
+    memcpy(dst->cfill, src->cfill, src->cw * src->ch * sizeof *dst->cfill);
+    memcpy(dst->cversion, src->cversion, src->cw * src->ch * sizeof *dst->cversion);
+    dst->version = src->version;
+    return;
+  }
+  for(ci = 0; ci < src->ch; ++ci)
+    for(cj = 0; cj < src->cw; ++cj) {
+      int k = ci * src->cw + cj, j0 = cj << CHUNK_SHIFT, n = MIN(CHUNK, src->w - j0);
+      if(dst->cversion[k] == src->cversion[k])
+	continue;
+      for(i = ci << CHUNK_SHIFT; i < MIN((ci + 1) << CHUNK_SHIFT, src->h); ++i)
+	memcpy(&dst->cells[i * src->w + j0], &src->cells[i * src->w + j0], n * sizeof *dst->cells);
+      dst->cfill[k] = src->cfill[k];
+      dst->cversion[k] = src->cversion[k];
+    }
+  dst->version = src->version;
+}
+
+/*!\brief charge dans \a b le niveau d'origine du jeu */
+void level_builtin(board_t * b) {
+  board_init(b, BUILTIN_W, BUILTIN_H, _builtin);
+}
+
+/*!\brief charge dans \a b le niveau binaire \a filename ; renvoie 0 (et
+ * un message sur la sortie d'erreur) en cas d'échec */
+int level_load(board_t * b, const char * filename) {
+  unsigned char * map = NULL;
+  size_t size = 0;
+  unsigned w, h, i;
+#ifdef _WIN32
+  FILE * f = fopen(filename, "rb");
+  long l;
+  if(!f || fseek(f, 0, SEEK_END) || (l = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+    perror(filename);
+    if(f) fclose(f);
+    return 0;
+  }
+  size = (size_t)l;
+  map = malloc(size ? size : 1);
+  assert(map);
+  if(fread(map, 1, size, f) != size) {
+    perror(filename);
+    fclose(f);
+    free(map);
+    return 0;
+  }
+  fclose(f);
+#else
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0) {
+    perror(filename);
+    if(fd >= 0) close(fd);
+    return 0;
+  }
+  size = (size_t)st.st_size;
+  if(size >= LEVEL_HEADER)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED || map == NULL) {
+    fprintf(stderr, "%s : fichier de niveau trop court ou illisible\n", filename);
+    return 0;
+  }
+#endif
+  w = size >= LEVEL_HEADER ? rd32(map + 8) : 0;
+  h = size >= LEVEL_HEADER ? rd32(map + 12) : 0;
+  if(size < LEVEL_HEADER || memcmp(map, "CBLV", 4) || map[4] != 1 || !w || !h ||
+     w > (1u << 15) || h > (1u << 15) || size < LEVEL_HEADER + (size_t)w * h) {
+    fprintf(stderr, "%s : ce n'est pas un niveau CBLV version 1 valide\n", filename);
+    w = 0;
+  }
+  for(i = 0; w && i < w * h; ++i)
+    if(map[LEVEL_HEADER + i] > CELL_BRICK) {
+      fprintf(stderr, "%s : case %u invalide (%d)\n", filename, i, map[LEVEL_HEADER + i]);
+      w = 0;
+    }
+  if(!w) {
+#ifdef _WIN32
+    free(map);
+#else
+    munmap(map, size);
+#endif
+    return 0;
+  }
+  memset(b, 0, sizeof *b);
+  b->w = (int)w;
+  b->h = (int)h;
+  b->cells = map + LEVEL_HEADER;
+  b->map = map;
+  b->mapsize = size;
+  board_chunks(b);
+  return 1;
+}
+
+/*!\brief écrit le plateau \a b dans le fichier de niveau binaire \a
+ * filename ; renvoie 0 en cas d'échec */
+int level_save(const board_t * b, const char * filename) {
+  unsigned char hd[LEVEL_HEADER] = { 'C', 'B', 'L', 'V', 1, 0, 0, 0 };
+  FILE * f = fopen(filename, "wb");
+  if(!f) {
+    perror(filename);
+    return 0;
+  }
+  wr32(hd + 8, (unsigned)b->w);
+  wr32(hd + 12, (unsigned)b->h);
+  if(fwrite(hd, 1, sizeof hd, f) != sizeof hd ||
+     fwrite(b->cells, 1, (size_t)b->w * b->h, f) != (size_t)b->w * b->h) {
+    perror(filename);
+    fclose(f);
+    return 0;
+  }
+  return fclose(f) == 0;
+}
+
+/*!\brief lit un entier de 32 bits petit-boutiste */
+unsigned rd32(const unsigned char * p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+/*!\brief écrit un entier de 32 bits petit-boutiste */
+void wr32(unsigned char * p, unsigned v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
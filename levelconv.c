@@ -0,0 +1,154 @@
+/*!\file levelconv.c
+ *
+ * \brief conversion des niveaux entre leur forme texte, éditable à la
+ * main, et leur forme binaire chargée par le jeu (voir level.c).
+ *
+ * Dans la forme texte, chaque ligne est une rangée du plateau et
+ * chaque caractère une case : '#' (ou '1') un mur, '=' (ou '2') une
+ * brique, '.', ' ' (ou '0') une case vide. Les lignes commençant par
+ * ';' sont des commentaires ; les rangées plus courtes que la plus
+ * longue sont complétées par des cases vides.
+ *
+ * Usage :
+ * \verbatim
+ levelconv niveau.txt niveau.lvl     texte vers binaire
+ levelconv -d niveau.lvl niveau.txt  binaire vers texte
+ levelconv -g WxH niveau.lvl         génère un grand niveau de test
+ \endverbatim
+ *
+ * \author VILFEU Vincent
+ */
+
+#include "game.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*!\brief caractères des cases dans la forme texte */
+static const char _chars[] = { '.', '#', '=' };
+
+/*!\brief affiche l'usage et quitte */
+static void usage(const char * prog) {
+  fprintf(stderr, "usage : %s niveau.txt niveau.lvl\n"
+	  "        %s -d niveau.lvl niveau.txt\n"
+	  "        %s -g WxH niveau.lvl\n", prog, prog, prog);
+  exit(1);
+}
+
+/*!\brief lit le niveau texte \a filename dans \a b ; renvoie 0 en cas
+ * d'échec */
+static int read_text(board_t * b, const char * filename) {
+  char line[1 << 16];
+  unsigned char * cells = NULL;
+  int w = 0, h = 0, ln = 0, j, n;
+  FILE * f = fopen(filename, "r");
+  if(!f) {
+    perror(filename);
+    return 0;
+  }
+  /* première passe : les dimensions */
+  while(fgets(line, sizeof line, f))
+    if(line[0] != ';') {
+      n = (int)strcspn(line, "\r\n");
+      w = MAX(w, n);
+      ++h;
+    }
+  if(!w || !h) {
+    fprintf(stderr, "%s : niveau vide\n", filename);
+    fclose(f);
+    return 0;
+  }
+  cells = calloc(w * h, sizeof *cells);
+  assert(cells);
+  rewind(f);
+  h = 0;
+  while(fgets(line, sizeof line, f)) {
+    ++ln;
+    if(line[0] == ';')
+      continue;
+    n = (int)strcspn(line, "\r\n");
+    for(j = 0; j < n; ++j)
+      switch(line[j]) {
+      case '.': case ' ': case '0': cells[h * w + j] = CELL_EMPTY; break;
+      case '#': case '1': cells[h * w + j] = CELL_WALL; break;
+      case '=': case '2': cells[h * w + j] = CELL_BRICK; break;
+      default:
+	fprintf(stderr, "%s:%d : case invalide '%c'\n", filename, ln, line[j]);
+	free(cells);
+	fclose(f);
+	return 0;
+      }
+    ++h;
+  }
+  fclose(f);
+  board_init(b, w, h, cells);
+  free(cells);
+  return 1;
+}
+
+/*!\brief écrit \a b sous forme texte dans \a filename ; renvoie 0 en
+ * cas d'échec */
+static int write_text(const board_t * b, const char * filename) {
+  int i, j;
+  FILE * f = fopen(filename, "w");
+  if(!f) {
+    perror(filename);
+    return 0;
+  }
+  fprintf(f, "; niveau de %d x %d cases (voir levelconv.c)\n", b->w, b->h);
+  for(i = 0; i < b->h; ++i) {
+    for(j = 0; j < b->w; ++j)
+      fputc(_chars[b->cells[i * b->w + j]], f);
+    fputc('\n', f);
+  }
+  return fclose(f) == 0;
+}
+
+/*!\brief remplit \a b d'un niveau de \a w x \a h cases : murs sur les
+ * côtés et en haut, bas ouvert, des blocs de briques séparés par des
+ * couloirs et quelques piliers dans la moitié haute, la moitié basse
+ * vide. Sert à éprouver le chargement et le rendu des grands
+ * plateaux. */
+static void generate(board_t * b, int w, int h) {
+  int i, j;
+  board_init(b, w, h, NULL);
+  for(i = 0; i < h; ++i)
+    for(j = 0; j < w; ++j) {
+      unsigned char v = CELL_EMPTY;
+      if(i == 0 || j == 0 || j == w - 1)
+	v = CELL_WALL;
+      else if(i < h / 2) {
+	if(i % 24 == 12 && j % 24 == 12)
+	  v = CELL_WALL;
+	else if(i % 8 != 0 && j % 12 != 0 && (i / 8 + j / 12) % 4 != 0)
+	  v = CELL_BRICK;
+      }
+      board_set(b, i, j, v);
+    }
+}
+
+int main(int argc, char ** argv) {
+  board_t b;
+  int w, h, ok;
+  if(argc != 3 && argc != 4)
+    usage(argv[0]);
+  if(argc == 4 && !strcmp(argv[1], "-d")) {
+    if(!level_load(&b, argv[2]))
+      return 1;
+    ok = write_text(&b, argv[3]);
+  } else if(argc == 4 && !strcmp(argv[1], "-g")) {
+    if(sscanf(argv[2], "%dx%d", &w, &h) != 2 || w < 3 || h < 3 || w > (1 << 15) || h > (1 << 15))
+      usage(argv[0]);
+    generate(&b, w, h);
+    ok = level_save(&b, argv[3]);
+  } else if(argc == 3) {
+    if(!read_text(&b, argv[1]))
+      return 1;
+    ok = level_save(&b, argv[2]);
+  } else
+    usage(argv[0]);
+  if(ok)
+    printf("%s : %d x %d cases, %d briques\n", argv[argc - 1], b.w, b.h, board_count(&b, CELL_BRICK));
+  board_free(&b);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,538 @@
+/*!\file obj.c
+ *
+ * \brief chargement de maillages au format Wavefront OBJ et
+ * réordonnancement de leurs triangles.
+ *
+ * Le fichier est lu par blocs et analysé ligne à ligne, sans en
+ * garder de représentation intermédiaire. Seuls sont conservés les
+ * attributs des lignes v, vt et vn, chacun une seule fois même s'il
+ * est répété dans le fichier ; les sommets distincts, triplets
+ * (position, coordonnée de texture, normale) dédoublonnés au fil des
+ * faces par une table de hachage ; et les triangles, trois indices de
+ * sommets, les polygones étant découpés en éventail. Jusqu'à la
+ * fabrication de la surface, un maillage de plusieurs millions de
+ * triangles ne coûte donc que quelques dizaines d'octets par
+ * triangle ; avec OBJ_COMPACT, la surface reçoit directement des
+ * sommets compacts (voir compact_surface), sans passer par les
+ * triangle_t, six fois plus gros. Les sommets sans normale prennent
+ * la moyenne des normales des triangles qui partagent leur position,
+ * pondérées par leur aire. Les lignes autres que v, vt, vn et f
+ * (groupes, matériaux, ...) sont ignorées.
+ *
+ * Avec OBJ_OPTIMIZE, les triangles sont réordonnés comme par Tipsify
+ * (Sander, Nehab et Barczak, 2007) : tous les triangles non encore
+ * émis d'un sommet le sont, puis le sommet suivant est pris parmi les
+ * leurs, celui qui restera le plus longtemps dans un cache FIFO de
+ * OBJ_CACHE sommets simulé ; à défaut, dans la pile des sommets déjà
+ * vus, puis dans l'ordre. Les triangles consécutifs partagent ainsi
+ * leurs sommets. Chacun de ces sauts hors du voisinage termine un
+ * groupe de triangles proches (d'au moins OBJ_CLUSTER triangles) ;
+ * les groupes sont ensuite triés, une fois pour toutes, du plus
+ * tourné vers l'extérieur du maillage au moins tourné (produit
+ * scalaire de leur normale moyenne et de la direction du centre du
+ * maillage à leur centre). Dessinés d'abord, les groupes extérieurs
+ * cachent souvent les autres, dont les pixels échouent alors au test
+ * de profondeur avant d'être coloriés. Le moteur transformant les
+ * trois sommets de chaque triangle (voir stransform_vertices), sans
+ * cache de sommets transformés, c'est cette baisse de l'overdraw qui
+ * compte ici, l'ordre de Tipsify fournissant les groupes.
+ *
+ * \author VILFEU Vincent
+ */
+#include "rasterize.h"
+#include <assert.h>
+#include <stdio.h>
+#include <math.h>
+
+/*!\brief taille des blocs lus dans le fichier, qui borne aussi la
+ * longueur d'une ligne */
+#define OBJ_BLOCK (1 << 16)
+/*!\brief taille du cache FIFO de sommets simulé par le
+ * réordonnancement */
+#define OBJ_CACHE 16
+/*!\brief nombre minimum de triangles d'un groupe trié par le
+ * réordonnancement */
+#define OBJ_CLUSTER 64
+
+/*!\brief tableau extensible d'éléments de \a size octets */
+typedef struct objarray_t objarray_t;
+struct objarray_t {
+  char * data;
+  int n, cap;
+  size_t size;
+};
+
+/*!\brief table de hachage ouverte des éléments d'un objarray_t,
+ * désignés par leur indice (-1 pour une case libre) */
+typedef struct objhash_t objhash_t;
+struct objhash_t {
+  int * slot;
+  int mask;
+};
+
+/*!\brief ce qui est gardé de l'analyse d'un fichier (voir l'en-tête
+ * du fichier) */
+typedef struct objparse_t objparse_t;
+struct objparse_t {
+  objarray_t pos, tex, nor;    /* attributs distincts : float[3],
+				  float[2] et float[3] */
+  objhash_t hpos, htex, hnor;
+  objarray_t rpos, rtex, rnor; /* pour chaque ligne v, vt et vn du
+				  fichier, l'indice de son attribut
+				  distinct (int) */
+  objarray_t vert;             /* sommets distincts : indices de
+				  leurs attributs (int[3], -1 si
+				  absent) */
+  objhash_t hvert;
+  objarray_t tri;              /* triangles : indices de leurs
+				  sommets (int[3]) */
+};
+
+/*!\brief un groupe de triangles du réordonnancement : order[first] à
+ * order[first + n - 1], et sa clé de tri */
+typedef struct objcluster_t objcluster_t;
+struct objcluster_t {
+  int first, n;
+  float key;
+};
+
+static void *      array_push(objarray_t * a);
+static int         array_intern(objarray_t * a, objhash_t * h, const void * e);
+static int         parse_line(objparse_t * p, char * line);
+static int         parse_corner(objparse_t * p, char ** s);
+static surface_t * obj_surface(const objparse_t * p, int flags, float * bmin, float * bmax);
+static void        obj_vertex(const objparse_t * p, const float * snor, int k, vertex_t * v);
+static float *     smooth_normals(const objparse_t * p);
+static int *       optimize(const objparse_t * p);
+static void        tri_geometry(const objparse_t * p, int t, float * c, float * n);
+static int         cmp_cluster(const void * a, const void * b);
+
+/*!\brief charge le fichier OBJ \a filename (voir l'en-tête du
+ * fichier) et en fait une surface, blanche, dont les triangles sont
+ * réordonnés si \a flags contient OBJ_OPTIMIZE et qui est compacte
+ * s'il contient OBJ_COMPACT. Si \a bmin et \a bmax ne sont pas NULL,
+ * ils reçoivent la boîte englobante du maillage. Renvoie NULL (et un
+ * message sur la sortie d'erreur) si le fichier est illisible, mal
+ * formé ou sans face. */
+surface_t * load_OBJ(const char * filename, int flags, float * bmin, float * bmax) {
+  objparse_t p;
+  objarray_t * a[] = { &p.pos, &p.tex, &p.nor, &p.rpos, &p.rtex, &p.rnor, &p.vert, &p.tri };
+  objhash_t * h[] = { &p.hpos, &p.htex, &p.hnor, &p.hvert };
+  surface_t * s = NULL;
+  char * buf, * line, * eol;
+  size_t len = 0, r;
+  int i, ln = 0, ok = 1;
+  FILE * f = fopen(filename, "rb");
+  if(!f) {
+    perror(filename);
+    return NULL;
+  }
+  memset(&p, 0, sizeof p);
+  p.pos.size = p.nor.size = 3 * sizeof(float);
+  p.tex.size = 2 * sizeof(float);
+  p.rpos.size = p.rtex.size = p.rnor.size = sizeof(int);
+  p.vert.size = p.tri.size = 3 * sizeof(int);
+  /* un octet de plus pour la fin de la dernière ligne */
+  buf = malloc(OBJ_BLOCK + 1);
+  assert(buf);
+  do {
+    r = fread(buf + len, 1, OBJ_BLOCK - len, f);
+    len += r;
+    /* la dernière ligne du fichier peut ne pas finir par '\n' */
+    if(!r && len)
+      buf[len++] = '\n';
+    for(line = buf; ok && (eol = memchr(line, '\n', buf + len - line)); line = eol + 1) {
+      *eol = '\0';
+      ++ln;
+      if(!(ok = parse_line(&p, line)))
+	fprintf(stderr, "%s:%d : ligne invalide : %s\n", filename, ln, line);
+    }
+    len -= line - buf;
+    memmove(buf, line, len);
+    if(ok && len == OBJ_BLOCK) {
+      fprintf(stderr, "%s:%d : ligne trop longue\n", filename, ln + 1);
+      ok = 0;
+    }
+  } while(ok && r);
+  if(ok && ferror(f)) {
+    perror(filename);
+    ok = 0;
+  }
+  fclose(f);
+  free(buf);
+  if(ok && !p.tri.n)
+    fprintf(stderr, "%s : aucune face\n", filename);
+  else if(ok)
+    s = obj_surface(&p, flags, bmin, bmax);
+  for(i = 0; i < (int)(sizeof a / sizeof *a); ++i)
+    free(a[i]->data);
+  for(i = 0; i < (int)(sizeof h / sizeof *h); ++i)
+    free(h[i]->slot);
+  return s;
+}
+
+/*!\brief ajoute un élément à la fin de \a a et renvoie son adresse */
+void * array_push(objarray_t * a) {
+  if(a->n == a->cap) {
+    a->cap = a->cap ? 2 * a->cap : 256;
+    a->data = realloc(a->data, a->cap * a->size);
+    assert(a->data);
+  }
+  return a->data + a->size * a->n++;
+}
+
+/*!\brief renvoie l'indice de l'élément de \a a égal (octet par octet)
+ * à \a e, après l'avoir ajouté à \a a s'il n'y était pas ; \a h est
+ * la table de hachage des éléments de \a a */
+int array_intern(objarray_t * a, objhash_t * h, const void * e) {
+  unsigned i, k;
+  int j;
+  /* la table est gardée au plus à moitié pleine */
+  if(2 * (a->n + 1) > h->mask + 1) {
+    h->mask = h->mask ? 2 * h->mask + 1 : 1023;
+    free(h->slot);
+    h->slot = malloc((h->mask + 1) * sizeof *h->slot);
+    assert(h->slot);
+    memset(h->slot, 0xFF, (h->mask + 1) * sizeof *h->slot);
+    for(j = 0; j < a->n; ++j) {
+      const unsigned char * b = (const unsigned char *)a->data + j * a->size;
+      /* FNV-1a */
+      for(i = 2166136261u, k = 0; k < a->size; ++k)
+	i = (i ^ b[k]) * 16777619u;
+      for(i &= h->mask; h->slot[i] >= 0; i = (i + 1) & h->mask)
+	;
+      h->slot[i] = j;
+    }
+  }
+  for(i = 2166136261u, k = 0; k < a->size; ++k)
+    i = (i ^ ((const unsigned char *)e)[k]) * 16777619u;
+  for(i &= h->mask; (j = h->slot[i]) >= 0; i = (i + 1) & h->mask)
+    if(!memcmp(a->data + j * a->size, e, a->size))
+      return j;
+  h->slot[i] = a->n;
+  memcpy(array_push(a), e, a->size);
+  return a->n - 1;
+}
+
+/*!\brief analyse la ligne \a line (sans sa fin de ligne) ; renvoie 0
+ * si elle est mal formée */
+int parse_line(objparse_t * p, char * line) {
+  char * s = line + strspn(line, " \t"), * e;
+  float v[3] = { 0.0f, 0.0f, 0.0f };
+  int i, n, min, k, first = -1, prev = -1;
+  objarray_t * a, * r;
+  objhash_t * h;
+  if(s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+    /* un polygone, découpé en éventail autour de son premier coin */
+    for(s += 1, n = 0; (k = parse_corner(p, &s)) != -1; ++n) {
+      if(k < 0)
+	return 0;
+      if(n >= 2) {
+	int * t = array_push(&p->tri);
+	t[0] = first;
+	t[1] = prev;
+	t[2] = k;
+      } else if(!n)
+	first = k;
+      prev = k;
+    }
+    return n >= 3;
+  }
+  if(s[0] != 'v')
+    return 1;
+  if(s[1] == ' ' || s[1] == '\t') {
+    a = &p->pos; h = &p->hpos; r = &p->rpos; n = min = 3; s += 1;
+  } else if(s[1] == 't' && (s[2] == ' ' || s[2] == '\t')) {
+    a = &p->tex; h = &p->htex; r = &p->rtex; n = 2; min = 1; s += 2;
+  } else if(s[1] == 'n' && (s[2] == ' ' || s[2] == '\t')) {
+    a = &p->nor; h = &p->hnor; r = &p->rnor; n = min = 3; s += 2;
+  } else
+    return 1;
+  for(i = 0; i < n; ++i, s = e) {
+    /* + 0.0f : -0 et 0 sont le même attribut */
+    v[i] = strtof(s, &e) + 0.0f;
+    if(e == s) {
+      if(i < min)
+	return 0;
+      break;
+    }
+  }
+  *(int *)array_push(r) = array_intern(a, h, v);
+  return 1;
+}
+
+/*!\brief lit en *\a s le coin de face "v", "v/vt", "v//vn" ou
+ * "v/vt/vn" (indices à partir de 1, ou négatifs pour compter depuis
+ * la dernière ligne lue) et renvoie l'indice de son sommet distinct ;
+ * -1 en fin de ligne, -2 si le coin est invalide */
+int parse_corner(objparse_t * p, char ** s) {
+  const objarray_t * r[3] = { &p->rpos, &p->rtex, &p->rnor };
+  int key[3] = { -1, -1, -1 }, i;
+  long k;
+  char * e;
+  *s += strspn(*s, " \t\r");
+  if(!**s)
+    return -1;
+  for(i = 0; i < 3; ++i) {
+    if(i) {
+      if(**s != '/')
+	break;
+      if(*++*s == '/' && i == 1)
+	continue;
+    }
+    k = strtol(*s, &e, 10);
+    if(e == *s)
+      return -2;
+    *s = e;
+    k = k < 0 ? r[i]->n + k : k - 1;
+    if(k < 0 || k >= r[i]->n)
+      return -2;
+    key[i] = ((const int *)r[i]->data)[k];
+  }
+  if(**s && !strchr(" \t\r", **s))
+    return -2;
+  return array_intern(&p->vert, &p->hvert, key);
+}
+
+/*!\brief fabrique la surface du maillage \a p (voir \ref load_OBJ) */
+surface_t * obj_surface(const objparse_t * p, int flags, float * bmin, float * bmax) {
+  const int * tri = (const int *)p->tri.data;
+  int nt = p->tri.n, i, j, c, * order = NULL;
+  float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX }, * snor = smooth_normals(p);
+  surface_t * s;
+  for(i = 0; i < p->vert.n; ++i) {
+    const float * x = (const float *)p->pos.data + 3 * ((const int *)p->vert.data)[3 * i];
+    for(c = 0; c < 3; ++c) {
+      lo[c] = MIN(lo[c], x[c]);
+      hi[c] = MAX(hi[c], x[c]);
+    }
+  }
+  if(bmin)
+    memcpy(bmin, lo, sizeof lo);
+  if(bmax)
+    memcpy(bmax, hi, sizeof hi);
+  if(flags & OBJ_OPTIMIZE)
+    order = optimize(p);
+  if(flags & OBJ_COMPACT) {
+    s = new_surface(NULL, 0, 0, 1);
+    set_compact_bounds(s, lo, hi);
+    s->cv = malloc(3 * nt * sizeof *s->cv);
+    assert(s->cv);
+    s->n = nt;
+    for(i = 0; i < nt; ++i)
+      for(j = 0; j < 3; ++j) {
+	vertex_t v;
+	obj_vertex(p, snor, tri[3 * (order ? order[i] : i) + j], &v);
+	cvertex_encode(s, &v, &(s->cv[3 * i + j]));
+	/* comme compact_surface : le rayon englobant est pris sur les
+	   positions telles qu'elles seront décompressées */
+	cvertex_decode(s, &(s->cv[3 * i + j]), &v);
+	s->radius = MAX(s->radius, sqrtf(MVEC3DOT((float *)&(v.position), (float *)&(v.position))));
+      }
+  } else {
+    triangle_t * t = malloc(nt * sizeof *t);
+    assert(t);
+    for(i = 0; i < nt; ++i) {
+      for(j = 0; j < 3; ++j)
+	obj_vertex(p, snor, tri[3 * (order ? order[i] : i) + j], &(t[i].v[j]));
+      tnormal(&t[i]);
+    }
+    s = new_surface(t, nt, 0, 1);
+  }
+  free(order);
+  free(snor);
+  return s;
+}
+
+/*!\brief remplit les attributs de \a v d'après le sommet distinct \a
+ * k de \a p ; \a snor donne la normale des sommets qui n'en ont pas
+ * (voir \ref smooth_normals) */
+void obj_vertex(const objparse_t * p, const float * snor, int k, vertex_t * v) {
+  /* on met du blanc partout */
+  const vec4 color0 = { 1.0f, 1.0f, 1.0f, 1.0f };
+  const int * key = (const int *)p->vert.data + 3 * k;
+  const float * x = (const float *)p->pos.data + 3 * key[0];
+  const float * n = key[2] >= 0 ? (const float *)p->nor.data + 3 * key[2] : &snor[3 * key[0]];
+  float l = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+  v->position.x = x[0];
+  v->position.y = x[1];
+  v->position.z = x[2];
+  v->position.w = 1.0f;
+  /* les normales du fichier ne sont pas forcément unitaires */
+  l = l > 0.0f ? 1.0f / l : 0.0f;
+  v->normal.x = n[0] * l;
+  v->normal.y = n[1] * l;
+  v->normal.z = n[2] * l;
+  v->texCoord.x = key[1] >= 0 ? ((const float *)p->tex.data)[2 * key[1]] : 0.0f;
+  v->texCoord.y = key[1] >= 0 ? ((const float *)p->tex.data)[2 * key[1] + 1] : 0.0f;
+  v->color0 = color0;
+}
+
+/*!\brief renvoie (alloué) pour chaque position de \a p la somme des
+ * normales des triangles qui l'utilisent, pondérées par leur aire ;
+ * NULL si tous les sommets ont leur normale */
+float * smooth_normals(const objparse_t * p) {
+  const int * vert = (const int *)p->vert.data, * tri = (const int *)p->tri.data;
+  int i, j, c;
+  float * snor, g[3], n[3];
+  for(i = 0; i < p->vert.n && vert[3 * i + 2] >= 0; ++i)
+    ;
+  if(i == p->vert.n)
+    return NULL;
+  snor = calloc(3 * p->pos.n, sizeof *snor);
+  assert(snor);
+  for(i = 0; i < p->tri.n; ++i) {
+    tri_geometry(p, i, g, n);
+    for(j = 0; j < 3; ++j)
+      for(c = 0; c < 3; ++c)
+	snor[3 * vert[3 * tri[3 * i + j]] + c] += n[c];
+  }
+  return snor;
+}
+
+/*!\brief met dans \a c le centre du triangle \a t de \a p et dans \a
+ * n sa normale, de longueur le double de son aire */
+void tri_geometry(const objparse_t * p, int t, float * c, float * n) {
+  const int * tri = (const int *)p->tri.data + 3 * t, * vert = (const int *)p->vert.data;
+  const float * x[3];
+  float u[3], v[3];
+  int k;
+  for(k = 0; k < 3; ++k)
+    x[k] = (const float *)p->pos.data + 3 * vert[3 * tri[k]];
+  for(k = 0; k < 3; ++k) {
+    c[k] = (x[0][k] + x[1][k] + x[2][k]) / 3.0f;
+    u[k] = x[1][k] - x[0][k];
+    v[k] = x[2][k] - x[0][k];
+  }
+  MVEC3CROSS(n, u, v);
+}
+
+/*!\brief renvoie (alloué) le nouvel ordre des triangles de \a p (voir
+ * l'en-tête du fichier) */
+int * optimize(const objparse_t * p) {
+  const int * tri = (const int *)p->tri.data;
+  int nt = p->tri.n, nv = p->vert.n, i, j, k, f, s = OBJ_CACHE + 1, cursor = 0, no = 0, nd = 0, nc = 0;
+  int * start = calloc(nv + 1, sizeof *start), * adj = malloc(3 * nt * sizeof *adj);
+  int * live = malloc(nv * sizeof *live), * stamp = calloc(nv, sizeof *stamp);
+  int * dead = malloc(3 * nt * sizeof *dead), * order = malloc(nt * sizeof *order), * out;
+  unsigned char * emitted = calloc(nt, 1);
+  objcluster_t * cl = malloc((nt / OBJ_CLUSTER + 1) * sizeof *cl);
+  float m[3] = { 0.0f, 0.0f, 0.0f }, area = 0.0f, g[3], n[3];
+  assert(start && adj && live && stamp && dead && order && emitted && cl);
+  /* les triangles de chaque sommet : adj[start[v]] à adj[start[v +
+     1] - 1] ; live compte ceux qui restent à émettre */
+  for(i = 0; i < 3 * nt; ++i)
+    ++start[tri[i] + 1];
+  for(k = 0; k < nv; ++k) {
+    live[k] = start[k + 1];
+    start[k + 1] += start[k];
+  }
+  for(i = 0; i < 3 * nt; ++i)
+    adj[start[tri[i]] + stamp[tri[i]]++] = i / 3;
+  memset(stamp, 0, nv * sizeof *stamp);
+  /* stamp[v] est l'instant d'entrée de v dans le cache simulé, qui en
+     est sorti si s - stamp[v] > OBJ_CACHE */
+  cl[0].first = 0;
+  for(f = tri[0]; f >= 0; ) {
+    int d0 = nd, best = -1, bestp = 0;
+    for(j = start[f]; j < start[f + 1]; ++j) {
+      int t = adj[j];
+      if(emitted[t])
+	continue;
+      emitted[t] = 1;
+      order[no++] = t;
+      for(k = 0; k < 3; ++k) {
+	int v = tri[3 * t + k];
+	dead[nd++] = v;
+	--live[v];
+	if(s - stamp[v] > OBJ_CACHE)
+	  stamp[v] = s++;
+      }
+    }
+    /* parmi les sommets des triangles émis qui en ont encore, celui
+       qui restera le plus longtemps dans le cache, même après l'ajout
+       des sommets de ses triangles */
+    for(j = d0; j < nd; ++j) {
+      int v = dead[j], pr;
+      if(live[v] <= 0)
+	continue;
+      pr = s - stamp[v] + 2 * live[v] <= OBJ_CACHE ? s - stamp[v] : 0;
+      if(pr > bestp) {
+	bestp = pr;
+	best = v;
+      }
+    }
+    if(best < 0) {
+      /* un saut : le dernier sommet vu qui a encore des triangles,
+	 sinon le suivant dans l'ordre */
+      while(best < 0 && nd > 0)
+	if(live[dead[--nd]] > 0)
+	  best = dead[nd];
+      while(best < 0 && cursor < nv)
+	if(live[cursor++] > 0)
+	  best = cursor - 1;
+      if(no - cl[nc].first >= OBJ_CLUSTER) {
+	cl[nc].n = no - cl[nc].first;
+	cl[++nc].first = no;
+      }
+    }
+    f = best;
+  }
+  assert(no == nt);
+  if((cl[nc].n = no - cl[nc].first) > 0)
+    ++nc;
+  /* centre du maillage, puis clé de chaque groupe */
+  for(i = 0; i < nt; ++i) {
+    float a;
+    tri_geometry(p, i, g, n);
+    a = sqrtf(MVEC3DOT(n, n));
+    for(k = 0; k < 3; ++k)
+      m[k] += a * g[k];
+    area += a;
+  }
+  for(k = 0; k < 3 && area > 0.0f; ++k)
+    m[k] /= area;
+  for(i = 0; i < nc; ++i) {
+    float c[3] = { 0.0f, 0.0f, 0.0f }, nn[3] = { 0.0f, 0.0f, 0.0f }, ca = 0.0f, l;
+    for(j = cl[i].first; j < cl[i].first + cl[i].n; ++j) {
+      float a;
+      tri_geometry(p, order[j], g, n);
+      a = sqrtf(MVEC3DOT(n, n));
+      for(k = 0; k < 3; ++k) {
+	c[k] += a * g[k];
+	nn[k] += n[k];
+      }
+      ca += a;
+    }
+    l = sqrtf(MVEC3DOT(nn, nn));
+    cl[i].key = 0.0f;
+    if(ca > 0.0f && l > 0.0f)
+      for(k = 0; k < 3; ++k)
+	cl[i].key += (c[k] / ca - m[k]) * nn[k] / l;
+  }
+  qsort(cl, nc, sizeof *cl, cmp_cluster);
+  /* order est réécrit dans l'ordre des groupes */
+  out = malloc(nt * sizeof *out);
+  assert(out);
+  for(i = 0, no = 0; i < nc; ++i)
+    for(j = cl[i].first; j < cl[i].first + cl[i].n; ++j)
+      out[no++] = order[j];
+  free(cl);
+  free(emitted);
+  free(order);
+  free(dead);
+  free(stamp);
+  free(live);
+  free(adj);
+  free(start);
+  return out;
+}
+
+/*!\brief tri des groupes par clé décroissante, puis dans l'ordre de
+ * Tipsify */
+int cmp_cluster(const void * a, const void * b) {
+  const objcluster_t * ca = a, * cb = b;
+  if(ca->key != cb->key)
+    return ca->key < cb->key ? 1 : -1;
+  return ca->first - cb->first;
+}
@@ -0,0 +1,164 @@
+/*!\file pipeline.c
+ *
+ * \brief exécution des frames en pipeline : la frame N est rastérisée
+ * par un thread dédié pendant que le thread appelant (celui de
+ * l'affichage) transforme la frame N + 1, la simulation pouvant
+ * tourner dans un troisième (voir game.c).
+ *
+ * Entre pipeline_begin et pipeline_end, le rendu du thread appelant
+ * est enregistré dans une display list (voir dlist_record) : les
+ * sommets sont transformés, les triangles cullés et rangés, mais rien
+ * n'est rastérisé. pipeline_end passe la liste au thread de
+ * rastérisation par une file bornée de PIPELINE_SLOTS listes : si
+ * elles sont toutes en attente ou en cours, pipeline_begin attend
+ * qu'une se libère. Le thread de rastérisation joue les listes dans
+ * l'ordre dans son propre buffer de couleur, qui garde la frame
+ * précédente (le rendu incrémental de window.c en a besoin), puis le
+ * recopie dans le buffer présenté, que pipeline_present recopie à son
+ * tour dans l'écran.
+ *
+ * pipeline_present peut attendre la frame qui vient d'être soumise
+ * (pas de latence ajoutée, mais transformation et rastérisation ne se
+ * recouvrent pas) ou se contenter de la précédente : une frame de
+ * latence en plus, mais le débit n'est plus borné que par l'étape la
+ * plus lente.
+ *
+ * \author VILFEU Vincent
+ */
+#include "rasterize.h"
+#include <assert.h>
+
+/*!\brief nombre de display lists (frames en vol) */
+#define PIPELINE_SLOTS 2
+
+/*!\brief les display lists, la frame N utilisant la liste N %
+ * PIPELINE_SLOTS */
+static dlist_t * _lists[PIPELINE_SLOTS];
+/*!\brief nombre de frames soumises et nombre de frames rastérisées */
+static int _submitted = 0, _done = 0;
+/*!\brief dimensions des frames et buffers de couleur : celui où
+ * rastérise le thread et celui qui est présenté */
+static int _w = 0, _h = 0;
+static GLuint * _work = NULL, * _front = NULL;
+/*!\brief synchronisation avec le thread de rastérisation */
+static SDL_mutex * _mutex = NULL;
+static SDL_cond * _cond = NULL;
+static SDL_Thread * _thread = NULL;
+static int _quit = 0;
+
+static int raster_thread(void * data);
+
+/*!\brief crée les display lists et lance le thread de rastérisation */
+void pipeline_init(void) {
+  int i;
+  assert(!_thread);
+  for(i = 0; i < PIPELINE_SLOTS; ++i)
+    _lists[i] = dlist_new();
+  _submitted = _done = _quit = 0;
+  _mutex = SDL_CreateMutex();
+  _cond = SDL_CreateCond();
+  assert(_mutex && _cond);
+  _thread = SDL_CreateThread(raster_thread, "rasterisation", NULL);
+  assert(_thread);
+}
+
+/*!\brief termine les frames en vol, arrête le thread et libère le
+ * tout */
+void pipeline_quit(void) {
+  int i;
+  if(!_thread)
+    return;
+  SDL_LockMutex(_mutex);
+  _quit = 1;
+  SDL_CondBroadcast(_cond);
+  SDL_UnlockMutex(_mutex);
+  SDL_WaitThread(_thread, NULL);
+  _thread = NULL;
+  SDL_DestroyCond(_cond);
+  SDL_DestroyMutex(_mutex);
+  for(i = 0; i < PIPELINE_SLOTS; ++i) {
+    dlist_free(_lists[i]);
+    _lists[i] = NULL;
+  }
+  free(_work);
+  free(_front);
+  _work = _front = NULL;
+  _w = _h = 0;
+}
+
+/*!\brief commence la frame suivante, de \a w x \a h pixels : attend
+ * qu'une display list soit libre puis y enregistre le rendu du thread
+ * appelant jusqu'à \ref pipeline_end */
+void pipeline_begin(int w, int h) {
+  SDL_LockMutex(_mutex);
+  /* la liste de la frame _submitted a servi à la frame _submitted -
+     PIPELINE_SLOTS, et changer de dimensions demande que tout soit
+     rastérisé */
+  while(_submitted - _done >= PIPELINE_SLOTS || ((w != _w || h != _h) && _done < _submitted))
+    SDL_CondWait(_cond, _mutex);
+  if(w != _w || h != _h) {
+    free(_work);
+    free(_front);
+    _work = calloc(w * h, sizeof *_work);
+    _front = calloc(w * h, sizeof *_front);
+    assert(_work && _front);
+    _w = w;
+    _h = h;
+  }
+  SDL_UnlockMutex(_mutex);
+  dlist_record(_lists[_submitted % PIPELINE_SLOTS], w, h);
+}
+
+/*!\brief termine l'enregistrement de la frame et la passe au thread
+ * de rastérisation */
+void pipeline_end(void) {
+  dlist_record(NULL, 0, 0);
+  SDL_LockMutex(_mutex);
+  ++_submitted;
+  SDL_CondBroadcast(_cond);
+  SDL_UnlockMutex(_mutex);
+}
+
+/*!\brief recopie dans \a pixels (aux dimensions de la dernière frame
+ * commencée) la dernière frame rastérisée : la dernière soumise si \a
+ * latency est nul, sinon la précédente, sans attendre la dernière.
+ * Renvoie 0 s'il n'y a encore rien à présenter. */
+int pipeline_present(GLuint * pixels, int latency) {
+  int ok;
+  SDL_LockMutex(_mutex);
+  while(_done < _submitted - (latency ? 1 : 0))
+    SDL_CondWait(_cond, _mutex);
+  if((ok = _done > 0))
+    memcpy(pixels, _front, _w * _h * sizeof *pixels);
+  SDL_UnlockMutex(_mutex);
+  return ok;
+}
+
+/*!\brief le thread de rastérisation : joue dans l'ordre les display
+ * lists soumises */
+int raster_thread(void * data) {
+  (void)data;
+  SDL_LockMutex(_mutex);
+  for(;;) {
+    dlist_t * l;
+    GLuint * work;
+    int w, h;
+    while(_done == _submitted && !_quit)
+      SDL_CondWait(_cond, _mutex);
+    if(_done == _submitted)
+      break;
+    l = _lists[_done % PIPELINE_SLOTS];
+    work = _work;
+    w = _w;
+    h = _h;
+    SDL_UnlockMutex(_mutex);
+    dlist_play(l, work, w, h);
+    SDL_LockMutex(_mutex);
+    memcpy(_front, work, w * h * sizeof *_front);
+    ++_done;
+    SDL_CondBroadcast(_cond);
+  }
+  SDL_UnlockMutex(_mutex);
+  free_depth_map();
+  return 0;
+}
@@ -0,0 +1,165 @@
+/*!\file profiler.c
+ * \brief instrumentation du moteur de rendu : temps par étape du
+ * pipeline et compteurs de triangles et de pixels.
+ *
+ * L'instrumentation n'est compilée que si RASTERIZE_PROFILE est
+ * défini (make PROFILE=1) ; sinon les macros PROF_* de rasterize.h
+ * sont vides et les fonctions de ce fichier ne font rien.
+ *
+ * Chaque thread qui rend (pipeline, jobs) cumule ses temps et ses
+ * compteurs dans son propre bloc \ref prof_thread_t, enregistré à sa
+ * première mesure ; \ref prof_frame_end fait la somme des blocs sans
+ * les modifier, en retranchant ce qu'il en avait lu à la frame
+ * précédente. Les blocs des threads terminés restent dans la liste
+ * (ils ne changent plus).
+ *
+ * \author Farès BELHADJ, amsi@up8.edu
+ * \date November 2021.
+ */
+
+#include "rasterize.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef RASTERIZE_PROFILE
+
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#  elif defined(__x86_64__) || defined(__i386__)
+#    include <x86intrin.h>
+#  endif
+
+/*!\brief noms des étapes, dans l'ordre de pstage_t */
+static const char * _stage_names[PROF_NSTAGES] = {
+  "stransform", "clip2_unit_cube", "fill_triangle", "abscisses", "horizontal_line", "shading"
+};
+
+/*!\brief bloc du thread courant (NULL avant sa première mesure) */
+THREAD_LOCAL prof_thread_t * _prof_self = NULL;
+/*!\brief liste des blocs de tous les threads et son verrou */
+static prof_thread_t * _threads = NULL;
+static SDL_SpinLock _threads_lock = 0;
+
+/*!\brief cumul depuis le dernier affichage */
+static prof_frame_t _acc;
+/*!\brief statistiques de la dernière frame terminée */
+static prof_frame_t _last;
+/*!\brief nombre de frames cumulées dans \ref _acc */
+static int _nframes = 0;
+/*!\brief afficher les statistiques toutes les \ref _interval frames
+ * (0 pour ne jamais afficher) */
+static int _interval = 0;
+/*!\brief début de la frame en cours en ticks et en temps système */
+static unsigned long long _t0 = 0;
+static Uint64 _pc0 = 0;
+
+/*!\brief compteur de cycles (rdtsc) quand il est disponible, sinon
+ * compteur haute résolution de SDL */
+unsigned long long prof_ticks(void) {
+#  if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#  else
+  return SDL_GetPerformanceCounter();
+#  endif
+}
+
+/*!\brief alloue et enregistre le bloc du thread courant */
+prof_thread_t * prof_thread(void) {
+  prof_thread_t * p = calloc(1, sizeof *p);
+  assert(p);
+  SDL_AtomicLock(&_threads_lock);
+  p->next = _threads;
+  _threads = p;
+  SDL_AtomicUnlock(&_threads_lock);
+  return _prof_self = p;
+}
+
+/*!\brief ajoute à \a last la progression de \a v depuis \a seen */
+static inline void delta(unsigned long long * v, unsigned long long * seen, unsigned long long * last) {
+  unsigned long long x = PROF_LOAD(v);
+  *last += x - *seen;
+  *seen = x;
+}
+
+/*!\brief termine la frame en cours : ses statistiques deviennent
+ * celles renvoyées par \ref prof_get et s'ajoutent au cumul affiché
+ * toutes les N frames (voir \ref prof_set_dump_interval). */
+void prof_frame_end(void) {
+  int i;
+  prof_thread_t * p;
+  unsigned long long t = prof_ticks();
+  Uint64 pc = SDL_GetPerformanceCounter();
+  if(_t0) {
+    _last.frame_ticks = t - _t0;
+    _last.frame_ms = 1000.0 * (pc - _pc0) / SDL_GetPerformanceFrequency();
+  }
+  _t0 = t;
+  _pc0 = pc;
+  memset(_last.ticks, 0, sizeof _last.ticks);
+  memset(_last.counters, 0, sizeof _last.counters);
+  SDL_AtomicLock(&_threads_lock);
+  for(p = _threads; p; p = p->next) {
+    for(i = 0; i < PROF_NSTAGES; ++i)
+      delta(&p->ticks[i], &p->seen_ticks[i], &_last.ticks[i]);
+    for(i = 0; i < PROF_NCOUNTERS; ++i)
+      delta(&p->counters[i], &p->seen_counters[i], &_last.counters[i]);
+  }
+  SDL_AtomicUnlock(&_threads_lock);
+  for(i = 0; i < PROF_NSTAGES; ++i)
+    _acc.ticks[i] += _last.ticks[i];
+  for(i = 0; i < PROF_NCOUNTERS; ++i)
+    _acc.counters[i] += _last.counters[i];
+  _acc.frame_ticks += _last.frame_ticks;
+  _acc.frame_ms += _last.frame_ms;
+  if(_interval > 0 && ++_nframes >= _interval) {
+    prof_dump(stdout);
+    memset(&_acc, 0, sizeof _acc);
+    _nframes = 0;
+  }
+}
+
+/*!\brief affiche dans \a f la moyenne par frame des statistiques
+ * cumulées depuis le dernier affichage. Les temps des étapes sont
+ * inclusifs : fill_triangle comprend abscisses et horizontal_line,
+ * qui comprend le shading ; stransform comprend le clipping. */
+void prof_dump(FILE * f) {
+  int i;
+  double n = _nframes ? _nframes : 1, ms_per_tick;
+  const unsigned long long * c = _acc.counters;
+  ms_per_tick = _acc.frame_ticks ? _acc.frame_ms / _acc.frame_ticks : 0.0;
+  fprintf(f, "[prof] %d frames, %.3f ms/frame\n", _nframes, _acc.frame_ms / n);
+  for(i = 0; i < PROF_NSTAGES; ++i)
+    fprintf(f, "  %-16s %9.3f ms %12.0f ticks\n", _stage_names[i],
+	    _acc.ticks[i] * ms_per_tick / n, _acc.ticks[i] / n);
+  fprintf(f, "  triangles        submitted %.0f culled %.0f out %.0f clipped %.0f degenerate %.0f rasterized %.0f (tiny %.0f tiled %.0f)\n",
+	  c[PROF_TRI_SUBMITTED] / n, c[PROF_TRI_CULLED] / n, c[PROF_TRI_OUT] / n,
+	  c[PROF_TRI_CLIPPED] / n, c[PROF_TRI_DEGENERATE] / n, c[PROF_TRI_RASTERIZED] / n,
+	  c[PROF_TRI_TINY] / n, c[PROF_TRI_TILED] / n);
+  fprintf(f, "  pixels           tested %.0f passed %.0f shaded %.0f covered %.0f skipped %.0f overdraw %.2f\n",
+	  c[PROF_PIX_TESTED] / n, c[PROF_PIX_PASSED] / n, c[PROF_PIX_SHADED] / n, c[PROF_PIX_COVERED] / n,
+	  c[PROF_PIX_SKIPPED] / n,
+	  c[PROF_PIX_COVERED] ? c[PROF_PIX_SHADED] / (double)c[PROF_PIX_COVERED] : 0.0);
+  fflush(f);
+}
+
+/*!\brief copie dans \a f les statistiques de la dernière frame */
+void prof_get(prof_frame_t * f) {
+  *f = _last;
+}
+
+/*!\brief affiche les statistiques sur la sortie standard toutes les
+ * \a n frames (0 pour désactiver l'affichage) */
+void prof_set_dump_interval(int n) {
+  _interval = n;
+}
+
+#else /* RASTERIZE_PROFILE */
+
+unsigned long long prof_ticks(void) { return 0; }
+void prof_frame_end(void) {}
+void prof_dump(FILE * f) {}
+void prof_get(prof_frame_t * f) { memset(f, 0, sizeof *f); }
+void prof_set_dump_interval(int n) {}
+
+#endif /* RASTERIZE_PROFILE */
@@ -12,12 +12,186 @@
 
 #include "rasterize.h"
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
+
+/*!\brief nombre de fragments éclairés d'un coup par \ref phong_span */
+#define PHONG_CHUNK 64
+/*!\brief un triangle dont la boîte englobante à l'écran fait moins de
+ * TINY_TRI_PX pixels de côté est rastérisé pixel par pixel (\ref
+ * raster_tiny) */
+#define TINY_TRI_PX 4
+/*!\brief un triangle dont la boîte englobante à l'écran fait au moins
+ * TILED_TRI_PX pixels de côté est rastérisé par tuiles (\ref
+ * fill_triangle_tiled) */
+#define TILED_TRI_PX 64
+/*!\brief côté des tuiles de \ref fill_triangle_tiled */
+#define TILE 32
+/*!\brief hauteur minimale des bandes d'une display list jouée en
+ * parallèle, voir \ref dlist_play */
+#define DLIST_BAND_MIN 16
+/*!\brief nombre de surfaces par tâche de \ref
+ * transform_n_rasterize_surfaces */
+#define SURFACES_GRAIN 2
+/*!\brief nombre de triangles d'une surface compacte décompressés,
+ * transformés et rastérisés d'un coup, voir \ref compact_batches */
+#define WORK_BATCH 256
+/*!\brief nombre maximal de segments gardés par ligne du S-buffer,
+ * voir \ref set_span_buffer */
+#define SBUF_SPANS 32
+/*!\brief marge sur les profondeurs comparées par le S-buffer,
+ * au-delà des erreurs d'arrondi de leur interpolation */
+#define SBUF_EPS 1e-6f
+
+/*!\brief les fonctions d'arêtes d'un triangle à l'écran, évaluées au
+ * centre du pixel (x, y) : e_i(x, y) = a[i] x + b[i] y + c[i] est
+ * positive ou nulle si ce centre est du côté intérieur de l'arête
+ * opposée au sommet i, et e_i / area y est le poids (barycentrique)
+ * du sommet i. Elles sont calculées en virgule fixe, exactement, à
+ * partir des positions fx, fy des sommets (voir \ref tri_edges). */
+typedef struct edges_t edges_t;
+struct edges_t {
+  int64_t a[3], b[3], c[3], area;
+};
+
+/*!\brief les commandes d'une display list (voir \ref dlist_record) */
+enum {
+  DL_CLEAR_COLOR = 0,
+  DL_CLEAR_DEPTH,
+  DL_SCISSOR,
+  DL_NO_SCISSOR,
+  DL_TRIANGLES,
+  DL_IMPOSTOR
+};
+/*!\brief une commande d'une display list. Pour DL_TRIANGLES et
+ * DL_IMPOSTOR, \a s est une copie de la surface au moment du dessin
+ * (options, couleurs, fonctions, lumières déjà dans le repère objet)
+ * dont les \a s.n triangles, déjà transformés, sont rangés à partir
+ * de \a first dans ceux de la liste ; la texture et la correction de
+ * perspective sont celles qui étaient en place. */
+typedef struct dcmd_t dcmd_t;
+struct dcmd_t {
+  int type;
+  GLuint color;          /* DL_CLEAR_COLOR */
+  int rect[4];           /* DL_SCISSOR */
+  surface_t s;
+  size_t first;
+  texture_t tex;         /* la texture courante */
+  int persp;
+  float mv[16], inv[16], proj[16], r; /* DL_IMPOSTOR, voir sphere_impostor */
+};
+/*!\brief une display list : les commandes de rendu d'une frame,
+ * enregistrées par un thread et jouées par un autre */
+struct dlist_t {
+  int w, h;              /* dimensions de la cible */
+  int visibility;        /* jouée en deux passes, voir
+			    set_visibility_buffer */
+  int sbuffer;           /* jouée avec le S-buffer, voir
+			    set_span_buffer */
+  int affine;            /* pas de l'interpolation exacte, voir
+			    set_affine_span */
+  dcmd_t * cmds;
+  int ncmds, capcmds;
+  triangle_t * tris;     /* les triangles transformés de toutes les
+			    commandes */
+  size_t ntris, captris;
+};
+/*!\brief l'intervalle [x0, x1] d'un segment interpolé affinement
+ * entre les valeurs exactes \a v[0] et \a v[1] de ses bornes, \a dq
+ * valant 1 / (x1 - x0), voir \ref set_affine_span */
+typedef struct affine_t affine_t;
+struct affine_t {
+  int x0, x1;
+  float dq;
+  int tex, s, e; /* attributs interpolés, voir \ref interp_range */
+  vertex_t v[2];
+};
+/*!\brief un segment [x0, x1] d'une ligne du S-buffer, sur lequel
+ * la profondeur vaut au moins \a z */
+typedef struct sspan_t sspan_t;
+struct sspan_t {
+  int x0, x1;
+  float z;
+};
+/*!\brief un pixel du visibility buffer : la commande (plus un, 0 si
+ * le pixel n'est pas à colorier) et le triangle de la display list
+ * qui y est visible */
+typedef struct vis_t vis_t;
+struct vis_t {
+  int draw, tri;
+};
+/*!\brief l'état de la rastérisation d'un thread, mis de côté le
+ * temps qu'il joue une bande de display list (voir \ref dlist_play) */
+typedef struct rstate_t rstate_t;
+struct rstate_t {
+  texture_t tex;
+  float * depth;
+  int depthW, depthH;
+  GLuint * fb;
+  int fbW, fbH, fb_user;
+  int scissor[4], scissor_on, clip[4], band[2], persp, sbuffer, affine;
+  dlist_t * rec;
+};
+/*!\brief une display list jouée par bandes de \a band lignes */
+typedef struct dplay_t dplay_t;
+struct dplay_t {
+  dlist_t * l;
+  GLuint * pixels;
+  int band;
+};
+/*!\brief des surfaces transformées en parallèle, voir \ref
+ * transform_n_rasterize_surfaces */
+typedef struct stransform_t stransform_t;
+struct stransform_t {
+  surface_t ** s;
+  float * model_view_matrix, * projection_matrix, * viewport;
+};
 
 /* bloc de fonctions locales (static) */
+static inline void    get_target(void);
+static inline dcmd_t * dlist_push(dlist_t * l, int type);
+static inline void    dlist_surface(surface_t * s);
+static inline void    dlist_impostor(surface_t * s, float * model_view_matrix, float * inv_model_view_matrix, float * projection_matrix, float r);
+static        void    dlist_play_bands(void * data, int b0, int b1);
+static inline void    dlist_play_rows(dlist_t * l, GLuint * pixels, int y0, int y1);
+static inline void    save_state(rstate_t * st);
+static inline void    vis_resolve(dlist_t * l);
+static inline void    restore_state(const rstate_t * st);
+static inline void    sbuf_sync(void);
+static inline int     sbuf_clip(int y, int x0, int x1, float z, int (*runs)[2]);
+static inline void    sbuf_insert(int y, int x0, int x1, float z);
+static inline void    sbuf_piece(sspan_t * t, int * n, int x0, int x1, float z);
+static        void    stransform_range(void * data, int i0, int i1);
+static inline void    prepare_target(float * projection_matrix, float * viewport);
+static inline void    frustum_planes(float * projection_matrix, float planes[6][4]);
+static inline float   projected_radius(float r, float z, float * projection_matrix);
+static inline float   lod_px(const surface_t * s, int l, int nm);
+static inline int     select_lod(surface_t * s, float px, int * lod);
+static inline void    sphere_impostor(surface_t * s, float * model_view_matrix, float * inv_model_view_matrix, float * projection_matrix, float r);
+static inline triangle_t * work_buffer(void);
+static inline void    work_impostor(surface_t * s);
+static inline void    compact_batches(surface_t * s, float * model_view_matrix, float * projection_matrix, float * viewport);
+static inline void    rasterize_surface(surface_t * s);
 static inline void    fill_triangle(surface_t * s, triangle_t * t);
+static inline int64_t tri_edges(triangle_t * t, edges_t * e);
+static inline int     tri_box(const triangle_t * t, int * box);
+static inline void    row_span(const edges_t * e, int y, int x0, int x1, int * xs, int * xe);
+static inline void    span_ends(void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float), triangle_t * t, const edges_t * e, int y, int xs, int xe, vertex_t * b);
+static inline void    span_affine(void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float), vertex_t * b, int xs, int xe, float deltap, int x, affine_t * af, vertex_t * f);
+static inline void    interp_range(void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float), int * tex, int * s, int * e);
+static inline void    affine_lerp(vertex_t * r, const vertex_t * a, const vertex_t * b, float q, int s, int e);
+static inline void    raster_tiny(surface_t * s, triangle_t * t, const edges_t * e, int x0, int y0, int x1, int y1);
+static inline void    fill_triangle_tiled(surface_t * s, triangle_t * t, const edges_t * e, int x0, int y0, int x1, int y1);
+static inline void    raster_block(surface_t * s, triangle_t * t, const edges_t * e, int x0, int y0, int x1, int y1);
 static inline void    abscisses(surface_t * s, vertex_t * p0, vertex_t * p1, vertex_t * absc, int replace);
 static inline void    horizontal_line(surface_t * s, vertex_t * vG, vertex_t * vD);
+static inline void    horizontal_line_phong(surface_t * s, vertex_t * vG, vertex_t * vD);
+static inline void    phong_flush(surface_t * s, GLuint * image, vertex_t * v, int * o, int n);
+static inline void    phong_span(surface_t * s, float * nx, float * ny, float * nz, float * px, float * py, float * pz, float * li, float * sp, int n);
+static inline float   frsqrt(float x);
 static inline void    shading_none(surface_t * s, GLuint * pcolor, vertex_t * v);
+static inline GLuint  texel(const texture_t * t, const vec2 * tc);
+static inline GLuint  bc1_texel(const texture_t * t, int x, int y);
 static inline void    shading_only_tex(surface_t * s, GLuint * pcolor, vertex_t * v);
 static inline void    shading_only_color_CM(surface_t * s, GLuint * pcolor, vertex_t * v);
 static inline void    shading_only_color(surface_t * s, GLuint * pcolor, vertex_t * v);
@@ -25,55 +199,679 @@ static inline void    shading_all_CM(surface_t * s, GLuint * pcolor, vertex_t *
 static inline void    shading_all(surface_t * s, GLuint * pcolor, vertex_t * v);
 static inline void    interpolate(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb, int s, int e);
 static inline void    metainterpolate_none(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb);
+static inline void    metainterpolate_depth(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb);
 static inline void    metainterpolate_only_tex(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb);
 static inline void    metainterpolate_only_color(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb);
 static inline void    metainterpolate_all(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb);
+static inline void    metainterpolate_phong(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb);
+static inline void    metainterpolate_phong_all(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb);
 static inline GLuint  rgba(GLubyte r, GLubyte g, GLubyte b, GLubyte a);
 static inline GLubyte red(GLuint c);
 static inline GLubyte green(GLuint c);
 static inline GLubyte blue(GLuint c);
 static inline GLubyte alpha(GLuint c);
-static        void    pquit(void); 
-
-/*!\brief la texture courante à utiliser en cas de mapping de texture */
-static GLuint * _tex = NULL;
-/*!\brief la largeur de la texture courante à utiliser en cas de
- * mapping de texture */
-static GLuint _texW = 0;
-/*!\brief la hauteur de la texture courante à utiliser en cas de
- * mapping de texture */
-static GLuint _texH = 0;
+
+/* l'état de la rastérisation (cible, profondeur, texture, scissor)
+ * est propre à chaque thread (THREAD_LOCAL) : le thread qui
+ * transforme une frame et ceux qui rastérisent des bandes de la
+ * précédente (voir pipeline.c et jobs.c) ont chacun le leur */
+
+/*!\brief la texture courante, mappée sur les surfaces qui n'ont pas
+ * la leur (voir set_texture_handle) */
+static THREAD_LOCAL texture_t _tex = { NULL, 0, 0, 0, 0, 0, TF_RGBA };
+/*!\brief nombre d'entrées du cache de palettes BC1 de chaque thread
+ * (une puissance de 2) */
+#define BC1_CACHE 8
+/*!\brief une palette BC1 décodée et les deux couleurs (clé) dont elle
+ * est tirée */
+typedef struct bc1_entry_t bc1_entry_t;
+struct bc1_entry_t {
+  GLuint c01, pal[4];
+};
+/*!\brief le cache des dernières palettes BC1 décodées par le thread,
+ * indexé par la position du bloc dans l'image ; une entrée vide a
+ * pal[0] nul, ce que n'est jamais une palette (pal[0] est opaque) */
+static THREAD_LOCAL bc1_entry_t _bc1_cache[BC1_CACHE];
 /*!\brief un buffer de depth pour faire le z-test */
-static float * _depth = NULL;
+static THREAD_LOCAL float * _depth = NULL;
+/*!\brief dimensions du buffer de depth */
+static THREAD_LOCAL int _depthW = 0, _depthH = 0;
+/*!\brief le buffer de profondeur des bandes de display list que joue
+ * ce thread : un thread qui attend des tâches au milieu de son propre
+ * rendu peut avoir à en jouer une, qui ne doit pas toucher à \a
+ * _depth */
+static THREAD_LOCAL float * _play_depth = NULL;
+static THREAD_LOCAL int _play_depthW = 0, _play_depthH = 0;
+/*!\brief le visibility buffer des bandes de display list que joue ce
+ * thread (tout à zéro hors de \ref dlist_play_rows) et ses dimensions */
+static THREAD_LOCAL vis_t * _play_vis = NULL;
+static THREAD_LOCAL int _play_visW = 0, _play_visH = 0;
+/*!\brief pendant la première passe du visibility buffer, le buffer
+ * (NULL sinon), la commande en cours (plus un) et le rectangle des
+ * pixels où un triangle a été gardé */
+static THREAD_LOCAL vis_t * _vis = NULL;
+static THREAD_LOCAL int _vis_draw = 0, _vis_box[4];
+/*!\brief flag du visibility buffer pour les display lists
+ * enregistrées par ce thread, voir \ref set_visibility_buffer */
+static THREAD_LOCAL int _visibility = 0;
+/*!\brief le S-buffer : par ligne, jusqu'à SBUF_SPANS segments triés
+ * et disjoints (_sbufn[y] segments à partir de _sbuf[y *
+ * SBUF_SPANS]), chacun avec un minorant de la profondeur de ses
+ * pixels dans _sbuf_depth, le buffer de profondeur qu'il décrit ; son
+ * nombre de lignes et le flag d'activation, voir \ref set_span_buffer */
+static THREAD_LOCAL sspan_t * _sbuf = NULL;
+static THREAD_LOCAL int * _sbufn = NULL, _sbufH = 0;
+static THREAD_LOCAL float * _sbuf_depth = NULL;
+static THREAD_LOCAL int _span_buffer = 0;
+/*!\brief en projection perspective, pas (en pixels) des valeurs
+ * exactes entre lesquelles les attributs des segments sont interpolés
+ * affinement, 0 pour les calculer exactement à chaque pixel, voir
+ * \ref set_affine_span */
+static THREAD_LOCAL int _affine_span = 0;
+/*!\brief la cible du rendu (pixels et dimensions) ; par défaut le
+ * screen GL4Dummies courant */
+static THREAD_LOCAL GLuint * _fb = NULL;
+static THREAD_LOCAL int _fbW = 0, _fbH = 0;
+/*!\brief flag indiquant que la cible du rendu a été donnée par \ref
+ * set_render_target plutôt que tirée du screen courant */
+static THREAD_LOCAL int _fb_user = 0;
+/*!\brief le rectangle de scissor (x0, y0, x1, y1, pixels inclus) et
+ * son flag d'activation, voir \ref set_scissor */
+static THREAD_LOCAL int _scissor[4] = { 0, 0, -1, -1 }, _scissor_on = 0;
+/*!\brief le rectangle de pixels (x0, y0, x1, y1 inclus) où le rendu
+ * est permis : la cible, réduite au scissor s'il est actif ; tenu à
+ * jour par \ref get_target */
+static THREAD_LOCAL int _clip[4] = { 0, 0, -1, -1 };
+/*!\brief les lignes (y0, y1 inclus) auxquelles est limité le rendu
+ * de ce thread pendant qu'il joue une bande de display list, voir
+ * \ref dlist_play */
+static THREAD_LOCAL int _band[2] = { 0, INT_MAX };
 /*!\brief flag pour savoir s'il faut ou non corriger l'interpolation
  * par rapport à la profondeur en cas de projection en
  * perspective */
-static int _perpective_correction = 0;
+static THREAD_LOCAL int _perpective_correction = 0;
+/*!\brief la display list en cours d'enregistrement par ce thread
+ * (NULL si le rendu est immédiat), voir \ref dlist_record */
+static THREAD_LOCAL dlist_t * _rec = NULL;
+/*!\brief le buffer de travail du thread, de WORK_BATCH triangles, où
+ * sont décompressés les triangles des surfaces compactes lot par lot
+ * le temps de leur dessin (voir compact_surface et \ref
+ * compact_batches) */
+static THREAD_LOCAL triangle_t * _work = NULL;
 
 /*!\brief transforme et rastérise l'ensemble des triangles de la
- * surface. */
-void transform_n_rasterize(surface_t * s, float * model_view_matrix, float * projection_matrix) {
+ * surface (ou la dessine en imposteur, voir \ref sphere_impostor) ;
+ * renvoie le nombre de triangles soumis. */
+int transform_n_rasterize(surface_t * s, float * model_view_matrix, float * projection_matrix) {
+  float viewport[4];
+  prepare_target(projection_matrix, viewport);
+  /* mettre en place la texture qui sera utilisée pour mapper la surface */
+  if((s->options & SO_USE_TEXTURE) && s->tex_id && !s->tex.pixels)
+    set_texture(s->tex_id);
+  if(s->nlod || s->impostorpx > 0.0f) {
+    float sc = 0.0f, inv[16];
+    int j;
+    for(j = 0; j < 3; ++j)
+      sc = MAX(sc, model_view_matrix[j] * model_view_matrix[j] + model_view_matrix[4 + j] * model_view_matrix[4 + j] + model_view_matrix[8 + j] * model_view_matrix[8 + j]);
+    if(select_lod(s, projected_radius(s->radius * sqrtf(sc), model_view_matrix[11], projection_matrix), &s->lod)) {
+      memcpy(inv, model_view_matrix, sizeof inv);
+      MMAT4INVERSE(inv);
+      if(s->options & SO_USE_LIGHTING)
+	lights_to_object_space(&(s->lights), inv);
+      PROF_COUNT(PROF_TRI_SUBMITTED, 2);
+      work_impostor(s);
+      if(_rec)
+	dlist_impostor(s, model_view_matrix, inv, projection_matrix, s->radius * sqrtf(sc));
+      else
+	sphere_impostor(s, model_view_matrix, inv, projection_matrix, s->radius * sqrtf(sc));
+      if(s->cv)
+	s->t = NULL;
+      return 2;
+    }
+  }
+  PROF_COUNT(PROF_TRI_SUBMITTED, s->n);
+  if(s->cv) {
+    if(s->options & SO_USE_LIGHTING) {
+      float inv[16];
+      memcpy(inv, model_view_matrix, sizeof inv);
+      MMAT4INVERSE(inv);
+      lights_to_object_space(&(s->lights), inv);
+    }
+    compact_batches(s, model_view_matrix, projection_matrix, viewport);
+    return s->n;
+  }
+  PROF_BEGIN(PROF_STRANSFORM);
+  stransform(s, model_view_matrix, projection_matrix, viewport);
+  PROF_END(PROF_STRANSFORM);
+  if(_rec)
+    dlist_surface(s);
+  else
+    rasterize_surface(s);
+  return s->n;
+}
+
+/*!\brief transforme et rastérise les \a n surfaces \a s, qui
+ * partagent la model-view et la projection : équivaut à \a n appels
+ * à \ref transform_n_rasterize, mais les sommets des surfaces sont
+ * transformés en parallèle (voir jobs.c) avant que les surfaces ne
+ * soient rastérisées (ou enregistrées, voir \ref dlist_record) dans
+ * l'ordre. Les surfaces compactes, elles, sont transformées lot
+ * par lot au moment d'être rastérisées (voir \ref compact_batches),
+ * sans rien garder de décompressé d'une surface à l'autre. Les
+ * surfaces ne doivent avoir ni niveaux de détail ni imposteur.
+ * Renvoie le nombre de triangles soumis. */
+int transform_n_rasterize_surfaces(surface_t ** s, int n, float * model_view_matrix, float * projection_matrix) {
+  float viewport[4];
+  stransform_t st;
+  int i, r = 0;
+  if(n <= 0)
+    return 0;
+  prepare_target(projection_matrix, viewport);
+  st.s = s;
+  st.model_view_matrix = model_view_matrix;
+  st.projection_matrix = projection_matrix;
+  st.viewport = viewport;
+  PROF_BEGIN(PROF_STRANSFORM);
+  jobs_parallel_for(n, SURFACES_GRAIN, stransform_range, &st);
+  PROF_END(PROF_STRANSFORM);
+  for(i = 0; i < n; ++i) {
+    assert(!s[i]->nlod && s[i]->impostorpx <= 0.0f);
+    if((s[i]->options & SO_USE_TEXTURE) && s[i]->tex_id && !s[i]->tex.pixels)
+      set_texture(s[i]->tex_id);
+    PROF_COUNT(PROF_TRI_SUBMITTED, s[i]->n);
+    if(s[i]->cv)
+      compact_batches(s[i], model_view_matrix, projection_matrix, viewport);
+    else if(_rec)
+      dlist_surface(s[i]);
+    else
+      rasterize_surface(s[i]);
+    r += s[i]->n;
+  }
+  return r;
+}
+
+/*!\brief la tâche de \ref transform_n_rasterize_surfaces : transforme
+ * les surfaces [\a i0, \a i1[ (de leurs sommets, seules les lumières
+ * des surfaces compactes) */
+void stransform_range(void * data, int i0, int i1) {
+  stransform_t * st = data;
   int i;
-  /* la première fois allouer le depth buffer */
-  if(_depth == NULL) {
-    _depth = calloc(gl4dpGetWidth() * gl4dpGetHeight(), sizeof *_depth);
+  float inv[16];
+  for(i = i0; i < i1; ++i)
+    if(!st->s[i]->cv)
+      stransform(st->s[i], st->model_view_matrix, st->projection_matrix, st->viewport);
+    else if(st->s[i]->options & SO_USE_LIGHTING) {
+      memcpy(inv, st->model_view_matrix, sizeof inv);
+      MMAT4INVERSE(inv);
+      lights_to_object_space(&(st->s[i]->lights), inv);
+    }
+}
+
+/*!\brief dessine \a n instances de la surface \a s. L'instance i a
+ * pour matrice de model-view \a view_matrix x T(\a xyz[3i], \a
+ * xyz[3i + 1], \a xyz[3i + 2]) x \a model_matrix (\a model_matrix
+ * peut être NULL pour l'identité).
+ *
+ * Par rapport à \a n appels à \ref transform_n_rasterize, la cible,
+ * la texture et les lumières ne sont préparées qu'une fois : les
+ * instances ne différant que par une translation, les lumières
+ * ramenées dans le repère objet sont simplement décalées pour chaque
+ * instance au lieu d'inverser une matrice. Les instances dont la
+ * sphère englobante sort du frustum sont rejetées avant toute
+ * transformation de sommet. Si \a s a des niveaux de détail ou un
+ * imposteur, chaque instance choisit le sien (voir \ref select_lod),
+ * l'hystérésis suivant l'indice de l'instance. Renvoie le nombre de
+ * triangles soumis (deux par imposteur). */
+int transform_n_rasterize_instances(surface_t * s, float * view_matrix, float * model_matrix, float * projection_matrix, const float * xyz, int n) {
+  int i, j, k, out, imp = 0, ntri = 0;
+  float vm[16], mv[16], inv[16], minv[16], viewport[4], planes[6][4], r = 0.0f, sc = 0.0f, d[3];
+  olights_t base;
+  if(n <= 0 || s->n <= 0)
+    return 0;
+  prepare_target(projection_matrix, viewport);
+  memcpy(vm, view_matrix, sizeof vm);
+  MIDENTITY(minv);
+  if(model_matrix) {
+    mult_matrix(vm, model_matrix);
+    memcpy(minv, model_matrix, sizeof minv);
+    MMAT4INVERSE(minv);
+  }
+  if((s->options & SO_USE_LIGHTING) || s->impostorpx > 0.0f) {
+    memcpy(inv, vm, sizeof inv);
+    MMAT4INVERSE(inv);
+    if(s->options & SO_USE_LIGHTING)
+      lights_to_object_space(&base, inv);
+  }
+  /* rayon de la sphère englobante (centrée sur l'origine du repère
+     objet) dans le repère de la caméra */
+  if(s->nlod || s->impostorpx > 0.0f) {
+    r = s->radius * s->radius;
+    if(n > s->nilod) {
+      s->ilod = realloc(s->ilod, n * sizeof *s->ilod);
+      assert(s->ilod);
+      memset(s->ilod + s->nilod, 0, (n - s->nilod) * sizeof *s->ilod);
+      s->nilod = n;
+    }
+  } else if(s->cv)
+    r = s->radius * s->radius;
+  else
+    for(i = 0; i < s->n; ++i)
+      for(j = 0; j < 3; ++j)
+	r = MAX(r, MVEC3DOT((float *)&(s->t[i].v[j].position), (float *)&(s->t[i].v[j].position)));
+  for(j = 0; j < 3; ++j)
+    sc = MAX(sc, vm[j] * vm[j] + vm[4 + j] * vm[4 + j] + vm[8 + j] * vm[8 + j]);
+  r = sqrtf(r * sc);
+  frustum_planes(projection_matrix, planes);
+  if((s->options & SO_USE_TEXTURE) && s->tex_id && !s->tex.pixels)
+    set_texture(s->tex_id);
+  for(i = 0; i < n; ++i) {
+    const float * p = &xyz[3 * i];
+    memcpy(mv, vm, sizeof mv);
+    for(k = 0; k < 3; ++k)
+      mv[k * 4 + 3] += view_matrix[k * 4] * p[0] + view_matrix[k * 4 + 1] * p[1] + view_matrix[k * 4 + 2] * p[2];
+    if(s->nlod || s->impostorpx > 0.0f)
+      imp = select_lod(s, projected_radius(r, mv[11], projection_matrix), &s->ilod[i]);
+    PROF_COUNT(PROF_TRI_SUBMITTED, imp ? 2 : s->n);
+    ntri += imp ? 2 : s->n;
+    for(k = 0, out = 0; k < 6 && !out; ++k)
+      out = planes[k][0] * mv[3] + planes[k][1] * mv[7] + planes[k][2] * mv[11] + planes[k][3] < -r;
+    if(out) {
+      PROF_COUNT(PROF_TRI_OUT, imp ? 2 : s->n);
+      continue;
+    }
+    if(s->options & SO_USE_LIGHTING) {
+      s->lights = base;
+      for(k = 0; k < 3; ++k)
+	d[k] = minv[k * 4] * p[0] + minv[k * 4 + 1] * p[1] + minv[k * 4 + 2] * p[2];
+      for(k = 0; k < base.np; ++k) {
+	s->lights.p[k].x -= d[0];
+	s->lights.p[k].y -= d[1];
+	s->lights.p[k].z -= d[2];
+      }
+      s->lights.eye.x -= d[0];
+      s->lights.eye.y -= d[1];
+      s->lights.eye.z -= d[2];
+    }
+    if(imp) {
+      work_impostor(s);
+      if(_rec)
+	dlist_impostor(s, mv, inv, projection_matrix, r);
+      else
+	sphere_impostor(s, mv, inv, projection_matrix, r);
+      continue;
+    }
+    if(s->cv) {
+      compact_batches(s, mv, projection_matrix, viewport);
+      continue;
+    }
+    PROF_BEGIN(PROF_STRANSFORM);
+    stransform_vertices(s, mv, projection_matrix, viewport);
+    PROF_END(PROF_STRANSFORM);
+    if(_rec)
+      dlist_surface(s);
+    else
+      rasterize_surface(s);
+  }
+  if(s->cv)
+    s->t = NULL;
+  return ntri;
+}
+
+/*!\brief indique si la boîte [\a bmin, \a bmax] (alignée sur les
+ * axes du repère objet) peut être vue avec la matrice de model-view
+ * \a model_view_matrix et la projection \a projection_matrix. Le test
+ * est conservateur : la boîte transformée est englobée dans une boîte
+ * alignée sur les axes de la caméra, qui n'est rejetée que si elle
+ * est entièrement derrière l'un des plans du frustum. Sert à écarter
+ * d'un coup des groupes d'objets (les chunks du plateau). */
+int box_in_frustum(float * model_view_matrix, float * projection_matrix, const float * bmin, const float * bmax) {
+  float planes[6][4], c[3], e[3], r;
+  int i, k;
+  frustum_planes(projection_matrix, planes);
+  for(k = 0; k < 3; ++k) {
+    const float * m = &model_view_matrix[k * 4];
+    float hx = (bmax[0] - bmin[0]) / 2.0f, hy = (bmax[1] - bmin[1]) / 2.0f, hz = (bmax[2] - bmin[2]) / 2.0f;
+    c[k] = m[0] * (bmin[0] + hx) + m[1] * (bmin[1] + hy) + m[2] * (bmin[2] + hz) + m[3];
+    e[k] = fabsf(m[0]) * hx + fabsf(m[1]) * hy + fabsf(m[2]) * hz;
+  }
+  for(i = 0; i < 6; ++i) {
+    r = fabsf(planes[i][0]) * e[0] + fabsf(planes[i][1]) * e[1] + fabsf(planes[i][2]) * e[2];
+    if(planes[i][0] * c[0] + planes[i][1] * c[1] + planes[i][2] * c[2] + planes[i][3] < -r)
+      return 0;
+  }
+  return 1;
+}
+
+/*!\brief calcule dans \a rect (x0, y0, x1, y1, pixels inclus) le
+ * rectangle de la cible du rendu que couvre la boîte [\a bmin, \a
+ * bmax] vue avec \a model_view_matrix et \a projection_matrix, d'après
+ * la projection de ses huit coins, élargi d'un pixel pour les
+ * arrondis. Si un coin est derrière la caméra, c'est toute la cible.
+ * Renvoie 0 si le rectangle est vide (boîte hors de l'écran). Sert à
+ * ne redessiner que ce qui a bougé (voir window.c). */
+int box_screen_rect(float * model_view_matrix, float * projection_matrix, const float * bmin, const float * bmax, int * rect) {
+  float mvp[16], nmin[2] = { FLT_MAX, FLT_MAX }, nmax[2] = { -FLT_MAX, -FLT_MAX };
+  int i, k;
+  get_target();
+  memcpy(mvp, projection_matrix, sizeof mvp);
+  mult_matrix(mvp, model_view_matrix);
+  for(k = 0; k < 8; ++k) {
+    float p[3] = { k & 1 ? bmax[0] : bmin[0], k & 2 ? bmax[1] : bmin[1], k & 4 ? bmax[2] : bmin[2] };
+    float w = mvp[12] * p[0] + mvp[13] * p[1] + mvp[14] * p[2] + mvp[15];
+    if(w <= EPSILON) {
+      nmin[0] = nmin[1] = -1.0f;
+      nmax[0] = nmax[1] = 1.0f;
+      break;
+    }
+    for(i = 0; i < 2; ++i) {
+      float q = (mvp[i * 4] * p[0] + mvp[i * 4 + 1] * p[1] + mvp[i * 4 + 2] * p[2] + mvp[i * 4 + 3]) / w;
+      nmin[i] = MIN(nmin[i], q);
+      nmax[i] = MAX(nmax[i], q);
+    }
+  }
+  rect[0] = MAX(0, (int)floorf((MAX(nmin[0], -2.0f) + 1.0f) * 0.5f * _fbW) - 1);
+  rect[1] = MAX(0, (int)floorf((MAX(nmin[1], -2.0f) + 1.0f) * 0.5f * _fbH) - 1);
+  rect[2] = MIN(_fbW - 1, (int)floorf((MIN(nmax[0], 2.0f) + 1.0f) * 0.5f * _fbW) + 1);
+  rect[3] = MIN(_fbH - 1, (int)floorf((MIN(nmax[1], 2.0f) + 1.0f) * 0.5f * _fbH) + 1);
+  return rect[0] <= rect[2] && rect[1] <= rect[3];
+}
+
+/*!\brief rayon à l'écran, en pixels, d'une sphère de rayon \a r
+ * dont le centre est à la profondeur \a z du repère de la caméra
+ * (FLT_MAX si la caméra est dedans ou devant) ; à appeler après \ref
+ * prepare_target */
+inline float projected_radius(float r, float z, float * projection_matrix) {
+  float k = r * fabsf(projection_matrix[5]) * _fbH / 2.0f;
+  if(projection_matrix[15] == 1.0f)
+    return k;
+  return -z > r ? k / -z : FLT_MAX;
+}
+
+/*!\brief rayon projeté (pixels) sous lequel le niveau \a l de \a s
+ * est utilisé, le niveau \a nm (qui suit le dernier maillage
+ * utilisé) étant l'imposteur */
+inline float lod_px(const surface_t * s, int l, int nm) {
+  return l < nm ? s->lodpx[l] : s->impostorpx;
+}
+
+/*!\brief choisit le niveau de détail de \a s pour un rayon projeté de
+ * \a px pixels, en partant du niveau \a lod (mis à jour) : on ne
+ * passe à un niveau plus fin (resp. plus grossier) que si \a px
+ * dépasse de LOD_HYSTERESIS le seuil qui les sépare (resp. passe
+ * en dessous de LOD_HYSTERESIS). Renvoie 1 si la sphère doit être
+ * dessinée en imposteur (voir \ref sphere_impostor). */
+inline int select_lod(surface_t * s, float px, int * lod) {
+  int nm = 1, nl, l;
+  /* les maillages plus grossiers que le seuil de l'imposteur ne
+     servent pas */
+  while(nm < s->nlod && s->lodpx[nm] > s->impostorpx)
+    ++nm;
+  nl = nm + (s->impostorpx > 0.0f);
+  l = MIN(*lod, nl - 1);
+  while(l > 0 && px > lod_px(s, l, nm) * (1.0f + LOD_HYSTERESIS))
+    --l;
+  while(l < nl - 1 && px < lod_px(s, l + 1, nm) * (1.0f - LOD_HYSTERESIS))
+    ++l;
+  *lod = l;
+  if(l < s->nlod) {
+    if(s->cv)
+      s->cv = s->lodcv[l];
+    else
+      s->t = s->lodt[l];
+    s->n = s->lodn[l];
+  }
+  return l == nm;
+}
+
+/*!\brief renvoie le buffer de travail du thread (WORK_BATCH
+ * triangles), alloué à son premier appel */
+inline triangle_t * work_buffer(void) {
+  if(!_work) {
+    _work = malloc(WORK_BATCH * sizeof *_work);
+    assert(_work);
+  }
+  return _work;
+}
+
+/*!\brief transforme et rastérise (ou enregistre, voir \ref
+ * dlist_record) la surface compacte \a s par lots de WORK_BATCH
+ * triangles, décompressés l'un après l'autre dans le buffer de
+ * travail du thread : la mémoire du dessin ne dépend pas de la taille
+ * du maillage. Les lumières de \a s doivent déjà être dans le repère
+ * objet (voir \ref stransform_vertices). */
+inline void compact_batches(surface_t * s, float * model_view_matrix, float * projection_matrix, float * viewport) {
+  cvertex_t * cv = s->cv;
+  int i, n = s->n;
+  s->t = work_buffer();
+  for(i = 0; i < n; i += WORK_BATCH) {
+    s->cv = cv + 3 * i;
+    s->n = MIN(WORK_BATCH, n - i);
+    PROF_BEGIN(PROF_STRANSFORM);
+    stransform_vertices(s, model_view_matrix, projection_matrix, viewport);
+    PROF_END(PROF_STRANSFORM);
+    if(_rec)
+      dlist_surface(s);
+    else
+      rasterize_surface(s);
+  }
+  s->cv = cv;
+  s->n = n;
+  s->t = NULL;
+}
+
+/*!\brief si \a s est compacte, décompresse son premier triangle dans
+ * le buffer de travail : l'imposteur en tire la couleur */
+inline void work_impostor(surface_t * s) {
+  int j;
+  if(!s->cv)
+    return;
+  s->t = work_buffer();
+  for(j = 0; j < 3; ++j)
+    cvertex_decode(s, &(s->cv[j]), &(s->t[0].v[j]));
+}
+
+/*!\brief dessine la sphère \a s, de rayon \a r dans le repère de la
+ * caméra et centrée en la translation de \a model_view_matrix, en
+ * imposteur : le carré qui l'englobe à l'écran est parcouru et, pour
+ * chaque pixel, le rayon issu de la caméra est intersecté avec la
+ * sphère. Le point d'entrée donne la profondeur (même codage que
+ * \ref vtransform) et, ramené dans le repère objet par \a
+ * inv_model_view_matrix, la normale et les coordonnées de texture
+ * (longitude et latitude, comme \ref mk_sphere). La silhouette est
+ * exacte quelle que soit la taille. La projection doit être de la
+ * forme usuelle (perspective ou orthogonale) : x ne dépend que de x et
+ * z, y de y et z, la profondeur et w de z. Les lumières de \a s
+ * doivent être déjà dans le repère objet. */
+inline void sphere_impostor(surface_t * s, float * model_view_matrix, float * inv_model_view_matrix, float * projection_matrix, float r) {
+  const float * P = projection_matrix, * I = inv_model_view_matrix;
+  float c[3] = { model_view_matrix[3], model_view_matrix[7], model_view_matrix[11] };
+  float nmin[2] = { FLT_MAX, FLT_MAX }, nmax[2] = { -FLT_MAX, -FLT_MAX };
+  float sx = 2.0f / (_fbW - EPSILON), sy = 2.0f / (_fbH - EPSILON);
+  int x, y, x0, x1, y0, y1, xc, yc, i, k, n = 0, o[PHONG_CHUNK];
+  GLuint * image = _fb;
+  vertex_t v[PHONG_CHUNK];
+  /* le carré englobant : la projection étant homographique, ses
+     extrema sur la boîte englobant la sphère sont atteints aux coins */
+  for(k = 0; k < 8; ++k) {
+    float p[3] = { c[0] + (k & 1 ? r : -r), c[1] + (k & 2 ? r : -r), c[2] + (k & 4 ? r : -r) };
+    float w = P[12] * p[0] + P[13] * p[1] + P[14] * p[2] + P[15];
+    if(w <= 0.0f)
+      return;
+    for(i = 0; i < 2; ++i) {
+      float q = (P[i * 4] * p[0] + P[i * 4 + 1] * p[1] + P[i * 4 + 2] * p[2] + P[i * 4 + 3]) / w;
+      nmin[i] = MIN(nmin[i], q);
+      nmax[i] = MAX(nmax[i], q);
+    }
+  }
+  x0 = MAX(_clip[0], (int)floorf((nmin[0] + 1.0f) / sx));
+  x1 = MIN(_clip[2], (int)((nmax[0] + 1.0f) / sx));
+  y0 = MAX(_clip[1], (int)floorf((nmin[1] + 1.0f) / sy));
+  y1 = MIN(_clip[3], (int)((nmax[1] + 1.0f) / sy));
+  /* le pixel du centre, toujours dessiné (comme le plus petit des
+     triangles) pour qu'une sphère de moins d'un pixel ne disparaisse
+     pas entre deux centres de pixels */
+  xc = (int)floorf(((P[0] * c[0] + P[2] * c[2] + P[3]) / (P[14] * c[2] + P[15]) + 1.0f) / sx);
+  yc = (int)floorf(((P[5] * c[1] + P[6] * c[2] + P[7]) / (P[14] * c[2] + P[15]) + 1.0f) / sy);
+  PROF_BEGIN(PROF_FILL);
+  for(y = y0; y <= y1; ++y) {
+    /* le rayon du pixel : x = ax + bx z, y = ay + by z */
+    float yn = (y + 0.5f) * sy - 1.0f;
+    float by = (yn * P[14] - P[6]) / P[5], ey = (yn * P[15] - P[7]) / P[5] - c[1];
+    for(x = x0; x <= x1; ++x) {
+      float xn = (x + 0.5f) * sx - 1.0f;
+      float bx = (xn * P[14] - P[2]) / P[0], ex = (xn * P[15] - P[3]) / P[0] - c[0];
+      float a = bx * bx + by * by + 1.0f, b = ex * bx + ey * by - c[2];
+      float d = b * b - a * (ex * ex + ey * ey + c[2] * c[2] - r * r), z, zn, dx, dy, dz, ox, oy, oz, il;
+      vertex_t * f = &v[n];
+      if(d < 0.0f) {
+	if(x != xc || y != yc)
+	  continue;
+	d = 0.0f;
+      }
+      /* l'intersection la plus proche de la caméra (z le plus grand) */
+      z = (-b + sqrtf(d)) / a;
+      zn = (P[10] * z + P[11]) / (P[14] * z + P[15]);
+      if(zn < -1.0f || zn > 1.0f)
+	continue;
+      f->z = sqrtf((-zn + 1.0f) * 0.5f);
+      PROF_COUNT(PROF_PIX_TESTED, 1);
+      if(f->z < _depth[y * _fbW + x])
+	continue;
+      PROF_COUNT(PROF_PIX_PASSED, 1);
+      PROF_COUNT(PROF_PIX_COVERED, _depth[y * _fbW + x] == 0.0f);
+      _depth[y * _fbW + x] = f->z;
+      if(_vis)
+	_vis[y * _fbW + x].draw = 0;
+      f->icolor = s->t[0].v[0].color0;
+      f->li = 1.0f;
+      dx = ex + bx * z; dy = ey + by * z; dz = z - c[2];
+      ox = I[0] * dx + I[1] * dy + I[2]  * dz;
+      oy = I[4] * dx + I[5] * dy + I[6]  * dz;
+      oz = I[8] * dx + I[9] * dy + I[10] * dz;
+      f->normal.x = f->opos.x = ox;
+      f->normal.y = f->opos.y = oy;
+      f->normal.z = f->opos.z = oz;
+      il = frsqrt(ox * ox + oy * oy + oz * oz + FLT_MIN);
+      f->texCoord.x = atan2f(oz, ox) / (2.0f * (float)M_PI);
+      f->texCoord.x += f->texCoord.x < 0.0f ? 1.0f : 0.0f;
+      f->texCoord.y = asinf(MAX(-1.0f, MIN(1.0f, oy * il))) / (float)M_PI + 0.5f;
+      if(!(s->options & SO_USE_LIGHTING)) {
+	PROF_BEGIN(PROF_SHADING);
+	s->shadingfunc(s, &image[y * _fbW + x], f);
+	PROF_END(PROF_SHADING);
+	PROF_COUNT(PROF_PIX_SHADED, 1);
+	continue;
+      }
+      o[n] = y * _fbW + x;
+      if(++n == PHONG_CHUNK) {
+	phong_flush(s, image, v, o, n);
+	n = 0;
+      }
+    }
+  }
+  if(n)
+    phong_flush(s, image, v, o, n);
+  PROF_END(PROF_FILL);
+}
+
+/*!\brief les six plans (normalisés, normale vers l'intérieur) du
+ * frustum dans le repère de la caméra, tirés des lignes de la
+ * projection ; les plans latéraux sont resserrés sur le scissor s'il
+ * est actif */
+inline void frustum_planes(float * projection_matrix, float planes[6][4]) {
+  float lim[6] = { -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f };
+  int i, k;
+  /* avec un scissor, les plans gauche, droit, bas et haut passent par
+     ses bords : x / w >= xl devient x - xl w >= 0, etc. */
+  if(_scissor_on && _fbW > 0 && _fbH > 0) {
+    lim[0] = 2.0f * _scissor[0] / _fbW - 1.0f;
+    lim[1] = 2.0f * (_scissor[2] + 1) / _fbW - 1.0f;
+    lim[2] = 2.0f * _scissor[1] / _fbH - 1.0f;
+    lim[3] = 2.0f * (_scissor[3] + 1) / _fbH - 1.0f;
+  }
+  for(i = 0; i < 6; ++i) {
+    float sg = (i & 1) ? -1.0f : 1.0f, l;
+    for(k = 0; k < 4; ++k)
+      planes[i][k] = sg * (projection_matrix[(i >> 1) * 4 + k] - lim[i] * projection_matrix[12 + k]);
+    l = sqrtf(planes[i][0] * planes[i][0] + planes[i][1] * planes[i][1] + planes[i][2] * planes[i][2]);
+    for(k = 0; k < 4; ++k)
+      planes[i][k] /= l;
+  }
+}
+
+/*!\brief récupère la cible du rendu, (ré)alloue au besoin le buffer
+ * de profondeur et calcule le rectangle où dessiner */
+inline void get_target(void) {
+  if(_rec) {
+    /* en enregistrement, seules les dimensions comptent */
+    _fb = NULL;
+    _fbW = _rec->w;
+    _fbH = _rec->h;
+  } else if(!_fb_user) {
+    _fb = gl4dpGetPixels();
+    _fbW = gl4dpGetWidth();
+    _fbH = gl4dpGetHeight();
+  }
+  /* la première fois, ou si la cible change de dimensions, allouer
+     le depth buffer */
+  if(!_rec && (_depth == NULL || _depthW != _fbW || _depthH != _fbH)) {
+    if(_depth == NULL)
+      atexit(free_depth_map);
+    free(_depth);
+    _depth = calloc(_fbW * _fbH, sizeof *_depth);
     assert(_depth);
-    atexit(pquit);
+    _depthW = _fbW;
+    _depthH = _fbH;
+    /* même à la même adresse, c'est un autre buffer */
+    _sbuf_depth = NULL;
+  }
+  if(!_rec && _span_buffer)
+    sbuf_sync();
+  _clip[0] = _clip[1] = 0;
+  _clip[2] = _fbW - 1;
+  _clip[3] = _fbH - 1;
+  if(_scissor_on) {
+    _clip[0] = MAX(_clip[0], _scissor[0]);
+    _clip[1] = MAX(_clip[1], _scissor[1]);
+    _clip[2] = MIN(_clip[2], _scissor[2]);
+    _clip[3] = MIN(_clip[3], _scissor[3]);
   }
+  _clip[1] = MAX(_clip[1], _band[0]);
+  _clip[3] = MIN(_clip[3], _band[1]);
+}
+
+/*!\brief récupère la cible du rendu (voir \ref get_target) et
+ * remplit le \a viewport */
+inline void prepare_target(float * projection_matrix, float * viewport) {
+  get_target();
   /* si projection_matrix[15] est à 1, c'est une projection orthogonale, pas
    * besoin de correction de perspective */
   _perpective_correction = projection_matrix[15] == 1.0f ? 0 : 1;
   /* le viewport est fixe ; \todo peut devenir paramétrable ... */
-  float viewport[] = { 0.0f, 0.0f, (float)gl4dpGetWidth(), (float)gl4dpGetHeight() };
-  stransform(s, model_view_matrix, projection_matrix, viewport);
-  /* mettre en place la texture qui sera utilisée pour mapper la surface */
-  if(s->options & SO_USE_TEXTURE)
-    set_texture(s->tex_id);
+  viewport[0] = 0.0f;
+  viewport[1] = 0.0f;
+  viewport[2] = (float)_fbW;
+  viewport[3] = (float)_fbH;
+}
+
+/*!\brief rastérise les triangles de \a s, déjà transformés. Chaque
+ * triangle est aiguillé d'après la boîte des centres de pixels qu'il
+ * peut couvrir : rejeté s'il est d'aire nulle, si elle est vide (il
+ * passe entre les centres) ou hors de l'écran ; rastérisé pixel par
+ * pixel (\ref raster_tiny) si elle fait moins de TINY_TRI_PX pixels
+ * de côté, par tuiles à partir de TILED_TRI_PX, par segments (\ref
+ * raster_block) entre les deux. Un triangle qui traverse le plan near
+ * ou far passe par les lignes de \ref fill_triangle. */
+inline void rasterize_surface(surface_t * s) {
+  int i, x0, y0, x1, y1, d, box[4];
+  edges_t e;
   for(i = 0; i < s->n; ++i) {
+    triangle_t * t = &(s->t[i]);
     /* si le triangle est déclaré CULL (par exemple en backface), le rejeter */
-    if(s->t[i].state & PS_CULL ) continue;
+    if(s->t[i].state & PS_CULL ) { PROF_COUNT(PROF_TRI_CULLED, 1); continue; }
     /* on rejette aussi les triangles complètement out */
-    if(s->t[i].state & PS_TOTALLY_OUT) continue;
+    if(s->t[i].state & PS_TOTALLY_OUT) { PROF_COUNT(PROF_TRI_OUT, 1); continue; }
+    if(s->t[i].state & PS_PARTIALLY_OUT) PROF_COUNT(PROF_TRI_CLIPPED, 1);
     /* "hack" pas terrible permettant de rejeter les triangles
      * partiellement out dont au moins un sommet est TOO_FAR (trop
      * éloigné). Voir le fichier transformations.c pour voir comment
@@ -81,31 +879,939 @@ void transform_n_rasterize(surface_t * s, float * model_view_matrix, float * pro
     if( s->t[i].state & PS_PARTIALLY_OUT &&
 	( (s->t[i].v[0].state & PS_TOO_FAR) ||
 	  (s->t[i].v[1].state & PS_TOO_FAR) ||
-	  (s->t[i].v[2].state & PS_TOO_FAR)    ) )
+	  (s->t[i].v[2].state & PS_TOO_FAR)    ) ) {
+      PROF_COUNT(PROF_TRI_OUT, 1);
+      continue;
+    }
+    if((t->v[0].state | t->v[1].state | t->v[2].state) & (PS_OUT_NEAR | PS_OUT_FAR)) {
+      /* un sommet hors des plans near et far (ou derrière la caméra,
+	 qui le projette au-delà du far) n'a pas de position à l'écran
+	 utilisable par les fonctions d'arêtes */
+      PROF_COUNT(PROF_TRI_RASTERIZED, 1);
+      PROF_BEGIN(PROF_FILL);
+      fill_triangle(s, t);
+      PROF_END(PROF_FILL);
+      continue;
+    }
+    if(!(d = tri_box(t, box)) || !tri_edges(t, &e)) {
+      PROF_COUNT(PROF_TRI_DEGENERATE, 1);
+      continue;
+    }
+    x0 = box[0]; y0 = box[1]; x1 = box[2]; y1 = box[3];
+    if(MAX(x0, _clip[0]) > MIN(x1, _clip[2]) || MAX(y0, _clip[1]) > MIN(y1, _clip[3])) {
+      PROF_COUNT(PROF_TRI_OUT, 1);
+      continue;
+    }
+    if(_vis) {
+      _vis_box[0] = MIN(_vis_box[0], MAX(x0, _clip[0]));
+      _vis_box[1] = MIN(_vis_box[1], MAX(y0, _clip[1]));
+      _vis_box[2] = MAX(_vis_box[2], MIN(x1, _clip[2]));
+      _vis_box[3] = MAX(_vis_box[3], MIN(y1, _clip[3]));
+    }
+    PROF_COUNT(PROF_TRI_RASTERIZED, 1);
+    PROF_BEGIN(PROF_FILL);
+    if(d < TINY_TRI_PX) {
+      PROF_COUNT(PROF_TRI_TINY, 1);
+      raster_tiny(s, t, &e, MAX(x0, _clip[0]), MAX(y0, _clip[1]), MIN(x1, _clip[2]), MIN(y1, _clip[3]));
+    } else if(d >= TILED_TRI_PX) {
+      PROF_COUNT(PROF_TRI_TILED, 1);
+      fill_triangle_tiled(s, t, &e, x0, y0, x1, y1);
+    } else
+      raster_block(s, t, &e, x0, y0, x1, y1);
+    PROF_END(PROF_FILL);
+  }
+}
+
+/*!\brief range dans \a box (x0, y0, x1, y1 inclus) les centres de
+ * pixels compris entre les sommets du triangle \a t, ramenés à
+ * l'écran, et renvoie le côté de la boîte avant ce recadrage (0 si
+ * elle est vide) : tuiles et segments se calent sur l'écran, pas sur
+ * le scissor, pour que les pixels d'un triangle ne dépendent pas de
+ * lui */
+inline int tri_box(const triangle_t * t, int * box) {
+  int x0, y0, x1, y1;
+  x0 = (MIN(t->v[0].fx, MIN(t->v[1].fx, t->v[2].fx)) + SUBPIXEL / 2 - 1) >> SUBPIXEL_BITS;
+  x1 = (MAX(t->v[0].fx, MAX(t->v[1].fx, t->v[2].fx)) - SUBPIXEL / 2) >> SUBPIXEL_BITS;
+  y0 = (MIN(t->v[0].fy, MIN(t->v[1].fy, t->v[2].fy)) + SUBPIXEL / 2 - 1) >> SUBPIXEL_BITS;
+  y1 = (MAX(t->v[0].fy, MAX(t->v[1].fy, t->v[2].fy)) - SUBPIXEL / 2) >> SUBPIXEL_BITS;
+  if(x0 > x1 || y0 > y1)
+    return 0;
+  box[0] = MAX(x0, 0); box[2] = MIN(x1, _fbW - 1);
+  box[1] = MAX(y0, 0); box[3] = MIN(y1, _fbH - 1);
+  return MAX(x1 - x0, y1 - y0) + 1;
+}
+
+/*!\brief calcule les fonctions d'arêtes \a e du triangle \a t (voir
+ * \ref edges_t) à partir des positions en virgule fixe de ses
+ * sommets, orientées pour que son aire soit positive ; renvoie cette
+ * aire (doublée, en SUBPIXEL^2 pixels), nulle si le triangle est
+ * dégénéré. Un centre de pixel situé exactement sur une arête n'est
+ * couvert que si c'est une arête gauche ou haute (règle "top-left") :
+ * de deux triangles qui partagent une arête, un seul dessine les
+ * pixels qui tombent dessus, sans trou ni recouvrement. */
+inline int64_t tri_edges(triangle_t * t, edges_t * e) {
+  int i, sg;
+  int64_t A[3], B[3], C[3], area;
+  for(i = 0; i < 3; ++i) {
+    const vertex_t * a = &(t->v[(i + 1) % 3]), * b = &(t->v[(i + 2) % 3]);
+    A[i] = a->fy - b->fy;
+    B[i] = b->fx - a->fx;
+    C[i] = (int64_t)a->fx * b->fy - (int64_t)b->fx * a->fy;
+  }
+  area = A[0] * t->v[0].fx + B[0] * t->v[0].fy + C[0];
+  sg = area < 0 ? -1 : 1;
+  for(i = 0; i < 3; ++i) {
+    A[i] *= sg; B[i] *= sg; C[i] *= sg;
+    /* passage aux indices de pixels : X = SUBPIXEL x + SUBPIXEL / 2 ;
+       e >= 0 devient e > 0 hors des arêtes gauches ou hautes */
+    e->a[i] = A[i] * SUBPIXEL;
+    e->b[i] = B[i] * SUBPIXEL;
+    e->c[i] = (A[i] + B[i]) * (SUBPIXEL / 2) + C[i] - !(A[i] > 0 || (A[i] == 0 && B[i] > 0));
+  }
+  return e->area = area * sg;
+}
+
+/*!\brief rastérise les pixels du rectangle [\a x0, \a x1] x [\a y0,
+ * \a y1] de l'écran couverts par le (petit) triangle \a t : pour
+ * chaque pixel, la couverture et les poids des sommets sont tirés
+ * directement des fonctions d'arêtes \a e, sans la recherche des
+ * segments de \ref raster_block qui ne se justifie pas pour quelques
+ * pixels. En première passe du visibility buffer, seuls la profondeur
+ * et le triangle sont gardés. */
+inline void raster_tiny(surface_t * s, triangle_t * t, const edges_t * e, int x0, int y0, int x1, int y1) {
+  int x, y, k = 0, o[PHONG_CHUNK];
+  int phong = (s->options & (SO_USE_LIGHTING | SO_USE_PHONG)) == (SO_USE_LIGHTING | SO_USE_PHONG);
+  GLuint * image = _fb;
+  vertex_t v[PHONG_CHUNK], r;
+  void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float) = _vis ? metainterpolate_depth : s->interpolatefunc;
+  for(y = y0; y <= y1; ++y) {
+    int64_t e0 = e->a[0] * x0 + e->b[0] * y + e->c[0];
+    int64_t e1 = e->a[1] * x0 + e->b[1] * y + e->c[1];
+    int64_t e2 = e->a[2] * x0 + e->b[2] * y + e->c[2];
+    for(x = x0; x <= x1; ++x, e0 += e->a[0], e1 += e->a[1], e2 += e->a[2]) {
+      float l01;
+      vertex_t * f = &v[k];
+      if((e0 | e1 | e2) < 0)
+	continue;
+      if(e0 + e1 > 0)
+	interp(&r, &(t->v[0]), &(t->v[1]), (float)e0 / (float)(e0 + e1), (float)e1 / (float)(e0 + e1));
+      else
+	interp(&r, &(t->v[0]), &(t->v[1]), 1.0f, 0.0f);
+      l01 = (float)(e0 + e1) / (float)e->area;
+      interp(f, &r, &(t->v[2]), l01, 1.0f - l01);
+      PROF_COUNT(PROF_PIX_TESTED, 1);
+      if(f->z < 0 || f->z > 1 || f->z < _depth[y * _fbW + x]) { continue; }
+      PROF_COUNT(PROF_PIX_PASSED, 1);
+      PROF_COUNT(PROF_PIX_COVERED, _depth[y * _fbW + x] == 0.0f);
+      _depth[y * _fbW + x] = f->z;
+      if(_vis) {
+	_vis[y * _fbW + x].draw = _vis_draw;
+	_vis[y * _fbW + x].tri = (int)(t - s->t);
+	continue;
+      }
+      if(!phong) {
+	PROF_BEGIN(PROF_SHADING);
+	s->shadingfunc(s, &image[y * _fbW + x], f);
+	PROF_END(PROF_SHADING);
+	PROF_COUNT(PROF_PIX_SHADED, 1);
+	continue;
+      }
+      o[k] = y * _fbW + x;
+      if(++k == PHONG_CHUNK) {
+	phong_flush(s, image, v, o, k);
+	k = 0;
+      }
+    }
+  }
+  if(k)
+    phong_flush(s, image, v, o, k);
+}
+
+/*!\brief rastérise par tuiles de TILE x TILE pixels le triangle \a t,
+ * de fonctions d'arêtes \a e, dans le rectangle [\a x0, \a x1] x [\a
+ * y0, \a y1] de l'écran. Les fonctions d'arêtes étant affines, leur
+ * maximum sur une tuile est atteint en l'un de ses coins : une tuile
+ * entièrement hors d'une arête est sautée sans rien calculer pour
+ * ses lignes. Parcourir l'écran par tuiles garde aussi les lignes du
+ * depth buffer et de l'image en cache. */
+inline void fill_triangle_tiled(surface_t * s, triangle_t * t, const edges_t * e, int x0, int y0, int x1, int y1) {
+  int tx, ty, tx1, ty1, i;
+  for(ty = y0; ty <= y1; ty += TILE)
+    for(tx = x0; tx <= x1; tx += TILE) {
+      tx1 = MIN(tx + TILE - 1, x1);
+      ty1 = MIN(ty + TILE - 1, y1);
+      if(tx > _clip[2] || tx1 < _clip[0] || ty > _clip[3] || ty1 < _clip[1])
+	continue;
+      for(i = 0; i < 3; ++i)
+	if(e->a[i] * (e->a[i] > 0 ? tx1 : tx) + e->b[i] * (e->b[i] > 0 ? ty1 : ty) + e->c[i] < 0)
+	  break;
+      if(i == 3)
+	raster_block(s, t, e, tx, ty, tx1, ty1);
+    }
+}
+
+/*!\brief rastérise les pixels du rectangle [\a x0, \a x1] x [\a y0,
+ * \a y1] de l'écran couverts par le triangle \a t. Sur chaque ligne,
+ * le triangle étant convexe, les pixels couverts forment un segment
+ * dont les bornes sont tirées exactement des fonctions d'arêtes \a
+ * e ; les attributs y sont calculés par leurs poids barycentriques
+ * (en deux fois, entre les sommets 0 et 1 puis entre ce résultat et
+ * le sommet 2, ce qui garde la correction de perspective de \ref
+ * interpolate) puis interpolés le long du segment comme dans \ref
+ * horizontal_line. En première passe du visibility buffer, seuls la
+ * profondeur (interpolée à l'identique) et le triangle sont gardés. */
+inline void raster_block(surface_t * s, triangle_t * t, const edges_t * e, int x0, int y0, int x1, int y1) {
+  int x, y, xs, xe, xa, xb, r, nr, k = 0, o[PHONG_CHUNK], runs[SBUF_SPANS + 1][2];
+  int phong = (s->options & (SO_USE_LIGHTING | SO_USE_PHONG)) == (SO_USE_LIGHTING | SO_USE_PHONG);
+  int affine = _affine_span && _perpective_correction && !_vis;
+  float p, deltap, zlo, zhi;
+  GLuint * image = _fb;
+  vertex_t v[PHONG_CHUNK], b[2];
+  affine_t af;
+  void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float) = _vis ? metainterpolate_depth : s->interpolatefunc;
+  for(y = MAX(y0, _clip[1]); y <= MIN(y1, _clip[3]); ++y) {
+    row_span(e, y, x0, x1, &xs, &xe);
+    if(xs > xe)
       continue;
-    fill_triangle(s, &(s->t[i]));
+    span_ends(interp, t, e, y, xs, xe, b);
+    /* le segment entier fixe l'interpolation, seule sa partie dans
+       le scissor est dessinée, et seulement là où le S-buffer ne la
+       sait pas cachée */
+    xa = MAX(xs, _clip[0]);
+    xb = MIN(xe, _clip[2]);
+    zlo = MIN(b[0].z, b[1].z);
+    zhi = MAX(b[0].z, b[1].z);
+    if(_span_buffer)
+      nr = sbuf_clip(y, xa, xb, zhi, runs);
+    else {
+      runs[0][0] = xa;
+      runs[0][1] = xb;
+      nr = xa <= xb;
+    }
+    deltap = xe > xs ? 1.0f / (xe - xs) : 0.0f;
+    af.x0 = 0;
+    af.x1 = -1;
+    for(r = 0; r < nr; ++r) {
+      for(x = runs[r][0]; x <= runs[r][1]; ++x) {
+	vertex_t * f = &v[k];
+	p = (x - xs) * deltap;
+	if(affine)
+	  span_affine(interp, b, xs, xe, deltap, x, &af, f);
+	else
+	  interp(f, &b[0], &b[1], 1.0f - p, p);
+	PROF_COUNT(PROF_PIX_TESTED, 1);
+	if(f->z < 0 || f->z > 1 || f->z < _depth[y * _fbW + x]) { continue; }
+	PROF_COUNT(PROF_PIX_PASSED, 1);
+	PROF_COUNT(PROF_PIX_COVERED, _depth[y * _fbW + x] == 0.0f);
+	_depth[y * _fbW + x] = f->z;
+	if(_vis) {
+	  _vis[y * _fbW + x].draw = _vis_draw;
+	  _vis[y * _fbW + x].tri = (int)(t - s->t);
+	  continue;
+	}
+	if(!phong) {
+	  PROF_BEGIN(PROF_SHADING);
+	  s->shadingfunc(s, &image[y * _fbW + x], f);
+	  PROF_END(PROF_SHADING);
+	  PROF_COUNT(PROF_PIX_SHADED, 1);
+	  continue;
+	}
+	o[k] = y * _fbW + x;
+	if(++k == PHONG_CHUNK) {
+	  phong_flush(s, image, v, o, k);
+	  k = 0;
+	}
+      }
+    }
+    /* la profondeur de chaque pixel du segment, écarté ou non, vaut
+       maintenant au moins celle qu'y a le segment, s'il est tout entier
+       entre les plans near et far */
+    if(_span_buffer && xa <= xb && zlo >= 0.0f && zhi <= 1.0f)
+      sbuf_insert(y, xa, xb, zlo - SBUF_EPS);
+  }
+  if(k)
+    phong_flush(s, image, v, o, k);
+}
+
+/*!\brief borne par [\a xs, \a xe] le segment de la ligne \a y,
+ * dans [\a x0, \a x1], couvert par le triangle de fonctions d'arêtes
+ * \a e (vide si *\a xs > *\a xe) : e_i(x) = a_i x + kk >= 0 pour les
+ * trois arêtes */
+inline void row_span(const edges_t * e, int y, int x0, int x1, int * xs, int * xe) {
+  int i;
+  for(i = 0, *xs = x0, *xe = x1; i < 3 && *xs <= *xe; ++i) {
+    int64_t kk = e->b[i] * y + e->c[i];
+    if(e->a[i] > 0)
+      *xs = MAX(*xs, (int)(-kk >= 0 ? (-kk + e->a[i] - 1) / e->a[i] : -(kk / e->a[i])));
+    else if(e->a[i] < 0)
+      *xe = MIN(*xe, (int)(kk >= 0 ? kk / -e->a[i] : -((-kk - e->a[i] - 1) / -e->a[i])));
+    else if(kk < 0)
+      *xe = *xs - 1;
+  }
+}
+
+/*!\brief calcule par \a interp les attributs \a b[0] et \a b[1] du
+ * triangle \a t aux bornes \a xs et \a xe du segment de la ligne \a
+ * y, d'après leurs poids barycentriques tirés des fonctions d'arêtes
+ * \a e */
+inline void span_ends(void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float), triangle_t * t, const edges_t * e, int y, int xs, int xe, vertex_t * b) {
+  int i;
+  float p;
+  vertex_t r;
+  for(i = 0; i < 2; ++i) {
+    int xb = i ? xe : xs;
+    int64_t e0 = e->a[0] * xb + e->b[0] * y + e->c[0], e1 = e->a[1] * xb + e->b[1] * y + e->c[1];
+    if(e0 + e1 > 0)
+      interp(&r, &(t->v[0]), &(t->v[1]), (float)e0 / (float)(e0 + e1), (float)e1 / (float)(e0 + e1));
+    else
+      interp(&r, &(t->v[0]), &(t->v[1]), 1.0f, 0.0f);
+    p = (float)(e0 + e1) / (float)e->area;
+    interp(&b[i], &r, &(t->v[2]), p, 1.0f - p);
+  }
+}
+
+/*!\brief (ré)alloue au besoin le S-buffer aux dimensions du buffer
+ * de profondeur courant, et le vide s'il en décrivait un autre */
+inline void sbuf_sync(void) {
+  if(_sbufH != _depthH) {
+    free(_sbuf);
+    free(_sbufn);
+    _sbuf = malloc(_depthH * SBUF_SPANS * sizeof *_sbuf);
+    _sbufn = malloc(_depthH * sizeof *_sbufn);
+    assert(_sbuf && _sbufn);
+    _sbufH = _depthH;
+    _sbuf_depth = NULL;
+  }
+  if(_sbuf_depth != _depth) {
+    memset(_sbufn, 0, _sbufH * sizeof *_sbufn);
+    _sbuf_depth = _depth;
   }
 }
 
+/*!\brief range dans \a runs les intervalles de [\a x0, \a x1], sur
+ * la ligne \a y, que le S-buffer ne sait pas cachés à un segment dont
+ * la profondeur ne dépasse pas \a z ; renvoie leur nombre (au plus
+ * SBUF_SPANS + 1) */
+inline int sbuf_clip(int y, int x0, int x1, float z, int (*runs)[2]) {
+  const sspan_t * sp = &_sbuf[y * SBUF_SPANS];
+  int i, n = 0, x = x0;
+  for(i = 0; i < _sbufn[y] && sp[i].x0 <= x1 && x <= x1; ++i) {
+    if(sp[i].x1 < x || sp[i].z <= z + SBUF_EPS)
+      continue;
+    if(sp[i].x0 > x) {
+      runs[n][0] = x;
+      runs[n++][1] = sp[i].x0 - 1;
+    }
+    PROF_COUNT(PROF_PIX_SKIPPED, MIN(sp[i].x1, x1) - MAX(sp[i].x0, x) + 1);
+    x = sp[i].x1 + 1;
+  }
+  if(x <= x1) {
+    runs[n][0] = x;
+    runs[n++][1] = x1;
+  }
+  return n;
+}
+
+/*!\brief note dans le S-buffer que, sur la ligne \a y, la profondeur
+ * vaut au moins \a z sur [\a x0, \a x1] : les segments recouverts
+ * gardent le plus grand des deux minorants, les trous prennent \a z.
+ * Si la ligne déborde, les segments aux plus petits minorants, qui
+ * cachent le moins, sont oubliés. */
+inline void sbuf_insert(int y, int x0, int x1, float z) {
+  sspan_t * sp = &_sbuf[y * SBUF_SPANS], t[2 * SBUF_SPANS + 3];
+  int i, n = 0, x = x0;
+  for(i = 0; i < _sbufn[y]; ++i) {
+    if(sp[i].x1 < x0 || sp[i].x0 > x1) {
+      /* le reste de [x0, x1] vient avant ce segment */
+      if(sp[i].x0 > x1 && x <= x1) {
+	sbuf_piece(t, &n, x, x1, z);
+	x = x1 + 1;
+      }
+      sbuf_piece(t, &n, sp[i].x0, sp[i].x1, sp[i].z);
+      continue;
+    }
+    if(sp[i].x0 < x0)
+      sbuf_piece(t, &n, sp[i].x0, x0 - 1, sp[i].z);
+    if(sp[i].x0 > x)
+      sbuf_piece(t, &n, x, sp[i].x0 - 1, z);
+    sbuf_piece(t, &n, MAX(sp[i].x0, x0), MIN(sp[i].x1, x1), MAX(sp[i].z, z));
+    x = MIN(sp[i].x1, x1) + 1;
+    if(sp[i].x1 > x1)
+      sbuf_piece(t, &n, x1 + 1, sp[i].x1, sp[i].z);
+  }
+  if(x <= x1)
+    sbuf_piece(t, &n, x, x1, z);
+  while(n > SBUF_SPANS) {
+    int m = 0;
+    for(i = 1; i < n; ++i)
+      if(t[i].z < t[m].z)
+	m = i;
+    memmove(&t[m], &t[m + 1], (n - m - 1) * sizeof *t);
+    --n;
+  }
+  memcpy(sp, t, n * sizeof *sp);
+  _sbufn[y] = n;
+}
+
+/*!\brief ajoute le segment [\a x0, \a x1] de minorant \a z aux \a n
+ * segments triés de \a t, en le fusionnant au dernier s'il le
+ * prolonge avec le même minorant */
+inline void sbuf_piece(sspan_t * t, int * n, int x0, int x1, float z) {
+  if(*n && t[*n - 1].x1 + 1 == x0 && t[*n - 1].z == z) {
+    t[*n - 1].x1 = x1;
+    return;
+  }
+  t[*n].x0 = x0;
+  t[*n].x1 = x1;
+  t[*n].z = z;
+  ++*n;
+}
+
+/*!\brief interpole dans \a f les attributs du pixel \a x du
+ * segment [\a xs, \a xe] d'extrémités \a b (deltap valant 1 / (xe -
+ * xs)) : affinement entre leurs valeurs exactes aux multiples de
+ * _affine_span pixels depuis \a xs, que \a af garde d'un pixel au
+ * suivant (af->x1 < af->x0 au début du segment). La profondeur reste
+ * celle de l'interpolation exacte. */
+inline void span_affine(void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float), vertex_t * b, int xs, int xe, float deltap, int x, affine_t * af, vertex_t * f) {
+  float p, q;
+  if(x < af->x0 || x > af->x1) {
+    int x0 = xs + (x - xs) / _affine_span * _affine_span, x1 = MIN(x0 + _affine_span, xe);
+    if(x0 == af->x1 && af->x0 <= af->x1)
+      af->v[0] = af->v[1];
+    else {
+      p = (x0 - xs) * deltap;
+      interp(&af->v[0], &b[0], &b[1], 1.0f - p, p);
+    }
+    p = (x1 - xs) * deltap;
+    interp(&af->v[1], &b[0], &b[1], 1.0f - p, p);
+    af->x0 = x0;
+    af->x1 = x1;
+    af->dq = x1 > x0 ? 1.0f / (x1 - x0) : 0.0f;
+    interp_range(interp, &af->tex, &af->s, &af->e);
+  }
+  q = (x - af->x0) * af->dq;
+  if(af->tex)
+    affine_lerp(f, &af->v[0], &af->v[1], q, 0, 1);
+  affine_lerp(f, &af->v[0], &af->v[1], q, af->s, af->e);
+  p = (x - xs) * deltap;
+  f->z = (1.0f - p) * b[0].z + p * b[1].z;
+}
+
+/*!\brief donne les attributs qu'écrit \a interp, en indices de
+ * floats depuis texCoord comme \ref interpolate : l'intervalle [\a
+ * s, \a e], précédé des coordonnées de texture [0, 1] si \a tex */
+inline void interp_range(void (*interp)(vertex_t *, vertex_t *, vertex_t *, float, float), int * tex, int * s, int * e) {
+  int split = interp == metainterpolate_only_tex || interp == metainterpolate_phong;
+  *tex = split;
+  *s = split || interp == metainterpolate_none ? 6 :
+    interp == metainterpolate_depth ? 8 :
+    interp == metainterpolate_only_color ? 2 : 0;
+  *e = interp == metainterpolate_phong || interp == metainterpolate_phong_all ? 14 : 8;
+}
+
+/*!\brief interpole affinement dans \a r les attributs [\a s, \a e]
+ * (voir \ref interp_range) entre \a a et \a b, au paramètre \a q */
+inline void affine_lerp(vertex_t * r, const vertex_t * a, const vertex_t * b, float q, int s, int e) {
+  int i;
+  float * pr = (float *)&(r->texCoord);
+  const float * pa = (const float *)&(a->texCoord);
+  const float * pb = (const float *)&(b->texCoord);
+  for(i = s; i <= e; ++i)
+    pr[i] = (1.0f - q) * pa[i] + q * pb[i];
+}
+
 /*!\brief effacer le buffer de profondeur (à chaque frame) pour
- * réaliser le z-test */
+ * réaliser le z-test ; seul le rectangle du scissor est effacé s'il
+ * est actif */
 void clear_depth_map(void) {
-  if(_depth) {
-    memset(_depth, 0, gl4dpGetWidth() * gl4dpGetHeight() * sizeof *_depth);
+  int y, x0, y0, x1, y1;
+  if(_rec) {
+    dlist_push(_rec, DL_CLEAR_DEPTH);
+    return;
+  }
+  if(!_depth)
+    return;
+  x0 = 0; x1 = _depthW - 1;
+  y0 = MAX(_band[0], 0); y1 = MIN(_band[1], _depthH - 1);
+  if(_scissor_on) {
+    x0 = MAX(x0, _scissor[0]); x1 = MIN(x1, _scissor[2]);
+    y0 = MAX(y0, _scissor[1]); y1 = MIN(y1, _scissor[3]);
+  }
+  /* les minorants du S-buffer ne tiennent plus sur les lignes
+     effacées : elles sont vidées en entier */
+  if(_sbuf_depth == _depth && x0 <= x1 && y0 <= y1)
+    memset(&_sbufn[y0], 0, (y1 - y0 + 1) * sizeof *_sbufn);
+  if(!_scissor_on && y0 == 0 && y1 == _depthH - 1) {
+    memset(_depth, 0, _depthW * _depthH * sizeof *_depth);
+    return;
+  }
+  for(y = y0; x0 <= x1 && y <= y1; ++y)
+    memset(&_depth[y * _depthW + x0], 0, (x1 - x0 + 1) * sizeof *_depth);
+}
+
+/*!\brief remplit de \a color les pixels de la cible du rendu, ceux
+ * du rectangle du scissor seulement s'il est actif */
+void clear_color_map(GLuint color) {
+  int x, y;
+  if(_rec) {
+    dlist_push(_rec, DL_CLEAR_COLOR)->color = color;
+    return;
+  }
+  get_target();
+  for(y = _clip[1]; y <= _clip[3]; ++y)
+    for(x = _clip[0]; x <= _clip[2]; ++x)
+      _fb[y * _fbW + x] = color;
+}
+
+/*!\brief limite le rendu (rastérisation, effacements, culling) au
+ * rectangle de pixels [\a x0, \a x1] x [\a y0, \a y1], bornes
+ * comprises, comme le glScissor d'OpenGL ; à annuler par \ref
+ * reset_scissor. Les pixels hors du rectangle ne sont pas touchés et
+ * les objets qui ne s'y projettent pas sont écartés par le test du
+ * frustum. */
+void set_scissor(int x0, int y0, int x1, int y1) {
+  _scissor[0] = x0;
+  _scissor[1] = y0;
+  _scissor[2] = x1;
+  _scissor[3] = y1;
+  _scissor_on = 1;
+  if(_rec)
+    memcpy(dlist_push(_rec, DL_SCISSOR)->rect, _scissor, sizeof _scissor);
+}
+
+/*!\brief désactive le scissor, voir \ref set_scissor */
+void reset_scissor(void) {
+  _scissor_on = 0;
+  if(_rec)
+    dlist_push(_rec, DL_NO_SCISSOR);
+}
+
+/*!\brief active (\a on non nul) ou non le visibility buffer pour
+ * les display lists que le thread appelant enregistrera ensuite (voir
+ * \ref dlist_record et \ref dlist_play) ; sans effet sur le rendu
+ * immédiat */
+void set_visibility_buffer(int on) {
+  _visibility = on;
+}
+
+/*!\brief active (\a on non nul) ou non le S-buffer pour le rendu
+ * immédiat du thread appelant et les display lists qu'il enregistrera
+ * ensuite. Chaque ligne du S-buffer garde des segments où la
+ * profondeur est connue pour valoir au moins un certain z : un
+ * segment de triangle (voir \ref raster_block) y est confronté avant
+ * tout travail par pixel, et ses parties entièrement derrière sont
+ * écartées sans être interpolées ni testées. Le buffer de profondeur
+ * reste la référence (le S-buffer n'en est qu'un résumé prudent),
+ * l'image est donc la même. Le gain dépend de l'ordre de dessin :
+ * seuls les segments cachés par ce qui est déjà dessiné sont
+ * écartés. */
+void set_span_buffer(int on) {
+  _span_buffer = on;
+}
+
+/*!\brief en projection perspective, n'interpole exactement (voir
+ * \ref interpolate) les attributs des segments de triangles que tous
+ * les \a n pixels, à partir du début de chaque segment, et
+ * affinement entre ces valeurs, sans division ; 0 (par défaut) pour
+ * l'interpolation exacte à chaque pixel. La profondeur reste exacte,
+ * seules les couleurs et coordonnées de texture s'écartent, d'autant
+ * moins que \a n est petit (8 ou 16 conviennent). Vaut pour le rendu
+ * immédiat du thread appelant et les display lists qu'il
+ * enregistrera ensuite. */
+void set_affine_span(int n) {
+  _affine_span = MAX(n, 0);
+}
+
+/*!\brief crée une display list vide */
+dlist_t * dlist_new(void) {
+  dlist_t * l = calloc(1, sizeof *l);
+  assert(l);
+  return l;
+}
+
+/*!\brief libère la display list \a l */
+void dlist_free(dlist_t * l) {
+  if(!l)
+    return;
+  free(l->cmds);
+  free(l->tris);
+  free(l);
+}
+
+/*!\brief commence (ou, si \a l est NULL, arrête) l'enregistrement du
+ * rendu du thread appelant dans la display list \a l, vidée, pour une
+ * cible de \a w x \a h pixels. Pendant l'enregistrement, \ref
+ * transform_n_rasterize et \ref transform_n_rasterize_instances
+ * transforment, cullent et choisissent les niveaux de détail comme
+ * d'habitude, mais rangent les triangles restants dans \a l au lieu
+ * de les rastériser ; effacements et scissor y sont aussi notés. La
+ * liste est ensuite rastérisée, éventuellement par un autre thread,
+ * par \ref dlist_play. */
+void dlist_record(dlist_t * l, int w, int h) {
+  int i;
+  /* les triangles de la liste terminée ne bougent plus (realloc) :
+     les commandes peuvent pointer dessus, une fois pour toutes */
+  if(_rec)
+    for(i = 0; i < _rec->ncmds; ++i)
+      if(_rec->cmds[i].type == DL_TRIANGLES || _rec->cmds[i].type == DL_IMPOSTOR)
+	_rec->cmds[i].s.t = &_rec->tris[_rec->cmds[i].first];
+  _rec = l;
+  if(!l)
+    return;
+  l->w = w;
+  l->h = h;
+  l->visibility = _visibility;
+  l->sbuffer = _span_buffer;
+  l->affine = _affine_span;
+  l->ncmds = 0;
+  l->ntris = 0;
+}
+
+/*!\brief rastérise dans \a pixels (\a w x \a h, les dimensions de
+ * l'enregistrement) les commandes de la display list \a l, dont
+ * l'enregistrement est terminé. L'image est découpée en bandes
+ * horizontales jouées en parallèle par l'ordonnanceur (voir jobs.c),
+ * chacune dans un buffer de profondeur propre au thread qui la joue ;
+ * chaque bande ne garde que ses lignes de chaque commande, si bien que
+ * l'image ne dépend pas du découpage. En mode mono-thread, l'image
+ * n'est qu'une bande. L'état de la rastérisation du thread appelant
+ * n'est pas modifié.
+ *
+ * Une liste enregistrée avec le visibility buffer (voir \ref
+ * set_visibility_buffer) est jouée en deux passes : la première ne
+ * rastérise que la profondeur et, par pixel, la commande et le
+ * triangle visibles ; la seconde (\ref vis_resolve) colorie chaque
+ * pixel une seule fois, quel que soit le nombre de triangles qui s'y
+ * sont recouverts. Les triangles qui traversent le plan near et les
+ * imposteurs, dont la position à l'écran ne suffit pas à retrouver
+ * les attributs, restent coloriés dès la première passe. */
+void dlist_play(dlist_t * l, GLuint * pixels, int w, int h) {
+  dplay_t p;
+  int n = jobs_threads();
+  assert(l != _rec && l->w == w && l->h == h);
+  p.l = l;
+  p.pixels = pixels;
+  /* les triangles n'étant pas répartis également, quatre bandes par
+     thread équilibrent mieux la charge qu'une seule */
+  p.band = n > 1 ? MAX(DLIST_BAND_MIN, (h + 4 * n - 1) / (4 * n)) : MAX(h, 1);
+  jobs_parallel_for((h + p.band - 1) / p.band, 1, dlist_play_bands, &p);
+}
+
+/*!\brief la tâche de \ref dlist_play : joue les bandes [\a b0, \a
+ * b1[ */
+void dlist_play_bands(void * data, int b0, int b1) {
+  dplay_t * p = data;
+  int b;
+  for(b = b0; b < b1; ++b)
+    dlist_play_rows(p->l, p->pixels, b * p->band, MIN((b + 1) * p->band, p->l->h) - 1);
+}
+
+/*!\brief joue les commandes de la display list \a l dans les lignes
+ * [\a y0, \a y1] de \a pixels, puis rend au thread son état */
+inline void dlist_play_rows(dlist_t * l, GLuint * pixels, int y0, int y1) {
+  rstate_t st;
+  int i, y;
+  save_state(&st);
+  _rec = NULL;
+  _depth = _play_depth;
+  _depthW = _play_depthW;
+  _depthH = _play_depthH;
+  _band[0] = y0;
+  _band[1] = y1;
+  _span_buffer = l->sbuffer;
+  _affine_span = l->affine;
+  set_render_target(pixels, l->w, l->h);
+  _scissor_on = 0;
+  if(l->visibility) {
+    if(_play_vis == NULL || _play_visW != l->w || _play_visH != l->h) {
+      free(_play_vis);
+      _play_vis = calloc(l->w * l->h, sizeof *_play_vis);
+      assert(_play_vis);
+      _play_visW = l->w;
+      _play_visH = l->h;
+    }
+    _vis = _play_vis;
+    _vis_box[0] = l->w;
+    _vis_box[1] = l->h;
+    _vis_box[2] = _vis_box[3] = -1;
+  }
+  for(i = 0; i < l->ncmds; ++i) {
+    dcmd_t * c = &l->cmds[i];
+    switch(c->type) {
+    case DL_CLEAR_COLOR:
+      clear_color_map(c->color);
+      /* les pixels effacés n'ont plus de triangle à colorier */
+      for(y = _clip[1]; _vis && _clip[0] <= _clip[2] && y <= _clip[3]; ++y)
+	memset(&_vis[y * _fbW + _clip[0]], 0, (_clip[2] - _clip[0] + 1) * sizeof *_vis);
+      break;
+    case DL_CLEAR_DEPTH:
+      get_target();
+      clear_depth_map();
+      break;
+    case DL_SCISSOR:
+      set_scissor(c->rect[0], c->rect[1], c->rect[2], c->rect[3]);
+      break;
+    case DL_NO_SCISSOR:
+      reset_scissor();
+      break;
+    default:
+      get_target();
+      _tex = c->tex;
+      _perpective_correction = c->persp;
+      _vis_draw = i + 1;
+      if(c->type == DL_IMPOSTOR)
+	sphere_impostor(&c->s, c->mv, c->inv, c->proj, c->r);
+      else
+	rasterize_surface(&c->s);
+      break;
+    }
+  }
+  if(_vis) {
+    vis_resolve(l);
+    _vis = NULL;
+  }
+  _play_depth = _depth;
+  _play_depthW = _depthW;
+  _play_depthH = _depthH;
+  restore_state(&st);
+}
+
+/*!\brief seconde passe du visibility buffer (voir \ref dlist_play) :
+ * chaque pixel du rectangle _vis_box où un triangle de la display
+ * list \a l est resté visible est colorié une seule fois. Ses
+ * attributs sont interpolés comme l'aurait fait le rendu direct :
+ * d'après ses poids barycentriques pour un petit triangle (\ref
+ * raster_tiny), sinon le long du segment de sa ligne, borné à sa
+ * tuile pour un grand triangle (\ref raster_block), que les pixels
+ * suivants du même triangle réutilisent. Ceux d'une même commande
+ * partagent sa texture et, en Phong, leur éclairage par paquets de
+ * PHONG_CHUNK. Le buffer est remis à zéro au passage. */
+inline void vis_resolve(dlist_t * l) {
+  int x, y, k = 0, o[PHONG_CHUNK], draw = 0, tri = -1, phong = 0, d = 0, box[4], xs = 0, xe = -1, sy = -1;
+  float deltap = 0.0f;
+  affine_t af;
+  surface_t * s = NULL;
+  triangle_t * t = NULL;
+  edges_t e;
+  vertex_t v[PHONG_CHUNK], r, f1, b[2];
+  memset(&e, 0, sizeof e);
+  memset(box, 0, sizeof box);
+  for(y = _vis_box[1]; y <= _vis_box[3]; ++y)
+    for(x = _vis_box[0]; x <= _vis_box[2]; ++x) {
+      vis_t * p = &_vis[y * _fbW + x];
+      vertex_t * f;
+      if(!p->draw)
+	continue;
+      if(p->draw != draw) {
+	dcmd_t * c = &l->cmds[p->draw - 1];
+	if(k) {
+	  phong_flush(s, _fb, v, o, k);
+	  k = 0;
+	}
+	draw = p->draw;
+	tri = -1;
+	s = &c->s;
+	_tex = c->tex;
+	_perpective_correction = c->persp;
+	phong = (s->options & (SO_USE_LIGHTING | SO_USE_PHONG)) == (SO_USE_LIGHTING | SO_USE_PHONG);
+      }
+      if(p->tri != tri) {
+	tri = p->tri;
+	t = &(s->t[tri]);
+	tri_edges(t, &e);
+	d = tri_box(t, box);
+	sy = -1;
+      }
+      p->draw = 0;
+      f = phong ? &v[k] : &f1;
+      if(d < TINY_TRI_PX) {
+	int64_t e0 = e.a[0] * x + e.b[0] * y + e.c[0], e1 = e.a[1] * x + e.b[1] * y + e.c[1];
+	float l01;
+	if(e0 + e1 > 0)
+	  s->interpolatefunc(&r, &(t->v[0]), &(t->v[1]), (float)e0 / (float)(e0 + e1), (float)e1 / (float)(e0 + e1));
+	else
+	  s->interpolatefunc(&r, &(t->v[0]), &(t->v[1]), 1.0f, 0.0f);
+	l01 = (float)(e0 + e1) / (float)e.area;
+	s->interpolatefunc(f, &r, &(t->v[2]), l01, 1.0f - l01);
+      } else {
+	float q;
+	if(y != sy || x > xe) {
+	  /* le segment de raster_block qui a posé ce pixel : celui de la
+	     ligne dans la boîte du triangle, ou dans sa tuile */
+	  int x0 = box[0], x1 = box[2];
+	  if(d >= TILED_TRI_PX) {
+	    x0 = box[0] + (x - box[0]) / TILE * TILE;
+	    x1 = MIN(x0 + TILE - 1, box[2]);
+	  }
+	  row_span(&e, y, x0, x1, &xs, &xe);
+	  span_ends(s->interpolatefunc, t, &e, y, xs, xe, b);
+	  deltap = xe > xs ? 1.0f / (xe - xs) : 0.0f;
+	  sy = y;
+	  af.x0 = 0;
+	  af.x1 = -1;
+	}
+	q = (x - xs) * deltap;
+	if(_affine_span && _perpective_correction)
+	  span_affine(s->interpolatefunc, b, xs, xe, deltap, x, &af, f);
+	else
+	  s->interpolatefunc(f, &b[0], &b[1], 1.0f - q, q);
+      }
+      if(!phong) {
+	PROF_BEGIN(PROF_SHADING);
+	s->shadingfunc(s, &_fb[y * _fbW + x], f);
+	PROF_END(PROF_SHADING);
+	PROF_COUNT(PROF_PIX_SHADED, 1);
+	continue;
+      }
+      o[k] = y * _fbW + x;
+      if(++k == PHONG_CHUNK) {
+	phong_flush(s, _fb, v, o, k);
+	k = 0;
+      }
+    }
+  if(k)
+    phong_flush(s, _fb, v, o, k);
+}
+
+/*!\brief met de côté dans \a st l'état de la rastérisation du thread */
+inline void save_state(rstate_t * st) {
+  st->tex = _tex;
+  st->depth = _depth;
+  st->depthW = _depthW;
+  st->depthH = _depthH;
+  st->fb = _fb;
+  st->fbW = _fbW;
+  st->fbH = _fbH;
+  st->fb_user = _fb_user;
+  memcpy(st->scissor, _scissor, sizeof st->scissor);
+  st->scissor_on = _scissor_on;
+  memcpy(st->clip, _clip, sizeof st->clip);
+  memcpy(st->band, _band, sizeof st->band);
+  st->persp = _perpective_correction;
+  st->sbuffer = _span_buffer;
+  st->affine = _affine_span;
+  st->rec = _rec;
+}
+
+/*!\brief rend au thread l'état de la rastérisation \a st, voir \ref
+ * save_state */
+inline void restore_state(const rstate_t * st) {
+  _tex = st->tex;
+  _depth = st->depth;
+  _depthW = st->depthW;
+  _depthH = st->depthH;
+  _fb = st->fb;
+  _fbW = st->fbW;
+  _fbH = st->fbH;
+  _fb_user = st->fb_user;
+  memcpy(_scissor, st->scissor, sizeof _scissor);
+  _scissor_on = st->scissor_on;
+  memcpy(_clip, st->clip, sizeof _clip);
+  memcpy(_band, st->band, sizeof _band);
+  _perpective_correction = st->persp;
+  _span_buffer = st->sbuffer;
+  _affine_span = st->affine;
+  _rec = st->rec;
+}
+
+/*!\brief ajoute à \a l une commande de type \a type et la renvoie */
+inline dcmd_t * dlist_push(dlist_t * l, int type) {
+  if(l->ncmds == l->capcmds) {
+    l->capcmds = l->capcmds ? 2 * l->capcmds : 64;
+    l->cmds = realloc(l->cmds, l->capcmds * sizeof *l->cmds);
+    assert(l->cmds);
+  }
+  l->cmds[l->ncmds].type = type;
+  return &l->cmds[l->ncmds++];
+}
+
+/*!\brief enregistre dans la display list en cours la surface \a s,
+ * dont les triangles viennent d'être transformés : seuls ceux qui ne
+ * sont ni cullés ni entièrement hors du frustum sont gardés, et la
+ * commande copie l'état de \a s et celui de la rastérisation (texture,
+ * correction de perspective) */
+inline void dlist_surface(surface_t * s) {
+  dlist_t * l = _rec;
+  dcmd_t * c;
+  int i, n = 0;
+  if(l->ntris + s->n > l->captris) {
+    l->captris = MAX(2 * l->captris, l->ntris + s->n);
+    l->tris = realloc(l->tris, l->captris * sizeof *l->tris);
+    assert(l->tris);
+  }
+  for(i = 0; i < s->n; ++i) {
+    if(s->t[i].state & PS_CULL) { PROF_COUNT(PROF_TRI_CULLED, 1); continue; }
+    if(s->t[i].state & PS_TOTALLY_OUT) { PROF_COUNT(PROF_TRI_OUT, 1); continue; }
+    l->tris[l->ntris + n++] = s->t[i];
   }
+  if(!n)
+    return;
+  c = dlist_push(l, DL_TRIANGLES);
+  c->s = *s;
+  c->s.n = n;
+  c->s.t = NULL;
+  c->first = l->ntris;
+  c->tex = _tex;
+  c->persp = _perpective_correction;
+  l->ntris += n;
+}
+
+/*!\brief enregistre dans la display list en cours l'imposteur de la
+ * sphère \a s (voir \ref sphere_impostor pour les paramètres) ; son
+ * premier triangle est gardé pour la couleur des sommets */
+inline void dlist_impostor(surface_t * s, float * model_view_matrix, float * inv_model_view_matrix, float * projection_matrix, float r) {
+  dlist_t * l = _rec;
+  dcmd_t * c;
+  if(l->ntris + 1 > l->captris) {
+    l->captris = MAX(2 * l->captris, 64);
+    l->tris = realloc(l->tris, l->captris * sizeof *l->tris);
+    assert(l->tris);
+  }
+  l->tris[l->ntris] = s->t[0];
+  c = dlist_push(l, DL_IMPOSTOR);
+  c->s = *s;
+  c->s.n = 1;
+  c->s.t = NULL;
+  c->first = l->ntris++;
+  c->tex = _tex;
+  c->persp = _perpective_correction;
+  memcpy(c->mv, model_view_matrix, sizeof c->mv);
+  memcpy(c->inv, inv_model_view_matrix, sizeof c->inv);
+  memcpy(c->proj, projection_matrix, sizeof c->proj);
+  c->r = r;
+}
+
+/*!\brief rastérise dans \a pixels (\a w x \a h) plutôt que dans le
+ * screen GL4Dummies courant ; utile pour un rendu sans fenêtre. Si \a
+ * pixels est NULL, revient au screen courant. */
+void set_render_target(GLuint * pixels, int w, int h) {
+  _fb_user = pixels != NULL;
+  _fb = pixels;
+  _fbW = w;
+  _fbH = h;
 }
 
 /*!\brief met en place une texture pour être mappée sur la surface en cours */
 void set_texture(GLuint screen) {
   GLuint old_id = gl4dpGetTextureId(); /* au cas où */
   gl4dpSetScreen(screen);
-  _tex = gl4dpGetPixels();
-  _texW = gl4dpGetWidth();
-  _texH = gl4dpGetHeight();
+  set_texture_pixels(gl4dpGetPixels(), gl4dpGetWidth(), gl4dpGetHeight());
   if(old_id)
     gl4dpSetScreen(old_id);
 }
 
+/*!\brief met en place les pixels \a pixels (\a w x \a h) comme
+ * texture ; sert aux surfaces dont le tex_id est nul, par exemple
+ * pour un rendu sans fenêtre (donc sans screen GL4Dummies). */
+void set_texture_pixels(GLuint * pixels, GLuint w, GLuint h) {
+  _tex.pixels = pixels;
+  _tex.stride = _tex.w = w;
+  _tex.h = h;
+  _tex.x = _tex.y = 0;
+  _tex.format = TF_RGBA;
+}
+
 
 /*!\brief met à jour la fonction d'interpolation et de coloriage
  * (shadingfunc) de la surface en fonction de ses options */
@@ -118,6 +1824,10 @@ void updatesfuncs(surface_t * s) {
     s->interpolatefunc = (t = s->options & SO_COLOR_MATERIAL) ? metainterpolate_only_color : metainterpolate_none;
     s->shadingfunc = (s->options & SO_USE_COLOR) ? (t ? shading_only_color_CM : shading_only_color) : shading_none;;
   }
+  /* en Phong, normales et positions s'ajoutent aux attributs à
+     interpoler */
+  if((s->options & (SO_USE_LIGHTING | SO_USE_PHONG)) == (SO_USE_LIGHTING | SO_USE_PHONG))
+    s->interpolatefunc = (s->options & SO_COLOR_MATERIAL) ? metainterpolate_phong_all : metainterpolate_phong;
 }
 
 /*!\brief fonction principale de ce fichier, elle dessine un triangle
@@ -126,7 +1836,7 @@ void updatesfuncs(surface_t * s) {
  */
 inline void fill_triangle(surface_t * s, triangle_t * t) {
   vertex_t * aG = NULL, * aD = NULL;
-  int bas, median, haut, n, signe, i, h = gl4dpGetHeight();
+  int bas, median, haut, n, signe, i;
   if(t->v[0].y < t->v[1].y) {
     if(t->v[0].y < t->v[2].y) {
       bas = 0;
@@ -177,6 +1887,7 @@ inline void fill_triangle(surface_t * s, triangle_t * t) {
     x = -(c + t->v[median].y) / a;
     signe = (t->v[median].x >= x) ? -1 : 1;
   }
+  PROF_BEGIN(PROF_ABSCISSES);
   if(signe < 0) { /* aG reçoit Ph->Pb, et aD reçoit Ph->Pm puis Pm vers Pb */
     abscisses(s, &(t->v[haut]), &(t->v[bas]), aG, 1);
     abscisses(s, &(t->v[haut]), &(t->v[median]), aD, 1);
@@ -186,11 +1897,14 @@ inline void fill_triangle(surface_t * s, triangle_t * t) {
     abscisses(s, &(t->v[haut]), &(t->v[median]), aG, 1);
     abscisses(s, &(t->v[median]), &(t->v[bas]), &aG[t->v[haut].y - t->v[median].y], 0);
   }
+  PROF_END(PROF_ABSCISSES);
+  PROF_BEGIN(PROF_HLINE);
   for(i = 0; i < n; ++i) {
-    if( aG[i].y >= 0 && aG[i].y < h &&
+    if( aG[i].y >= _clip[1] && aG[i].y <= _clip[3] &&
 	( (aG[i].z >= 0 && aG[i].z <= 1) || (aD[i].z >= 0 && aD[i].z <= 1) ) )
       horizontal_line(s, &aG[i], &aD[i]);
   }
+  PROF_END(PROF_HLINE);
   free(aG);
   free(aD);
 }
@@ -258,46 +1972,190 @@ inline void abscisses(surface_t * s, vertex_t * p0, vertex_t * p1, vertex_t * ab
 
 /*!\brief remplissage par droite horizontale entre deux abscisses */
 inline void horizontal_line(surface_t * s, vertex_t * vG, vertex_t * vD) {
-  int w = gl4dpGetWidth(), x, yw = vG->y * w;
-  GLuint * image = gl4dpGetPixels();
+  int x, yw = vG->y * _fbW;
+  GLuint * image = _fb;
   float dmax = vD->x - vG->x, p, deltap;
   vertex_t v;
+  if((s->options & (SO_USE_LIGHTING | SO_USE_PHONG)) == (SO_USE_LIGHTING | SO_USE_PHONG)) {
+    horizontal_line_phong(s, vG, vD);
+    return;
+  }
   /* il reste d'autres optims possibles */
   for(x = vG->x, p = 0.0f, deltap = 1.0f / dmax; x <= vD->x; ++x, p += deltap)
-    if(x >= 0 && x < w) {
+    if(x >= _clip[0] && x <= _clip[2]) {
       s->interpolatefunc(&v, vG, vD, 1.0f - p, p);
+      PROF_COUNT(PROF_PIX_TESTED, 1);
       if(v.z < 0 || v.z > 1 || v.z < _depth[yw + x]) { continue; }
+      PROF_COUNT(PROF_PIX_PASSED, 1);
+      PROF_COUNT(PROF_PIX_COVERED, _depth[yw + x] == 0.0f);
+      PROF_BEGIN(PROF_SHADING);
       s->shadingfunc(s, &image[yw + x], &v);
+      PROF_END(PROF_SHADING);
+      PROF_COUNT(PROF_PIX_SHADED, 1);
       _depth[yw + x] = v.z;
+      if(_vis)
+	_vis[yw + x].draw = 0;
+    }
+}
+/*!\brief remplissage par droite horizontale avec éclairage par
+ * pixel. Les fragments qui passent le z-test sont mis de côté par
+ * paquets de \ref PHONG_CHUNK, éclairés d'un coup par \ref
+ * phong_span puis coloriés par la shadingfunc de la surface. */
+inline void horizontal_line_phong(surface_t * s, vertex_t * vG, vertex_t * vD) {
+  int x, yw = vG->y * _fbW, k = 0, o[PHONG_CHUNK];
+  GLuint * image = _fb;
+  float dmax = vD->x - vG->x, p, deltap;
+  vertex_t v[PHONG_CHUNK];
+  for(x = vG->x, p = 0.0f, deltap = 1.0f / dmax; x <= vD->x; ++x, p += deltap)
+    if(x >= _clip[0] && x <= _clip[2]) {
+      s->interpolatefunc(&v[k], vG, vD, 1.0f - p, p);
+      PROF_COUNT(PROF_PIX_TESTED, 1);
+      if(v[k].z < 0 || v[k].z > 1 || v[k].z < _depth[yw + x]) { continue; }
+      PROF_COUNT(PROF_PIX_PASSED, 1);
+      PROF_COUNT(PROF_PIX_COVERED, _depth[yw + x] == 0.0f);
+      _depth[yw + x] = v[k].z;
+      if(_vis)
+	_vis[yw + x].draw = 0;
+      o[k] = yw + x;
+      if(++k == PHONG_CHUNK) {
+	phong_flush(s, image, v, o, k);
+	k = 0;
+      }
+    }
+  if(k)
+    phong_flush(s, image, v, o, k);
+}
+
+/*!\brief éclaire puis colorie les \a n fragments \a v destinés aux
+ * pixels d'indices \a o de \a image ; en Phong, le spéculaire est
+ * ajouté (avec saturation) à la couleur produite par la
+ * shadingfunc. */
+inline void phong_flush(surface_t * s, GLuint * image, vertex_t * v, int * o, int n) {
+  int i;
+  PROF_BEGIN(PROF_SHADING);
+  float nx[PHONG_CHUNK], ny[PHONG_CHUNK], nz[PHONG_CHUNK];
+  float px[PHONG_CHUNK], py[PHONG_CHUNK], pz[PHONG_CHUNK];
+  float li[PHONG_CHUNK], sp[PHONG_CHUNK];
+  /* passage en "structure de tableaux" pour que les boucles de
+     phong_span soient vectorisables */
+  for(i = 0; i < n; ++i) {
+    nx[i] = v[i].normal.x; ny[i] = v[i].normal.y; nz[i] = v[i].normal.z;
+    px[i] = v[i].opos.x;   py[i] = v[i].opos.y;   pz[i] = v[i].opos.z;
+  }
+  phong_span(s, nx, ny, nz, px, py, pz, li, sp, n);
+  for(i = 0; i < n; ++i) {
+    GLuint * pc = &image[o[i]];
+    v[i].li = li[i];
+    s->shadingfunc(s, pc, &v[i]);
+    if(sp[i] > 0.0f && (s->options & SO_USE_PHONG)) {
+      float f = sp[i] * (255 + EPSILON);
+      *pc = rgba((GLubyte)MIN(255.0f,   red(*pc) + f * s->scolor.x),
+		 (GLubyte)MIN(255.0f, green(*pc) + f * s->scolor.y),
+		 (GLubyte)MIN(255.0f,  blue(*pc) + f * s->scolor.z),
+		 alpha(*pc));
     }
+  }
+  PROF_COUNT(PROF_PIX_SHADED, n);
+  PROF_END(PROF_SHADING);
 }
+
+/*!\brief calcule l'intensité diffuse \a li et spéculaire \a sp de \a
+ * n fragments à partir de leurs normales (\a nx, \a ny, \a nz) et
+ * positions (\a px, \a py, \a pz) dans le repère objet. Les boucles
+ * sont sans branchement pour être vectorisées par le compilateur ;
+ * la puissance du spéculaire (Blinn-Phong) utilise l'approximation
+ * de Schlick x^n ~ x / (n - n x + x). */
+inline void phong_span(surface_t * s, float * nx, float * ny, float * nz, float * px, float * py, float * pz, float * li, float * sp, int n) {
+  int i, l;
+  const olights_t * ol = &(s->lights);
+  const float sh = s->shininess;
+  float vx[PHONG_CHUNK], vy[PHONG_CHUNK], vz[PHONG_CHUNK];
+  for(i = 0; i < n; ++i) {
+    float in = frsqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i] + FLT_MIN), iv;
+    nx[i] *= in; ny[i] *= in; nz[i] *= in;
+    vx[i] = ol->eye.x - px[i]; vy[i] = ol->eye.y - py[i]; vz[i] = ol->eye.z - pz[i];
+    iv = frsqrt(vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i] + FLT_MIN);
+    vx[i] *= iv; vy[i] *= iv; vz[i] *= iv;
+    li[i] = ol->ambient;
+    sp[i] = 0.0f;
+  }
+  for(l = 0; l < ol->np + ol->nd; ++l) {
+    const int pt = l < ol->np;
+    const vec4 * L = pt ? &(ol->p[l]) : &(ol->d[l - ol->np]);
+    for(i = 0; i < n; ++i) {
+      float lx = pt ? L->x - px[i] : L->x, ly = pt ? L->y - py[i] : L->y, lz = pt ? L->z - pz[i] : L->z;
+      float il = frsqrt(lx * lx + ly * ly + lz * lz + FLT_MIN), d, hx, hy, hz, c;
+      lx *= il; ly *= il; lz *= il;
+      d = nx[i] * lx + ny[i] * ly + nz[i] * lz;
+      d = d > 0.0f ? d : 0.0f;
+      hx = lx + vx[i]; hy = ly + vy[i]; hz = lz + vz[i];
+      c = (nx[i] * hx + ny[i] * hy + nz[i] * hz) * frsqrt(hx * hx + hy * hy + hz * hz + FLT_MIN);
+      c = (c > 0.0f && d > 0.0f) ? c : 0.0f;
+      li[i] += L->w * d;
+      sp[i] += L->w * c / (sh - sh * c + c + FLT_MIN);
+    }
+  }
+  for(i = 0; i < n; ++i) {
+    li[i] = li[i] < 1.0f ? li[i] : 1.0f;
+    sp[i] = sp[i] < 1.0f ? sp[i] : 1.0f;
+  }
+}
+
+/*!\brief renvoie 1 / sqrt(\a x). Sauf si RASTERIZE_EXACT_RSQRT est
+ * défini, utilise l'approximation par manipulation de bits suivie
+ * d'une itération de Newton (erreur relative < 0.2%), suffisante pour
+ * normaliser des vecteurs d'éclairage. */
+inline float frsqrt(float x) {
+#ifdef RASTERIZE_EXACT_RSQRT
+  return 1.0f / sqrtf(x);
+#else
+  union { float f; uint32_t i; } u = { x };
+  u.i = 0x5f3759df - (u.i >> 1);
+  return u.f * (1.5f - 0.5f * x * u.f * u.f);
+#endif
+}
+
 /*!\brief aucune couleur n'est inscrite */
 inline void shading_none(surface_t * s, GLuint * pcolor, vertex_t * v) {
   //vide pour l'instant, à prévoir le z-buffer
 }
 
+/*!\brief renvoie le texel de \a t aux coordonnées de texture \a tc,
+ * répétées (wrap) à l'intérieur du sous-rectangle de \a t ; ne
+ * dépend d'aucun état global */
+inline GLuint texel(const texture_t * t, const vec2 * tc) {
+  int xt, yt;
+  xt = (int)(tc->x * (t->w - EPSILON)) % t->w;
+  if(xt < 0) xt += t->w;
+  yt = (int)(tc->y * (t->h - EPSILON)) % t->h;
+  if(yt < 0) yt += t->h;
+  if(t->format == TF_BC1)
+    return bc1_texel(t, t->x + xt, t->y + yt);
+  return t->pixels[(t->y + yt) * t->stride + t->x + xt];
+}
+
+/*!\brief décode le texel (\a x, \a y) de l'image BC1 de \a t (voir
+ * atlas_compress) : la palette de son bloc est prise dans le cache du
+ * thread, ou décodée et mise en cache, puis l'indice du texel y est
+ * lu */
+inline GLuint bc1_texel(const texture_t * t, int x, int y) {
+  const GLuint * b = &t->pixels[((y >> 2) * (t->stride >> 2) + (x >> 2)) << 1];
+  bc1_entry_t * e = &_bc1_cache[((x >> 2) + (y >> 2) * 3) & (BC1_CACHE - 1)];
+  if(e->c01 != b[0] || !e->pal[0]) {
+    e->c01 = b[0];
+    bc1_palette(b[0], e->pal);
+  }
+  return e->pal[(b[1] >> (((y & 3) << 3) | ((x & 3) << 1))) & 3];
+}
+
 /*!\brief la couleur du pixel est tirée uniquement de la texture */
 inline void shading_only_tex(surface_t * s, GLuint * pcolor, vertex_t * v) {
-  int xt, yt, ct;
   GLubyte r, g, b, a;
-  xt = (int)(v->texCoord.x * (_texW - EPSILON));
-  if(xt < 0) {
-    xt = xt % (-_texW);
-    while(xt < 0) xt += _texW;
-  } else
-    xt = xt % _texW;
-  yt = (int)(v->texCoord.y * (_texH - EPSILON));
-  if(yt < 0) {
-    yt = yt % (-_texH);
-    while(yt < 0) yt += _texH;
-  } else
-    yt = yt % _texH;
-  ct = yt * _texW + xt;
-  *pcolor = _tex[yt * _texW + xt];
-  r = (GLubyte)(  red(_tex[ct]) * v->li);
-  g = (GLubyte)(green(_tex[ct]) * v->li);
-  b = (GLubyte)( blue(_tex[ct]) * v->li);
-  a = (GLubyte) alpha(_tex[ct]);
+  GLuint ct = texel(s->tex.pixels ? &s->tex : &_tex, &v->texCoord);
+  r = (GLubyte)(  red(ct) * v->li);
+  g = (GLubyte)(green(ct) * v->li);
+  b = (GLubyte)( blue(ct) * v->li);
+  a = (GLubyte) alpha(ct);
   *pcolor = rgba(r, g, b, a);
 }
 
@@ -326,24 +2184,11 @@ inline void shading_only_color(surface_t * s, GLuint * pcolor, vertex_t * v) {
  * et de la texture */
 inline void shading_all_CM(surface_t * s, GLuint * pcolor, vertex_t * v) {
   GLubyte r, g, b, a;
-  int xt, yt, ct;
-  xt = (int)(v->texCoord.x * (_texW - EPSILON));
-  if(xt < 0) {
-    xt = xt % (-_texW);
-    while(xt < 0) xt += _texW;
-  } else
-    xt = xt % _texW;
-  yt = (int)(v->texCoord.y * (_texH - EPSILON));
-  if(yt < 0) {
-    yt = yt % (-_texH);
-    while(yt < 0) yt += _texH;
-  } else
-    yt = yt % _texH;
-  ct = yt * _texW + xt;
-  r = (GLubyte)((  red(_tex[ct]) + EPSILON) * v->li * v->icolor.x);
-  g = (GLubyte)((green(_tex[ct]) + EPSILON) * v->li * v->icolor.y);
-  b = (GLubyte)(( blue(_tex[ct]) + EPSILON) * v->li * v->icolor.z);
-  a = (GLubyte)((alpha(_tex[ct]) + EPSILON) * v->icolor.w);
+  GLuint ct = texel(s->tex.pixels ? &s->tex : &_tex, &v->texCoord);
+  r = (GLubyte)((  red(ct) + EPSILON) * v->li * v->icolor.x);
+  g = (GLubyte)((green(ct) + EPSILON) * v->li * v->icolor.y);
+  b = (GLubyte)(( blue(ct) + EPSILON) * v->li * v->icolor.z);
+  a = (GLubyte)((alpha(ct) + EPSILON) * v->icolor.w);
   *pcolor = rgba(r, g, b, a);
 }
 
@@ -351,24 +2196,11 @@ inline void shading_all_CM(surface_t * s, GLuint * pcolor, vertex_t * v) {
  * de la surface et de la texture */
 inline void shading_all(surface_t * s, GLuint * pcolor, vertex_t * v) {
   GLubyte r, g, b, a;
-  int xt, yt, ct;
-  xt = (int)(v->texCoord.x * (_texW - EPSILON));
-  if(xt < 0) {
-    xt = xt % (-_texW);
-    while(xt < 0) xt += _texW;
-  } else
-    xt = xt % _texW;
-  yt = (int)(v->texCoord.y * (_texH - EPSILON));
-  if(yt < 0) {
-    yt = yt % (-_texH);
-    while(yt < 0) yt += _texH;
-  } else
-    yt = yt % _texH;
-  ct = yt * _texW + xt;
-  r = (GLubyte)((  red(_tex[ct]) + EPSILON) * v->li * s->dcolor.x);
-  g = (GLubyte)((green(_tex[ct]) + EPSILON) * v->li * s->dcolor.y);
-  b = (GLubyte)(( blue(_tex[ct]) + EPSILON) * v->li * s->dcolor.z);
-  a = (GLubyte)((alpha(_tex[ct]) + EPSILON) * s->dcolor.w);
+  GLuint ct = texel(s->tex.pixels ? &s->tex : &_tex, &v->texCoord);
+  r = (GLubyte)((  red(ct) + EPSILON) * v->li * s->dcolor.x);
+  g = (GLubyte)((green(ct) + EPSILON) * v->li * s->dcolor.y);
+  b = (GLubyte)(( blue(ct) + EPSILON) * v->li * s->dcolor.z);
+  a = (GLubyte)((alpha(ct) + EPSILON) * s->dcolor.w);
   *pcolor = rgba(r, g, b, a);
 }
 
@@ -404,6 +2236,12 @@ inline void interpolate(vertex_t * r, vertex_t * a, vertex_t * b, float fa, floa
 inline void metainterpolate_none(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb) {
   interpolate(r, a, b, fa, fb, 6, 8);
 }
+/*!\brief n'interpole que la profondeur, la seule utile à la première
+ * passe du visibility buffer ; elle l'est toujours linéairement (voir
+ * \ref interpolate), d'où le même z que les autres interpolations */
+inline void metainterpolate_depth(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb) {
+  r->z = fa * a->z + fb * b->z;
+}
 
 /*!\brief meta-fonction pour appeler \a interpolate, demande
  * uniquement l'interpolation des coord. de texture et les z */
@@ -424,6 +2262,23 @@ inline void metainterpolate_all(vertex_t * r, vertex_t * a, vertex_t * b, float
   interpolate(r, a, b, fa, fb, 0, 8);
 }
 
+/*!\brief meta-fonction pour appeler \a interpolate, demande
+ * l'interpolation des coord. de texture, des z, des normales et des
+ * positions (Phong) */
+inline void metainterpolate_phong(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb) {
+  interpolate(r, a, b, fa, fb, 0, 1);
+  interpolate(r, a, b, fa, fb, 6, 8);
+  interpolate(r, a, b, fa, fb, 9, 14);
+}
+
+/*!\brief meta-fonction pour appeler \a interpolate, demande
+ * l'interpolation de l'ensemble des attributs, normales et positions
+ * comprises (Phong) */
+inline void metainterpolate_phong_all(vertex_t * r, vertex_t * a, vertex_t * b, float fa, float fb) {
+  interpolate(r, a, b, fa, fb, 0, 8);
+  interpolate(r, a, b, fa, fb, 9, 14);
+}
+
 GLuint rgba(GLubyte r, GLubyte g, GLubyte b, GLubyte a) {
   return RGBA(r, g, b, a);
 }
@@ -445,11 +2300,31 @@ GLubyte alpha(GLuint c) {
 }
 
 
-/*!\brief au moment de quitter le programme désallouer la mémoire
- * utilisée pour _depth */
-void pquit(void) {
+/*!\brief désalloue les buffers de profondeur du thread appelant ;
+ * appelée au moment de quitter le programme et à la fin du thread de
+ * rastérisation (voir pipeline.c) et de ceux de l'ordonnanceur (voir
+ * jobs.c) */
+void free_depth_map(void) {
   if(_depth) {
     free(_depth);
     _depth = NULL;
   }
+  if(_play_depth) {
+    free(_play_depth);
+    _play_depth = NULL;
+    _play_depthW = _play_depthH = 0;
+  }
+  if(_play_vis) {
+    free(_play_vis);
+    _play_vis = NULL;
+    _play_visW = _play_visH = 0;
+  }
+  free(_sbuf);
+  free(_sbufn);
+  _sbuf = NULL;
+  _sbufn = NULL;
+  _sbufH = 0;
+  _sbuf_depth = NULL;
+  free(_work);
+  _work = NULL;
 }
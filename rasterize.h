@@ -14,6 +14,7 @@
 #  include <GL4D/gl4dm.h>
 
 #include <float.h>
+#include <stdio.h>
 #define EPSILON ((double)FLT_EPSILON)
 
 #  ifdef __cplusplus
@@ -22,12 +23,47 @@ extern "C" {
   
   typedef enum pstate_t pstate_t;
   typedef enum soptions_t soptions_t;
+  typedef enum ltype_t ltype_t;
+  typedef enum tformat_t tformat_t;
+  typedef enum objflags_t objflags_t;
   typedef struct vec4 vec4;
   typedef struct vec3 vec3;
   typedef struct vec2 vec2;
   typedef struct vertex_t vertex_t;
   typedef struct triangle_t triangle_t;
+  typedef struct cvertex_t cvertex_t;
   typedef struct surface_t surface_t;
+  typedef struct texture_t texture_t;
+  typedef struct atlas_t atlas_t;
+  typedef struct light_t light_t;
+  typedef struct olights_t olights_t;
+  typedef enum pstage_t pstage_t;
+  typedef enum pcounter_t pcounter_t;
+  typedef struct prof_frame_t prof_frame_t;
+  typedef struct dlist_t dlist_t;
+  typedef struct job_t job_t;
+
+  /*!\brief variable propre à chaque thread */
+#  if defined(_MSC_VER)
+#    define THREAD_LOCAL __declspec(thread)
+#  else
+#    define THREAD_LOCAL __thread
+#  endif
+  /*!\brief nombre maximum de lumières de la scène */
+#  define LIGHTS_MAX 8
+  /*!\brief nombre maximum de niveaux de détail d'une surface */
+#  define LOD_MAX 4
+  /*!\brief marge relative autour des seuils de changement de niveau
+   * de détail, pour qu'un objet à la limite ne bascule pas d'une
+   * frame à l'autre */
+#  define LOD_HYSTERESIS 0.15f
+  /*!\brief rayon projeté (pixels) sous lequel les sphères du jeu
+   * sont dessinées en imposteur (voir set_sphere_impostor) */
+#  define SPHERE_IMPOSTOR_PX 32.0f
+  /*!\brief nombre de bits de la partie fractionnaire des positions à
+   * l'écran (virgule fixe 28.4) */
+#  define SUBPIXEL_BITS 4
+#  define SUBPIXEL (1 << SUBPIXEL_BITS)
 
   /*!\brief états pour les sommets ou les triangles */
   enum pstate_t {
@@ -66,11 +102,68 @@ extern "C" {
 		   SO_USE_LIGHTING = 16, /* active le calcul d'ombre
 					    propre (Gouraud sur
 					    diffus) */
+		   SO_USE_PHONG = 32, /* calcule l'éclairage par pixel
+					 (diffus et spéculaire) à partir
+					 des normales interpolées
+					 (nécessite SO_USE_LIGHTING) */
 		   SO_DEFAULT = SO_CULL_BACKFACES | SO_USE_COLOR /* comportement
 								    par
 								    défaut */
   };
 
+  /*!\brief options de chargement des maillages OBJ (voir load_OBJ) */
+  enum objflags_t {
+		   OBJ_NONE = 0,
+		   OBJ_OPTIMIZE = 1, /* réordonne les triangles pour la
+					localité des sommets et
+					l'overdraw (voir obj.c) */
+		   OBJ_COMPACT = 2 /* produit directement une surface
+				      compacte (voir compact_surface),
+				      sans passer par les triangle_t */
+  };
+
+  /*!\brief types de lumières */
+  enum ltype_t {
+		LT_POINT = 0, /* lumière positionnelle (atténuation
+				 non gérée) */
+		LT_DIRECTIONAL, /* lumière à l'infini, seule sa
+				   direction compte */
+		LT_AMBIENT /* lumière ambiante, sans direction */
+  };
+
+  /*!\brief étapes du pipeline chronométrées par le profiler */
+  enum pstage_t {
+		 PROF_STRANSFORM = 0,
+		 PROF_CLIP,
+		 PROF_FILL,
+		 PROF_ABSCISSES,
+		 PROF_HLINE,
+		 PROF_SHADING,
+		 PROF_NSTAGES
+  };
+
+  /*!\brief compteurs du profiler */
+  enum pcounter_t {
+		   PROF_TRI_SUBMITTED = 0, /* triangles soumis */
+		   PROF_TRI_CULLED, /* rejetés en backface */
+		   PROF_TRI_OUT, /* rejetés car hors-champ */
+		   PROF_TRI_CLIPPED, /* partiellement hors-champ */
+		   PROF_TRI_RASTERIZED, /* rastérisés */
+		   PROF_TRI_DEGENERATE, /* rejetés car d'aire nulle à
+					   l'écran */
+		   PROF_TRI_TINY, /* rastérisés par le chemin des petits
+				     triangles */
+		   PROF_TRI_TILED, /* rastérisés par tuiles */
+		   PROF_PIX_TESTED, /* fragments soumis au z-test */
+		   PROF_PIX_PASSED, /* fragments ayant passé le z-test */
+		   PROF_PIX_SHADED, /* fragments coloriés */
+		   PROF_PIX_COVERED, /* pixels écrits au moins une fois
+					dans la frame */
+		   PROF_PIX_SKIPPED, /* fragments écartés sans z-test par
+					le S-buffer */
+		   PROF_NCOUNTERS
+  };
+
   struct vec4 {
     float x /* r */, y/* g */, z /* b */, w /* a */;
   };
@@ -95,9 +188,14 @@ extern "C" {
 		      l'interpolation par rapport à une projection en
 		      perspective */
     float z;       /* ce z représente la depth */
+    vec3 normal;   /* normale (repère objet), interpolée en Phong */
+    vec3 opos;     /* position dans le repère objet, interpolée en
+		      Phong */
     /* fin des données à partir desquelles on peut interpoler */
-    vec3 normal; /* interpolez les normales si vous implémentez Phong */
     int x, y;
+    int fx, fy;    /* position à l'écran en virgule fixe (SUBPIXEL_BITS
+		      bits après la virgule), le centre du pixel (x, y)
+		      étant en ((x << SUBPIXEL_BITS) + SUBPIXEL / 2, ...) */
     enum pstate_t state;
   };
 
@@ -108,6 +206,77 @@ extern "C" {
     enum pstate_t state;
   };
 
+  /*!\brief un sommet compact (voir compact_surface), 18 octets au
+   * lieu de sizeof(vertex_t) : sans aucun champ de travail, il ne
+   * garde que ce que vtransform lit d'un sommet */
+  struct cvertex_t {
+    short position[3];          /* quantifiée sur le réseau de la
+				   surface (qoffset, qscale) */
+    unsigned short texCoord[2]; /* demi-flottants (binary16) */
+    short normal[2];            /* projection octaédrique, SNORM16 */
+    GLubyte color[4];           /* couleur RGBA, UNORM8 */
+  };
+
+  /*!\brief une lumière de la scène ; sa position (ou sa direction
+   * pointant vers la lumière) est exprimée dans le repère de la caméra
+   * (eye space). */
+  struct light_t {
+    ltype_t type;
+    vec4 position; /* position si LT_POINT, direction vers la lumière
+		      si LT_DIRECTIONAL, ignorée si LT_AMBIENT */
+    float intensity;
+  };
+
+  /*!\brief les lumières de la scène ramenées dans le repère objet
+   * d'une surface. Ce précalcul est fait une fois par dessin (dans
+   * \ref stransform) afin que le calcul par sommet se limite à des
+   * produits scalaires. */
+  struct olights_t {
+    int np, nd;         /* nombre de lumières positionnelles et
+			   directionnelles */
+    float ambient;      /* somme des intensités ambiantes */
+    vec4 p[LIGHTS_MAX]; /* positions dans le repère objet, w reçoit
+			   l'intensité */
+    vec4 d[LIGHTS_MAX]; /* directions normalisées dans le repère
+			   objet, w reçoit l'intensité */
+    vec4 eye;           /* position de la caméra dans le repère
+			   objet, pour le spéculaire */
+  };
+
+  /*!\brief statistiques d'une frame (ou cumulées) du profiler */
+  struct prof_frame_t {
+    unsigned long long ticks[PROF_NSTAGES];
+    unsigned long long counters[PROF_NCOUNTERS];
+    unsigned long long frame_ticks;
+    double frame_ms;
+  };
+
+  /*!\brief formats de stockage des texels */
+  enum tformat_t {
+    TF_RGBA = 0, /* un GLuint (RGBA) par texel */
+    TF_BC1       /* blocs de 4x4 texels compressés sur deux GLuint
+		    (BC1/DXT1, voir atlas_compress) */
+  };
+
+  /*!\brief une texture : le sous-rectangle (\a x, \a y, \a w x \a h)
+   * d'une image de \a stride texels de large, par exemple une entrée
+   * d'un atlas (voir atlas.c). Les coordonnées de texture [0, 1]
+   * couvrent le sous-rectangle et se répètent à l'intérieur. */
+  struct texture_t {
+    const GLuint * pixels;
+    int stride, x, y, w, h;
+    tformat_t format;
+  };
+
+  /*!\brief un atlas : des textures rangées dans une seule image, aux
+   * dimensions multiples de 4 */
+  struct atlas_t {
+    GLuint * pixels;
+    int w, h, n;
+    tformat_t format;
+    texture_t * tex; /* la texture de chaque image rangée */
+  };
+
   /*!\brief la surface englobe plusieurs triangles et des options
    * telles que le type de rendu, la couleur diffuse ou la texture.
    */
@@ -115,23 +284,68 @@ extern "C" {
     int n;
     triangle_t * t;
     GLuint tex_id;
-    vec4 dcolor; /* couleur diffuse, ajoutez une couleur ambiante et
-		    spéculaire si vous souhaitez compléter le
-		    modèle */
+    texture_t tex; /* texture propre à la surface (voir
+		      set_texture_handle) ; si tex.pixels est nul, la
+		      texture courante (set_texture) est utilisée */
+    vec4 dcolor; /* couleur diffuse */
+    vec4 scolor; /* couleur spéculaire (utilisée en Phong) */
+    float shininess; /* brillance, exposant du spéculaire */
     soptions_t options; /* paramétrage du rendu de la surface */
+    olights_t lights; /* lumières dans le repère objet, mises à jour
+			 à chaque stransform */
     void (*interpolatefunc)(vertex_t *, vertex_t *, vertex_t *, float, float);
     void (*shadingfunc)(surface_t *, GLuint *, vertex_t *);
+    /* niveaux de détail (voir add_surface_lod) : t et n désignent
+       celui choisi au dernier dessin */
+    int nlod;                  /* 0 : un seul maillage, t */
+    triangle_t * lodt[LOD_MAX];/* triangles de chaque niveau, du plus
+				  fin au plus grossier */
+    int lodn[LOD_MAX];
+    float lodpx[LOD_MAX];      /* rayon projeté (pixels) sous lequel
+				  le niveau est utilisé */
+    float radius;              /* rayon englobant dans le repère objet */
+    int lod;                   /* niveau courant (hystérésis) */
+    int * ilod, nilod;         /* niveaux courants des instances */
+    float impostorpx;          /* rayon projeté (pixels) sous lequel
+				  la sphère est dessinée en imposteur
+				  (0 : jamais, voir set_sphere_impostor) */
+    cvertex_t * cv;            /* si non NULL, la surface est compacte
+				  (voir compact_surface) : ses sommets,
+				  trois par triangle, t ne désignant plus,
+				  le temps d'un dessin, que le lot de
+				  triangles décompressés en cours */
+    cvertex_t * lodcv[LOD_MAX];/* sommets compacts de chaque niveau */
+    float qoffset[3], qscale[3]; /* position = qoffset + q x qscale */
   };
   
   /* dans rasterize.c */
-  extern void transform_n_rasterize(surface_t * s, float * model_view_matrix, float * projection_matrix);
+  extern int  transform_n_rasterize(surface_t * s, float * model_view_matrix, float * projection_matrix);
+  extern int  transform_n_rasterize_surfaces(surface_t ** s, int n, float * model_view_matrix, float * projection_matrix);
+  extern int  transform_n_rasterize_instances(surface_t * s, float * view_matrix, float * model_matrix, float * projection_matrix, const float * xyz, int n);
+  extern int box_in_frustum(float * model_view_matrix, float * projection_matrix, const float * bmin, const float * bmax);
+  extern int box_screen_rect(float * model_view_matrix, float * projection_matrix, const float * bmin, const float * bmax, int * rect);
   extern void clear_depth_map(void);
+  extern void clear_color_map(GLuint color);
+  extern void set_scissor(int x0, int y0, int x1, int y1);
+  extern void reset_scissor(void);
+  extern void free_depth_map(void);
+  extern dlist_t * dlist_new(void);
+  extern void dlist_free(dlist_t * l);
+  extern void dlist_record(dlist_t * l, int w, int h);
+  extern void dlist_play(dlist_t * l, GLuint * pixels, int w, int h);
+  extern void set_visibility_buffer(int on);
+  extern void set_span_buffer(int on);
+  extern void set_affine_span(int n);
   extern void set_texture(GLuint screen);
+  extern void set_texture_pixels(GLuint * pixels, GLuint w, GLuint h);
+  extern void set_render_target(GLuint * pixels, int w, int h);
   extern void updatesfuncs(surface_t * s);
 
   /* dans vtranform.c */
-  extern vertex_t vtransform(surface_t * s, vertex_t v, float * model_view_matrix, float * ti_model_view_matrix, float * projection_matrix, float * viewport);
+  extern vertex_t vtransform(surface_t * s, vertex_t v, float * model_view_matrix, float * projection_matrix, float * viewport);
+  extern void     cvertex_decode(const surface_t * s, const cvertex_t * c, vertex_t * v);
   extern void     stransform(surface_t * s, float * model_view_matrix, float * projection_matrix, float * viewport);
+  extern void     stransform_vertices(surface_t * s, float * model_view_matrix, float * projection_matrix, float * viewport);
   extern void     mult_matrix(float * res, float * m);
   extern void     translate(float * m, float tx, float ty, float tz);
   extern void     rotate(float * m, float angle, float x, float y, float z);
@@ -144,16 +358,104 @@ extern "C" {
   extern void        tnormals2vertices(surface_t * s);
   extern void        set_texture_id(surface_t * s, GLuint tex_id);
   extern void        set_diffuse_color(surface_t * s, vec4 dcolor);
+  extern void        set_specular(surface_t * s, vec4 scolor, float shininess);
   extern void        enable_surface_option(surface_t * s, soptions_t option);
   extern void        disable_surface_option(surface_t * s, soptions_t option);
   extern surface_t * new_surface(triangle_t * t, int n, int duplicateTriangles, int hasNormals);
   extern void        free_surface(surface_t * s);
+  extern void        add_surface_lod(surface_t * s, triangle_t * t, int n, float below_px);
+  extern void        set_sphere_impostor(surface_t * s, float below_px);
+  extern void        compact_surface(surface_t * s);
+  extern void        compact_surface_lattice(surface_t * s, const float * offset, float scale);
+  extern void        set_compact_bounds(surface_t * s, const float * lo, const float * hi);
+  extern void        cvertex_encode(const surface_t * s, const vertex_t * v, cvertex_t * o);
   extern GLuint      get_texture_from_BMP(const char * filename);
+  extern void        get_textures_from_BMP(const char ** filenames, GLuint * ids, int n);
+  extern void        set_texture_handle(surface_t * s, texture_t t);
+  extern atlas_t *   atlas_from_BMP(const char ** filenames, int n);
+  extern int         add_light(light_t l);
+  extern void        set_light(int i, light_t l);
+  extern void        clear_lights(void);
+  extern int         get_nlights(void);
+  extern void        lights_to_object_space(olights_t * ol, float * inv_model_view_matrix);
+
+  /* dans atlas.c */
+  extern atlas_t *   atlas_new(const GLuint * const * images, const int * w, const int * h, int n);
+  extern texture_t   atlas_texture(const atlas_t * a, int i);
+  extern void        atlas_free(atlas_t * a);
+  extern void        atlas_compress(atlas_t * a);
+  extern void        bc1_palette(GLuint c01, GLuint * pal);
+
+  /* dans pipeline.c */
+  extern void        pipeline_init(void);
+  extern void        pipeline_quit(void);
+  extern void        pipeline_begin(int w, int h);
+  extern void        pipeline_end(void);
+  extern int         pipeline_present(GLuint * pixels, int latency);
+
+  /* dans jobs.c */
+  extern void        jobs_init(int n);
+  extern void        jobs_quit(void);
+  extern int         jobs_threads(void);
+  extern job_t *     job_new(void (*fn)(void *), void * arg);
+  extern void        job_after(job_t * j, job_t * dep);
+  extern void        job_submit(job_t * j);
+  extern void        job_wait(job_t * j);
+  extern void        job_release(job_t * j);
+  extern void        jobs_parallel_for(int n, int grain, void (*fn)(void *, int, int), void * arg);
+
+  /* dans profiler.c */
+  extern unsigned long long prof_ticks(void);
+  extern void               prof_frame_end(void);
+  extern void               prof_dump(FILE * f);
+  extern void               prof_get(prof_frame_t * f);
+  extern void               prof_set_dump_interval(int n);
+
+  /* macros d'instrumentation, vides si RASTERIZE_PROFILE n'est pas
+   * défini */
+#  ifdef RASTERIZE_PROFILE
+  /*!\brief les temps et les compteurs d'un thread, qu'il est seul à
+   * écrire ; prof_frame_end les lit sans les remettre à zéro (voir
+   * profiler.c) */
+  typedef struct prof_thread_t prof_thread_t;
+  struct prof_thread_t {
+    unsigned long long ticks[PROF_NSTAGES];
+    unsigned long long counters[PROF_NCOUNTERS];
+    /* valeurs lues au dernier prof_frame_end, par lui seul */
+    unsigned long long seen_ticks[PROF_NSTAGES];
+    unsigned long long seen_counters[PROF_NCOUNTERS];
+    prof_thread_t * next;
+  };
+  extern THREAD_LOCAL prof_thread_t * _prof_self;
+  extern prof_thread_t *              prof_thread(void);
+  /* lecture et écriture atomiques (sans ordre) d'un compteur : un
+   * seul thread l'écrit, prof_frame_end le lit pendant ce temps */
+#    if defined(_MSC_VER)
+#      define PROF_LOAD(p)     (*(volatile unsigned long long *)(p))
+#      define PROF_STORE(p, v) (*(volatile unsigned long long *)(p) = (v))
+#    else
+#      define PROF_LOAD(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#      define PROF_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#    endif
+#    define PROF_SELF()      (_prof_self ? _prof_self : prof_thread())
+#    define PROF_ADD(p, n)   do { unsigned long long * _prof_p = (p); PROF_STORE(_prof_p, PROF_LOAD(_prof_p) + (n)); } while(0)
+#    define PROF_BEGIN(st)   unsigned long long _prof_t0_##st = prof_ticks()
+#    define PROF_END(st)     PROF_ADD(&(PROF_SELF()->ticks[st]), prof_ticks() - _prof_t0_##st)
+#    define PROF_COUNT(c, n) PROF_ADD(&(PROF_SELF()->counters[c]), (n))
+#  else
+#    define PROF_BEGIN(st)   ((void)0)
+#    define PROF_END(st)     ((void)0)
+#    define PROF_COUNT(c, n) ((void)0)
+#  endif
+
+  /* dans obj.c */
+  extern surface_t * load_OBJ(const char * filename, int flags, float * bmin, float * bmax);
 
   /* dans geometry.c */
   extern surface_t * mk_quad(void);  
   extern surface_t * mk_cube(void);
   extern surface_t * mk_sphere(int longitudes, int latitudes);
+  extern surface_t * mk_sphere_lod(int longitudes, int latitudes);
 #  ifdef __cplusplus
 }
 #  endif
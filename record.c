@@ -0,0 +1,136 @@
+/*!\file record.c
+ *
+ * \brief enregistrement et relecture des parties.
+ *
+ * La simulation étant à pas fixe et déterministe, une partie est
+ * entièrement décrite par le niveau, le pas de temps, le nombre de
+ * balles supplémentaires de départ et la liste des entrées datées en
+ * numéro de pas. Le format est textuel, une information par ligne :
+ *
+ * \verbatim
+ # commentaire
+ version 1
+ level levels/grand.lvl
+ dt 0.00833333
+ balls 0
+ steps 3600
+ 120 launch
+ 600 multiball
+ \endverbatim
+ *
+ * "steps" est le nombre total de pas de la partie ; une ligne "<pas>
+ * <entrée>" applique l'entrée juste avant le pas numéro <pas> (le
+ * premier pas est le numéro 1). Les entrées sont left, right, launch
+ * et multiball. La ligne "level" (le chemin du niveau binaire,
+ * relatif au répertoire courant, jusqu'à la fin de la ligne : il peut
+ * contenir des espaces) est absente pour le niveau d'origine.
+ *
+ * \author VILFEU Vincent
+ */
+#include "game.h"
+#include <assert.h>
+#include <stdio.h>
+
+/*!\brief noms des entrées, dans l'ordre de ginput_t */
+static const char * _inames[] = { "left", "right", "launch", "multiball" };
+
+/*!\brief renvoie le nom de l'entrée \a in */
+const char * ginput_name(ginput_t in) {
+  assert(in >= GI_LEFT && in <= GI_MULTIBALL);
+  return _inames[in];
+}
+
+/*!\brief renvoie l'entrée de nom \a name, -1 si elle n'existe pas */
+int ginput_from_name(const char * name) {
+  int i;
+  for(i = 0; i < (int)(sizeof _inames / sizeof *_inames); ++i)
+    if(!strcmp(name, _inames[i]))
+      return i;
+  return -1;
+}
+
+/*!\brief initialise un enregistrement vide */
+void replay_init(replay_t * r, float dt, int nballs) {
+  memset(r, 0, sizeof *r);
+  r->dt = dt;
+  r->nballs = nballs;
+}
+
+/*!\brief ajoute l'entrée \a in au pas \a step (les pas doivent être
+ * croissants) */
+void replay_push(replay_t * r, unsigned long step, ginput_t in) {
+  if(r->n == r->cap) {
+    r->cap = r->cap ? 2 * r->cap : 64;
+    r->ev = realloc(r->ev, r->cap * sizeof *r->ev);
+    assert(r->ev);
+  }
+  assert(!r->n || r->ev[r->n - 1].step <= step);
+  r->ev[r->n].step = step;
+  r->ev[r->n++].in = in;
+}
+
+/*!\brief libère les entrées de \a r */
+void replay_free(replay_t * r) {
+  free(r->ev);
+  memset(r, 0, sizeof *r);
+}
+
+/*!\brief écrit \a r dans le fichier \a filename ; renvoie 0 en cas
+ * d'échec */
+int replay_save(const replay_t * r, const char * filename) {
+  int i;
+  FILE * f = fopen(filename, "w");
+  if(!f) {
+    perror(filename);
+    return 0;
+  }
+  fprintf(f, "# rejeu du casse-briques (voir record.c)\nversion 1\n");
+  if(r->level[0])
+    fprintf(f, "level %s\n", r->level);
+  fprintf(f, "dt %.9g\nballs %d\nsteps %lu\n", r->dt, r->nballs, r->nsteps);
+  for(i = 0; i < r->n; ++i)
+    fprintf(f, "%lu %s\n", r->ev[i].step, ginput_name(r->ev[i].in));
+  fclose(f);
+  return 1;
+}
+
+/*!\brief lit le fichier \a filename dans \a r ; renvoie 0 (et un
+ * message sur la sortie d'erreur) si le fichier est illisible ou
+ * mal formé */
+int replay_load(replay_t * r, const char * filename) {
+  char line[256], word[64];
+  unsigned long step;
+  int ln = 0, version = 0, in;
+  FILE * f = fopen(filename, "r");
+  if(!f) {
+    perror(filename);
+    return 0;
+  }
+  replay_init(r, (float)GAME_DT, 0);
+  while(fgets(line, sizeof line, f)) {
+    ++ln;
+    if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    if(sscanf(line, "version %d", &version) == 1 || sscanf(line, "level %255[^\r\n]", r->level) == 1 || sscanf(line, "dt %f", &r->dt) == 1 ||
+       sscanf(line, "balls %d", &r->nballs) == 1 || sscanf(line, "steps %lu", &r->nsteps) == 1)
+      continue;
+    if(sscanf(line, "%lu %63s", &step, word) == 2 && (in = ginput_from_name(word)) >= 0 &&
+       (!r->n || r->ev[r->n - 1].step <= step)) {
+      replay_push(r, step, (ginput_t)in);
+      continue;
+    }
+    fprintf(stderr, "%s:%d : ligne invalide : %s", filename, ln, line);
+    fclose(f);
+    replay_free(r);
+    return 0;
+  }
+  fclose(f);
+  if(version != 1 || r->dt <= 0.0f) {
+    fprintf(stderr, "%s : version ou pas de temps invalide\n", filename);
+    replay_free(r);
+    return 0;
+  }
+  if(r->n && r->nsteps < r->ev[r->n - 1].step)
+    r->nsteps = r->ev[r->n - 1].step;
+  return 1;
+}
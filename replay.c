@@ -0,0 +1,130 @@
+/*!\file replay.c
+ *
+ * \brief rejoue sans fenêtre, aussi vite que possible, des parties
+ * enregistrées (voir record.c et l'option --record de rasterizer).
+ *
+ * Pour chaque fichier, le débit de la simulation seule (pas par
+ * seconde) et l'état final, dont une empreinte qui doit rester la
+ * même d'une exécution à l'autre, sont écrits au format JSON Lines.
+ * Des frames choisies peuvent être rendues en PPM ; leur rendu n'est
+ * pas compté dans le débit.
+ *
+ * Usage : rasterizer_replay [-n pas] [-F pas]... [-r WxH] [-j threads] [-o répertoire] fichier...
+ * -n fixe le nombre de pas joués (par défaut celui du fichier), -F
+ * rend l'état atteint après le pas donné, -j fixe le nombre de threads
+ * de l'ordonnanceur de tâches (voir jobs.c) : 1 par défaut, 0 pour un
+ * par cœur ; l'empreinte n'en dépend pas.
+ *
+ * \author VILFEU Vincent
+ */
+
+#include "scenes.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*!\brief nombre maximum de frames rendues */
+#define MAX_FRAMES 64
+
+/*!\brief tri des numéros de pas à rendre */
+static int cmp_ulong(const void * a, const void * b) {
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*!\brief affiche l'usage et quitte */
+static void usage(const char * prog) {
+  fprintf(stderr, "usage : %s [-n pas] [-F pas]... [-r WxH] [-j threads] [-o répertoire] fichier...\n", prog);
+  exit(1);
+}
+
+/*!\brief rejoue le fichier \a filename et écrit le résultat dans \a
+ * out ; renvoie 0 en cas d'échec */
+static int replay(FILE * out, const char * filename, unsigned long nsteps, const unsigned long * frames, int nframes,
+		  int w, int h, const char * odir) {
+  replay_t r;
+  game_state_t s;
+  GLuint * pixels = NULL;
+  Uint64 ticks = 0, t0;
+  unsigned long done = 0, k;
+  int cursor = 0, f = 0, nb;
+  char name[512];
+  if(!replay_load(&r, filename))
+    return 0;
+  if(!nsteps)
+    nsteps = r.nsteps;
+  if(nframes) {
+    pixels = malloc(w * h * sizeof *pixels);
+    assert(pixels);
+  }
+  if(!game_init(r.level, 0, r.nballs)) {
+    replay_free(&r);
+    free(pixels);
+    return 0;
+  }
+  while(done < nsteps) {
+    /* jusqu'à la prochaine frame à rendre, ou la fin */
+    while(f < nframes && frames[f] <= done)
+      ++f;
+    k = (f < nframes ? MIN(frames[f], nsteps) : nsteps) - done;
+    t0 = SDL_GetPerformanceCounter();
+    game_steps(k, r.dt, &r, &cursor);
+    ticks += SDL_GetPerformanceCounter() - t0;
+    done += k;
+    if(f < nframes && frames[f] == done) {
+      const float * xyz;
+      game_get_state(&s);
+      xyz = game_balls(&nb);
+      scene_draw_game(&s, game_board(), xyz, nb, pixels, w, h);
+      snprintf(name, sizeof name, "%s/replay_%06lu.ppm", odir, done);
+      write_ppm(name, pixels, w, h);
+    }
+  }
+  game_get_state(&s);
+  game_balls(&nb);
+  {
+    double sec = ticks / (double)SDL_GetPerformanceFrequency();
+    fprintf(out, "{\"replay\": \"%s\", \"steps\": %lu, \"seconds\": %.4f, \"steps_per_s\": %.0f, "
+	    "\"bricks\": %d, \"balls\": %d, \"checksum\": \"%08x\"}\n",
+	    filename, nsteps, sec, sec > 0.0 ? nsteps / sec : 0.0, s.bricks, nb, game_checksum());
+  }
+  fflush(out);
+  game_quit();
+  replay_free(&r);
+  free(pixels);
+  return 1;
+}
+
+int main(int argc, char ** argv) {
+  int i, w = 640, h = 480, nframes = 0, failures = 0, nthreads = 1;
+  unsigned long nsteps = 0, frames[MAX_FRAMES];
+  const char * odir = ".";
+  for(i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    if(!strcmp(argv[i], "-n") && i + 1 < argc)
+      nsteps = strtoul(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "-F") && i + 1 < argc && nframes < MAX_FRAMES)
+      frames[nframes++] = strtoul(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "-r") && i + 1 < argc) {
+      if(sscanf(argv[++i], "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)
+	usage(argv[0]);
+    } else if(!strcmp(argv[i], "-j") && i + 1 < argc) {
+      if((nthreads = atoi(argv[++i])) < 0)
+	usage(argv[0]);
+    } else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+      odir = argv[++i];
+    else
+      usage(argv[0]);
+  }
+  if(i == argc)
+    usage(argv[0]);
+  qsort(frames, nframes, sizeof *frames, cmp_ulong);
+  jobs_init(nthreads);
+  if(nframes)
+    scenes_init();
+  for(; i < argc; ++i)
+    failures += !replay(stdout, argv[i], nsteps, frames, nframes, w, h, odir);
+  if(nframes)
+    scenes_quit();
+  jobs_quit();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,424 @@
+/*!\file scenes.c
+ *
+ * \brief scènes fixes et déterministes rendues sans fenêtre (donc
+ * sans screen GL4Dummies) : la cible du rendu est donnée par
+ * set_render_target et les textures sont générées ici plutôt que
+ * lues depuis images/. Une scène ne dépend que du numéro de frame,
+ * deux rendus de la même frame donnent la même image.
+ *
+ * \author Farès BELHADJ, amsi@up8.edu
+ * \date November 2021.
+*/
+
+#include "scenes.h"
+#include <assert.h>
+
+/*!\brief noms des scènes, dans l'ordre de scene_id_t */
+static const char * _names[SCENE_COUNT] = { "board", "spheres", "near_quads", "overdraw", "balls", "model" };
+
+/*!\brief copie du plateau de départ du jeu (game.c), fermé en bas */
+static const unsigned char _plateau[] = {
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+  1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+  1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+  1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+  1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+  1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+  1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+};
+static const int _W = 15, _H = 18;
+
+/*!\brief taille des textures générées */
+#define TEXW 64
+#define TEXH 64
+
+/*!\brief textures générées : murs (damier), briques et balle
+ * (bandes) */
+static GLuint _tex_wall[TEXW * TEXH], _tex_brick[TEXW * TEXH], _tex_ball[TEXW * TEXH];
+/*!\brief l'atlas qui range ces textures, et leurs indices dans
+ * l'atlas */
+static atlas_t * _atlas = NULL;
+enum { TEX_WALL, TEX_BRICK, TEX_BALL };
+
+static surface_t * _wall = NULL, * _brick = NULL, * _balle = NULL, * _raquette = NULL;
+static surface_t * _sphere = NULL, * _quad = NULL, * _mballe = NULL;
+/*!\brief le plateau de la scène SCENE_BOARD, et les chunks de rendu
+ * de ce plateau et de celui de scene_draw_game */
+static board_t _board;
+static bmesh_t _bmesh, _gmesh;
+
+/*!\brief le maillage de la scène SCENE_MODEL (voir
+ * scenes_load_model), le centre de sa boîte englobante et la
+ * demi-diagonale de celle-ci */
+static surface_t * _model = NULL;
+static float _model_center[3], _model_radius;
+
+/*!\brief nombre de balles de la scène SCENE_BALLS */
+#define NBALLS 2048
+/*!\brief positions des balles de la scène SCENE_BALLS */
+static float _balls_xyz[3 * NBALLS];
+
+/*!\brief génère les textures de \ref _tex_wall, \ref _tex_brick et
+ * \ref _tex_ball */
+static void mk_textures(void) {
+  int x, y;
+  for(y = 0; y < TEXH; ++y)
+    for(x = 0; x < TEXW; ++x) {
+      int c = ((x >> 3) ^ (y >> 3)) & 1, joint = (y % 16) == 0 || ((x + ((y / 16) & 1) * 16) % 32) == 0;
+      _tex_wall[y * TEXW + x] = c ? RGBA(180, 180, 180, 255) : RGBA(90, 90, 90, 255);
+      _tex_brick[y * TEXW + x] = joint ? RGBA(200, 200, 190, 255) : RGBA(170 + (x * 7 + y * 13) % 40, 80, 50, 255);
+      _tex_ball[y * TEXW + x] = (x / 8) & 1 ? RGBA(255, 255, 255, 255) : RGBA(60, 200, 60, 255);
+    }
+}
+
+/*!\brief fabrique les surfaces et textures des scènes */
+void scenes_init(void) {
+  vec4 gris = { 1, 1, 1, 1 }, r = { 1, 0, 0, 1 }, g = { 0, 1, 0, 1 };
+  light_t lp = { LT_POINT, { 0.0f, 0.0f, 1.0f, 1.0f }, 0.8f }, la = { LT_AMBIENT, { 0.0f, 0.0f, 0.0f, 0.0f }, 0.2f };
+  /* un éclairage fixe, indépendant de celui du jeu */
+  clear_lights();
+  add_light(lp);
+  add_light(la);
+  mk_textures();
+  {
+    const GLuint * images[] = { _tex_wall, _tex_brick, _tex_ball };
+    int w[] = { TEXW, TEXW, TEXW }, h[] = { TEXH, TEXH, TEXH };
+    _atlas = atlas_new(images, w, h, 3);
+  }
+  _wall = mk_cube();
+  _brick = mk_cube();
+  _raquette = mk_cube();
+  _balle = mk_sphere_lod(12, 12);
+  _sphere = mk_sphere_lod(24, 24);
+  _quad = mk_quad();
+  _mballe = mk_sphere_lod(6, 6);
+  _mballe->dcolor = g;
+  set_sphere_impostor(_balle, SPHERE_IMPOSTOR_PX);
+  set_sphere_impostor(_sphere, SPHERE_IMPOSTOR_PX);
+  set_sphere_impostor(_mballe, SPHERE_IMPOSTOR_PX);
+  _wall->dcolor = _brick->dcolor = _sphere->dcolor = _quad->dcolor = gris;
+  _raquette->dcolor = r;
+  _balle->dcolor = g;
+  enable_surface_option(_wall, SO_USE_TEXTURE);
+  enable_surface_option(_brick, SO_USE_TEXTURE);
+  enable_surface_option(_raquette, SO_USE_TEXTURE);
+  enable_surface_option(_balle, SO_USE_TEXTURE);
+  enable_surface_option(_sphere, SO_USE_TEXTURE);
+  enable_surface_option(_quad, SO_USE_TEXTURE);
+  enable_surface_option(_wall, SO_USE_LIGHTING);
+  enable_surface_option(_brick, SO_USE_LIGHTING);
+  enable_surface_option(_raquette, SO_USE_LIGHTING);
+  enable_surface_option(_balle, SO_USE_LIGHTING);
+  enable_surface_option(_balle, SO_USE_PHONG);
+  enable_surface_option(_sphere, SO_USE_LIGHTING);
+  enable_surface_option(_quad, SO_USE_LIGHTING);
+  enable_surface_option(_mballe, SO_USE_TEXTURE);
+  enable_surface_option(_mballe, SO_USE_LIGHTING);
+  set_texture_handle(_wall, atlas_texture(_atlas, TEX_WALL));
+  set_texture_handle(_brick, atlas_texture(_atlas, TEX_BRICK));
+  set_texture_handle(_mballe, atlas_texture(_atlas, TEX_BALL));
+  /* les quadrilatères sont vus des deux côtés */
+  disable_surface_option(_quad, SO_CULL_BACKFACES);
+  board_init(&_board, _W, _H, _plateau);
+  bmesh_init(&_bmesh);
+  bmesh_init(&_gmesh);
+}
+
+/*!\brief libère les surfaces des scènes */
+void scenes_quit(void) {
+  surface_t ** s[] = { &_wall, &_brick, &_balle, &_raquette, &_sphere, &_quad, &_mballe, &_model };
+  int i;
+  for(i = 0; i < (int)(sizeof s / sizeof *s); ++i)
+    if(*s[i]) {
+      free_surface(*s[i]);
+      *s[i] = NULL;
+    }
+  board_free(&_board);
+  bmesh_free(&_bmesh);
+  bmesh_free(&_gmesh);
+  atlas_free(_atlas);
+  _atlas = NULL;
+}
+
+/*!\brief compresse en BC1 l'atlas des textures des scènes (voir
+ * atlas_compress) */
+void scenes_compress_textures(void) {
+  atlas_compress(_atlas);
+  set_texture_handle(_wall, atlas_texture(_atlas, TEX_WALL));
+  set_texture_handle(_brick, atlas_texture(_atlas, TEX_BRICK));
+  set_texture_handle(_mballe, atlas_texture(_atlas, TEX_BALL));
+}
+
+/*!\brief rend compactes (voir compact_surface) les surfaces dessinées
+ * par les scènes et les maillages des chunks du plateau */
+void scenes_compact_meshes(void) {
+  surface_t * s[] = { _balle, _raquette, _sphere, _quad, _mballe };
+  int i;
+  for(i = 0; i < (int)(sizeof s / sizeof *s); ++i)
+    compact_surface(s[i]);
+  if(_model && !_model->cv)
+    compact_surface(_model);
+  _bmesh.compact = _gmesh.compact = 1;
+}
+
+/*!\brief charge le maillage de la scène SCENE_MODEL du fichier OBJ
+ * \a filename, avec les options \a flags de load_OBJ ; renvoie son
+ * nombre de triangles, 0 (et un message sur la sortie d'erreur) en
+ * cas d'échec */
+int scenes_load_model(const char * filename, int flags) {
+  vec4 gris = { 1, 1, 1, 1 };
+  float bmin[3], bmax[3];
+  int c;
+  surface_t * s = load_OBJ(filename, flags, bmin, bmax);
+  if(!s)
+    return 0;
+  if(_model)
+    free_surface(_model);
+  _model = s;
+  _model_radius = 0.0f;
+  for(c = 0; c < 3; ++c) {
+    _model_center[c] = 0.5f * (bmin[c] + bmax[c]);
+    _model_radius += 0.25f * (bmax[c] - bmin[c]) * (bmax[c] - bmin[c]);
+  }
+  _model_radius = sqrtf(_model_radius);
+  _model->dcolor = gris;
+  enable_surface_option(_model, SO_USE_TEXTURE);
+  enable_surface_option(_model, SO_USE_LIGHTING);
+  return _model->n;
+}
+
+/*!\brief renvoie le nom de la scène \a scene */
+const char * scene_name(int scene) {
+  assert(scene >= 0 && scene < SCENE_COUNT);
+  return _names[scene];
+}
+
+/*!\brief renvoie l'identifiant de la scène nommée \a name, -1 si elle
+ * n'existe pas */
+int scene_from_name(const char * name) {
+  int i;
+  for(i = 0; i < SCENE_COUNT; ++i)
+    if(!strcmp(name, _names[i]))
+      return i;
+  return -1;
+}
+
+/*!\brief dessine \a s avec la texture \a tex de l'atlas et la
+ * model-view \a mv ; renvoie le nombre de triangles soumis */
+static int draw(surface_t * s, int tex, float * mv, float * proj) {
+  set_texture_handle(s, atlas_texture(_atlas, tex));
+  return transform_n_rasterize(s, mv, proj);
+}
+
+/*!\brief les murs et les briques du plateau \a b, par les chunks de
+ * \a m (voir boardmesh.c) */
+static int draw_cells(bmesh_t * m, const board_t * b, float * view, float * proj) {
+  int n;
+  bmesh_update(m, b);
+  n = bmesh_draw(m, CELL_WALL, _wall, view, proj);
+  return n + bmesh_draw(m, CELL_BRICK, _brick, view, proj);
+}
+
+/*!\brief le plateau de window.c avec la balle qui tourne au-dessus
+ * de la raquette */
+static int draw_board(int frame, float * view, float * proj) {
+  float nmv[16], a = frame * 0.05f;
+  int i, n = draw_cells(&_bmesh, &_board, view, proj);
+  memcpy(nmv, view, sizeof nmv);
+  translate(nmv, 8.0f * cosf(a), -1.0f, 4.0f + 4.0f * sinf(a));
+  rotate(nmv, frame * 3.0f, 0.0f, 1.0f, 0.0f);
+  n += draw(_balle, TEX_BALL, nmv, proj);
+  for(i = -1; i <= 1; i += 2) {
+    memcpy(nmv, view, sizeof nmv);
+    translate(nmv, 4.0f * sinf(a) + i, 1.0f, 13.0f);
+    n += draw(_raquette, TEX_WALL, nmv, proj);
+  }
+  return n;
+}
+
+/*!\brief une grille de 8x8 sphères de 1152 triangles qui tournent */
+static int draw_spheres(int frame, float * view, float * proj) {
+  float nmv[16];
+  int i, j, n = 0;
+  for(i = 0; i < 8; ++i)
+    for(j = 0; j < 8; ++j) {
+      memcpy(nmv, view, sizeof nmv);
+      translate(nmv, 2.5f * (j - 3.5f), 0.0f, 2.5f * (i - 3.5f));
+      rotate(nmv, frame * 2.0f + 10.0f * (i + j), 0.0f, 1.0f, 0.0f);
+      n += draw(_sphere, TEX_BALL, nmv, proj);
+    }
+  return n;
+}
+
+/*!\brief un sol et deux murs de grands quadrilatères autour d'une
+ * caméra basse : beaucoup de triangles traversent le plan near */
+static int draw_near_quads(int frame, float * view, float * proj) {
+  float nmv[16];
+  int i, j, n = 0;
+  for(i = -5; i < 5; ++i)
+    for(j = -5; j < 5; ++j) {
+      memcpy(nmv, view, sizeof nmv);
+      translate(nmv, 8.0f * j + 4.0f, -1.0f, 8.0f * i + 4.0f);
+      rotate(nmv, -90.0f, 1.0f, 0.0f, 0.0f);
+      scale(nmv, 4.0f, 4.0f, 1.0f);
+      n += draw(_quad, TEX_WALL, nmv, proj);
+    }
+  for(i = -1; i <= 1; i += 2) {
+    memcpy(nmv, view, sizeof nmv);
+    translate(nmv, 3.0f * i, 2.0f, -10.0f);
+    rotate(nmv, 90.0f, 0.0f, 1.0f, 0.0f);
+    scale(nmv, 20.0f, 4.0f, 1.0f);
+    n += draw(_quad, TEX_BRICK, nmv, proj);
+  }
+  return n;
+}
+
+/*!\brief 16 quadrilatères couvrant juste l'écran, du plus loin au
+ * plus proche : chaque pixel est colorié 16 fois */
+static int draw_overdraw(int frame, float * view, float * proj) {
+  float nmv[16], d;
+  int i, n = 0;
+  for(i = 0; i < 16; ++i) {
+    /* à la distance d de la caméra, le frustum fait d / 2 de demi-largeur */
+    d = 5.0f - 0.2f * i;
+    memcpy(nmv, view, sizeof nmv);
+    translate(nmv, 0.05f * d * sinf(frame * 0.1f + i), 0.0f, 1.0f - d);
+    scale(nmv, 0.6f * d, 0.6f * d, 1.0f);
+    n += draw(_quad, i & 1 ? TEX_BRICK : TEX_WALL, nmv, proj);
+  }
+  return n;
+}
+
+/*!\brief NBALLS balles de rayon 0.25 qui tournent sur des
+ * courbes de Lissajous au-dessus du plateau, en un seul appel
+ * \ref transform_n_rasterize_instances */
+static int draw_balls(int frame, float * view, float * proj) {
+  float model[16], t;
+  int i;
+  for(i = 0; i < NBALLS; ++i) {
+    t = frame * 0.02f + i * 0.37f;
+    _balls_xyz[3 * i]     = 13.0f * sinf(t * (1.0f + (i & 7) * 0.13f));
+    _balls_xyz[3 * i + 1] = -1.0f + 0.002f * i;
+    _balls_xyz[3 * i + 2] = -1.0f + 14.0f * cosf(t * 0.7f + (i >> 3) * 0.05f);
+  }
+  MIDENTITY(model);
+  scale(model, 0.25f, 0.25f, 0.25f);
+  return transform_n_rasterize_instances(_mballe, view, model, proj, _balls_xyz, NBALLS);
+}
+
+/*!\brief le maillage de \ref scenes_load_model, ramené dans la
+ * sphère unité, qui tourne sur lui-même */
+static int draw_model(int frame, float * view, float * proj) {
+  float nmv[16], k;
+  assert(_model);
+  k = _model_radius > 0.0f ? 1.0f / _model_radius : 1.0f;
+  memcpy(nmv, view, sizeof nmv);
+  rotate(nmv, frame * 2.0f, 0.0f, 1.0f, 0.0f);
+  scale(nmv, k, k, k);
+  translate(nmv, -_model_center[0], -_model_center[1], -_model_center[2]);
+  return draw(_model, TEX_WALL, nmv, proj);
+}
+
+/*!\brief rend la frame \a frame de la scène \a scene dans \a pixels
+ * (\a w x \a h), après l'avoir effacé ainsi que le buffer de
+ * profondeur. Renvoie le nombre de triangles soumis. */
+int scene_draw(int scene, int frame, GLuint * pixels, int w, int h) {
+  float view[16], proj[16];
+  int n = 0;
+  set_render_target(pixels, w, h);
+  memset(pixels, 0, w * h * sizeof *pixels);
+  clear_depth_map();
+  MFRUSTUM(proj, -0.05f, 0.05f, -0.05f, 0.05f, 0.1f, 1000.0f);
+  MIDENTITY(view);
+  switch(scene) {
+  case SCENE_BOARD:
+    lookAt(view, 0, 30, 25, 0, 0, 0, 0, 0, -1);
+    n = draw_board(frame, view, proj);
+    break;
+  case SCENE_SPHERES:
+    lookAt(view, 0, 18, 14, 0, 0, 0, 0, 1, 0);
+    n = draw_spheres(frame, view, proj);
+    break;
+  case SCENE_NEAR_QUADS:
+    lookAt(view, 0, 0.5f, 0, sinf(frame * 0.02f), 0.3f, -1, 0, 1, 0);
+    n = draw_near_quads(frame, view, proj);
+    break;
+  case SCENE_OVERDRAW:
+    lookAt(view, 0, 0, 1, 0, 0, 0, 0, 1, 0);
+    n = draw_overdraw(frame, view, proj);
+    break;
+  case SCENE_BALLS:
+    lookAt(view, 0, 30, 25, 0, 0, 0, 0, 0, -1);
+    n = draw_balls(frame, view, proj);
+    break;
+  case SCENE_MODEL:
+    lookAt(view, 0, 0.8f, 2.5f, 0, 0, 0, 0, 1, 0);
+    n = draw_model(frame, view, proj);
+    break;
+  default:
+    assert(0);
+  }
+  return n;
+}
+
+/*!\brief rend dans \a pixels (\a w x \a h) l'état de jeu \a s sur
+ * le plateau \a b, avec les \a nb balles supplémentaires \a xyz, vu
+ * comme dans window.c. Renvoie le nombre de triangles soumis. */
+int scene_draw_game(const game_state_t * s, const board_t * b, const float * xyz, int nb, GLuint * pixels, int w, int h) {
+  float view[16], proj[16], nmv[16], model[16], cx = 0.0f, cz = 0.0f;
+  int i, n;
+  set_render_target(pixels, w, h);
+  memset(pixels, 0, w * h * sizeof *pixels);
+  clear_depth_map();
+  MFRUSTUM(proj, -0.05f, 0.05f, -0.05f, 0.05f, 0.1f, 1000.0f);
+  MIDENTITY(view);
+  if(b->w > GAME_VIEW_CELLS || b->h > GAME_VIEW_CELLS) {
+    cx = s->balle.x;
+    cz = s->balle.y;
+  }
+  lookAt(view, cx, 30, cz + 25, cx, 0, cz, 0, 0, -1);
+  n = draw_cells(&_gmesh, b, view, proj);
+  memcpy(nmv, view, sizeof nmv);
+  translate(nmv, s->balle.x, -1.0f, s->balle.y);
+  n += draw(_balle, TEX_BALL, nmv, proj);
+  for(i = -1; i <= 1; i += 2) {
+    memcpy(nmv, view, sizeof nmv);
+    translate(nmv, s->raquette.x + i, 1.0f, s->raquette.y);
+    n += draw(_raquette, TEX_WALL, nmv, proj);
+  }
+  MIDENTITY(model);
+  scale(model, GAME_MBALL_R, GAME_MBALL_R, GAME_MBALL_R);
+  return n + transform_n_rasterize_instances(_mballe, view, model, proj, xyz, nb);
+}
+
+/*!\brief écrit les \a w x \a h pixels \a p dans le fichier PPM \a
+ * filename (la première ligne de \a p est en bas de l'image) ;
+ * renvoie 0 en cas d'échec */
+int write_ppm(const char * filename, const GLuint * p, int w, int h) {
+  int x, y;
+  FILE * f = fopen(filename, "wb");
+  if(!f) {
+    perror(filename);
+    return 0;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", w, h);
+  for(y = h - 1; y >= 0; --y)
+    for(x = 0; x < w; ++x) {
+      fputc(RED(p[y * w + x]), f);
+      fputc(GREEN(p[y * w + x]), f);
+      fputc(BLUE(p[y * w + x]), f);
+    }
+  fclose(f);
+  return 1;
+}
@@ -0,0 +1,54 @@
+/*!\file scenes.h
+ *
+ * \brief scènes fixes et déterministes, rendues sans fenêtre par les
+ * outils de mesure et de vérification du moteur de rendu.
+ *
+ * \author Farès BELHADJ, amsi@up8.edu
+ * \date November 2021.
+*/
+
+#ifndef SCENES_H_SEEN
+#  define SCENES_H_SEEN
+
+#  include "rasterize.h"
+#  include "game.h"
+
+#  ifdef __cplusplus
+extern "C" {
+#  endif
+
+  /*!\brief les scènes disponibles */
+  enum scene_id_t {
+		   SCENE_BOARD = 0, /* le plateau du casse-briques de
+				       window.c */
+		   SCENE_SPHERES, /* une grille de sphères finement
+				     tessellées */
+		   SCENE_NEAR_QUADS, /* un sol de grands quadrilatères
+					traversant le plan near */
+		   SCENE_OVERDRAW, /* une pile de quadrilatères plein
+				      écran dessinés de l'arrière vers
+				      l'avant */
+		   SCENE_BALLS, /* des milliers de petites balles
+				   dessinées par instances */
+		   SCENE_MODEL, /* un maillage chargé d'un fichier OBJ
+				   (voir scenes_load_model) qui tourne,
+				   seulement s'il a été chargé */
+		   SCENE_COUNT
+  };
+
+  extern void         scenes_init(void);
+  extern void         scenes_quit(void);
+  extern void         scenes_compress_textures(void);
+  extern void         scenes_compact_meshes(void);
+  extern int          scenes_load_model(const char * filename, int flags);
+  extern const char * scene_name(int scene);
+  extern int          scene_from_name(const char * name);
+  extern int          scene_draw(int scene, int frame, GLuint * pixels, int w, int h);
+  extern int          write_ppm(const char * filename, const GLuint * p, int w, int h);
+  extern int          scene_draw_game(const game_state_t * s, const board_t * b, const float * xyz, int nb, GLuint * pixels, int w, int h);
+
+#  ifdef __cplusplus
+}
+#  endif
+
+#endif
@@ -1,7 +1,7 @@
 /*!\file surface.c 
  *
  * \brief gestion de surfaces et autres éléments de la scène :
- * lumière(s) (TODO), options, textures ...
+ * lumière(s), options, textures ...
  *
  * \author Farès BELHADJ, amsi@up8.edu
  * \date November 17, 2021. 
@@ -10,6 +10,12 @@
 #include "rasterize.h"
 #include <assert.h>
 
+/*!\brief les lumières de la scène, par défaut une lumière
+ * positionnelle placée en (0, 0, 1) dans le repère caméra */
+static light_t _lights[LIGHTS_MAX] = { { LT_POINT, { 0.0f, 0.0f, 1.0f, 1.0f }, 1.0f } };
+/*!\brief le nombre de lumières utilisées dans \ref _lights */
+static int _nlights = 1;
+
 /*!\brief calcule le vecteur normal à un triangle */
 void tnormal(triangle_t * t) {
   vec3 u = {
@@ -45,11 +51,25 @@ void set_texture_id(surface_t * s, GLuint tex_id) {
   s->tex_id = tex_id;
 }
 
+/*!\brief donne à la surface sa propre texture \a t, par exemple une
+ * entrée d'un atlas (voir atlas.c), prioritaire sur son identifiant
+ * de texture : la dessiner ne change plus la texture courante */
+void set_texture_handle(surface_t * s, texture_t t) {
+  s->tex = t;
+}
+
 /*!\brief affecte la couleur diffuse de la surface */
 void set_diffuse_color(surface_t * s, vec4 dcolor) {
   s->dcolor = dcolor;
 }
 
+/*!\brief affecte la couleur spéculaire et la brillance de la surface
+ * (utilisées par l'éclairage par pixel, voir SO_USE_PHONG) */
+void set_specular(surface_t * s, vec4 scolor, float shininess) {
+  s->scolor = scolor;
+  s->shininess = shininess;
+}
+
 /*!\brief active une option de la surface */
 void enable_surface_option(surface_t * s, soptions_t option) {
   if(!(s->options & option))
@@ -75,6 +95,7 @@ void disable_surface_option(surface_t * s, soptions_t option) {
  * affecte aux sommets. */
 surface_t * new_surface(triangle_t * t, int n, int duplicate_triangles, int has_normals) {
   const vec4 dcolor = { 0.42f, 0.1f, 0.1f, 1.0f };
+  const vec4 scolor = { 0.5f, 0.5f, 0.5f, 1.0f };
   surface_t * s = malloc(1 * sizeof *s);
   assert(s);
   s->n = n;
@@ -85,8 +106,15 @@ surface_t * new_surface(triangle_t * t, int n, int duplicate_triangles, int has_
   } else
     s->t = t;
   set_diffuse_color(s, dcolor);
+  set_specular(s, scolor, 32.0f);
   s->options = SO_DEFAULT;
   s->tex_id = 0;
+  memset(&s->tex, 0, sizeof s->tex);
+  s->nlod = s->lod = s->nilod = 0;
+  s->ilod = NULL;
+  s->radius = s->impostorpx = 0.0f;
+  s->cv = NULL;
+  memset(s->lodcv, 0, sizeof s->lodcv);
   updatesfuncs(s);
   if(!has_normals) {
     snormals(s);
@@ -97,30 +125,366 @@ surface_t * new_surface(triangle_t * t, int n, int duplicate_triangles, int has_
 
 /*!\brief libère la mémoire utilisée par la surface */
 void free_surface(surface_t * s) {
-  free(s->t);
+  int i;
+  if(s->nlod)
+    for(i = 0; i < s->nlod; ++i) {
+      free(s->lodt[i]);
+      free(s->lodcv[i]);
+    }
+  else {
+    free(s->t);
+    free(s->cv);
+  }
+  free(s->ilod);
   free(s);
 }
+
+/*!\brief ajoute à \a s un niveau de détail plus grossier que les
+ * précédents : les \a n triangles \a t (alloués avec malloc, ils
+ * seront libérés par free_surface), utilisés quand le rayon projeté
+ * de la surface passe sous \a below_px pixels. Les triangles
+ * d'origine de la surface forment le niveau 0. Le niveau est choisi
+ * à chaque dessin (voir transform_n_rasterize) avec une hystérésis de
+ * LOD_HYSTERESIS autour des seuils. */
+void add_surface_lod(surface_t * s, triangle_t * t, int n, float below_px) {
+  int i, j;
+  assert(!s->cv);
+  if(!s->nlod) {
+    s->lodt[0] = s->t;
+    s->lodn[0] = s->n;
+    s->lodpx[0] = FLT_MAX;
+    s->nlod = 1;
+    for(i = 0; i < s->n; ++i)
+      for(j = 0; j < 3; ++j)
+	s->radius = MAX(s->radius, sqrtf(MVEC3DOT((float *)&(s->t[i].v[j].position), (float *)&(s->t[i].v[j].position))));
+  }
+  assert(s->nlod < LOD_MAX && below_px < s->lodpx[s->nlod - 1]);
+  s->lodt[s->nlod] = t;
+  s->lodn[s->nlod] = n;
+  s->lodpx[s->nlod++] = below_px;
+}
+
+/*!\brief fait dessiner \a s, une sphère centrée sur l'origine de son
+ * repère objet (voir mk_sphere), en imposteur quand son rayon projeté
+ * passe sous \a below_px pixels (0 pour ne jamais le faire) : un carré
+ * à l'écran dont chaque pixel calcule l'intersection de son rayon avec
+ * la sphère (voir transform_n_rasterize). Le seuil suit la même
+ * hystérésis que ceux des niveaux de détail ; les niveaux utilisés
+ * sous ce seuil ne servent plus. */
+void set_sphere_impostor(surface_t * s, float below_px) {
+  int i, j;
+  if(!s->radius)
+    for(i = 0; i < s->n; ++i)
+      for(j = 0; j < 3; ++j)
+	s->radius = MAX(s->radius, sqrtf(MVEC3DOT((float *)&(s->t[i].v[j].position), (float *)&(s->t[i].v[j].position))));
+  s->impostorpx = below_px;
+}
+/*!\brief convertit \a f en demi-flottant (binary16), arrondi au plus
+ * proche ; les valeurs trop petites deviennent 0 (pas de dénormaux),
+ * les trop grandes le plus grand demi-flottant fini */
+static unsigned short float_to_half(float f) {
+  union { float f; unsigned u; } v;
+  unsigned sign, m, h;
+  int e;
+  v.f = f;
+  sign = (v.u >> 16) & 0x8000;
+  e = (int)((v.u >> 23) & 0xFF) - 127 + 15;
+  m = v.u & 0x7FFFFF;
+  if(e <= 0)
+    return (unsigned short)sign;
+  if(e >= 31)
+    return (unsigned short)(sign | 0x7BFF);
+  h = ((unsigned)e << 10) | (m >> 13);
+  h += (m >> 12) & 1;
+  return (unsigned short)(sign | MIN(h, 0x7BFF));
+}
+
+/*!\brief code la normale \a n (normalisée) par projection
+ * octaédrique dans \a o : projetée sur l'octaèdre |x| + |y| + |z| = 1,
+ * l'hémisphère z < 0 replié sur les coins, elle tient en deux
+ * coordonnées dans [-1, 1] (voir cvertex_decode) */
+static void oct_encode(const vec3 * n, short * o) {
+  float l = fabsf(n->x) + fabsf(n->y) + fabsf(n->z), x, y;
+  if(l <= 0.0f) {
+    o[0] = o[1] = 0;
+    return;
+  }
+  x = n->x / l;
+  y = n->y / l;
+  if(n->z < 0.0f) {
+    float ox = x;
+    x = (1.0f - fabsf(y)) * (ox < 0.0f ? -1.0f : 1.0f);
+    y = (1.0f - fabsf(ox)) * (y < 0.0f ? -1.0f : 1.0f);
+  }
+  o[0] = (short)lrintf(x * 32767.0f);
+  o[1] = (short)lrintf(y * 32767.0f);
+}
+
+/*!\brief fixe la boîte englobante (\a lo, \a hi) dans laquelle les
+ * positions des sommets compacts de \a s sont quantifiées (voir
+ * cvertex_encode) */
+void set_compact_bounds(surface_t * s, const float * lo, const float * hi) {
+  int c;
+  for(c = 0; c < 3; ++c) {
+    s->qoffset[c] = 0.5f * (lo[c] + hi[c]);
+    s->qscale[c] = 0.5f * (hi[c] - lo[c]) / 32767.0f;
+  }
+}
+
+/*!\brief code dans \a o le sommet \a v de la surface \a s, dont la
+ * boîte de quantification est déjà fixée (voir set_compact_bounds) */
+void cvertex_encode(const surface_t * s, const vertex_t * v, cvertex_t * o) {
+  int c;
+  for(c = 0; c < 3; ++c)
+    o->position[c] = s->qscale[c] > 0.0f ? (short)lrintf(MIN(MAX(((&(v->position.x))[c] - s->qoffset[c]) / s->qscale[c], -32767.0f), 32767.0f)) : 0;
+  o->texCoord[0] = float_to_half(v->texCoord.x);
+  o->texCoord[1] = float_to_half(v->texCoord.y);
+  oct_encode(&(v->normal), o->normal);
+  for(c = 0; c < 4; ++c)
+    o->color[c] = (GLubyte)lrintf(MIN(MAX((&(v->color0.x))[c], 0.0f), 1.0f) * 255.0f);
+}
+
+/*!\brief remplace les triangles de chaque niveau de \a s par leurs
+ * sommets compacts, sur le réseau de quantification déjà fixé (voir
+ * \ref compact_surface) */
+static void compact_encode(surface_t * s) {
+  int nl = s->nlod ? s->nlod : 1, l, cur = 0, i, j;
+  assert(!(s->cv && s->nlod));
+  free(s->cv);
+  s->radius = 0.0f;
+  for(l = 0; l < nl; ++l) {
+    triangle_t * t = s->nlod ? s->lodt[l] : s->t;
+    int n = s->nlod ? s->lodn[l] : s->n;
+    cvertex_t * cv = malloc(MAX(3 * n, 1) * sizeof *cv);
+    assert(cv);
+    if(s->nlod && t == s->t)
+      cur = l;
+    for(i = 0; i < n; ++i)
+      for(j = 0; j < 3; ++j) {
+	cvertex_t * o = &cv[3 * i + j];
+	vertex_t d;
+	cvertex_encode(s, &(t[i].v[j]), o);
+	/* le rayon englobant est pris sur les positions telles
+	   qu'elles seront décompressées */
+	cvertex_decode(s, o, &d);
+	s->radius = MAX(s->radius, sqrtf(MVEC3DOT((float *)&(d.position), (float *)&(d.position))));
+      }
+    free(t);
+    if(s->nlod) {
+      s->lodt[l] = NULL;
+      s->lodcv[l] = cv;
+    } else
+      s->cv = cv;
+  }
+  if(s->nlod)
+    s->cv = s->lodcv[cur];
+  s->t = NULL;
+}
+
+/*!\brief rend \a s compacte : les triangles de chacun de ses niveaux
+ * de détail sont remplacés par des sommets compacts (cvertex_t), 54
+ * octets par triangle au lieu des sizeof(triangle_t) (352) d'un
+ * triangle au repos. Les positions sont quantifiées sur 16 bits dans
+ * la boîte englobante de la surface, les coordonnées de texture en
+ * demi-flottants, les normales par projection octaédrique et la
+ * couleur sur 8 bits par composante. Les sommets sont décompressés à
+ * chaque dessin, au moment de leur transformation (voir
+ * stransform_vertices), par lots de quelques centaines de triangles
+ * dans un buffer de travail de taille fixe propre au thread qui
+ * dessine (environ 90 Ko) : la décompression coûte du temps à chaque
+ * dessin, pas de mémoire. Après un changement des triangles (s->t
+ * reçoit de nouveaux triangles, alloués avec malloc), la surface peut
+ * être compactée de nouveau, si elle n'a pas de niveaux de détail. */
+void compact_surface(surface_t * s) {
+  int nl = s->nlod ? s->nlod : 1, l, i, j, c, nv = 0;
+  float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  assert(!(s->cv && s->nlod));
+  for(l = 0; l < nl; ++l) {
+    triangle_t * t = s->nlod ? s->lodt[l] : s->t;
+    int n = s->nlod ? s->lodn[l] : s->n;
+    for(i = 0; i < n; ++i)
+      for(j = 0; j < 3; ++j, ++nv)
+	for(c = 0; c < 3; ++c) {
+	  lo[c] = MIN(lo[c], (&(t[i].v[j].position.x))[c]);
+	  hi[c] = MAX(hi[c], (&(t[i].v[j].position.x))[c]);
+	}
+  }
+  if(!nv)
+    lo[0] = lo[1] = lo[2] = hi[0] = hi[1] = hi[2] = 0.0f;
+  set_compact_bounds(s, lo, hi);
+  compact_encode(s);
+}
+
+/*!\brief rend \a s compacte comme \ref compact_surface, mais ses
+ * positions sont quantifiées sur le réseau donné, position = \a
+ * offset + q x \a scale, plutôt que dans sa boîte englobante : des
+ * surfaces quantifiées sur un même réseau (les chunks du plateau, voir
+ * boardmesh.c) décompressent à l'identique leurs sommets communs et
+ * restent jointives. Les positions doivent tenir dans \a offset
+ * +/- 32767 \a scale. */
+void compact_surface_lattice(surface_t * s, const float * offset, float scale) {
+  int c;
+  for(c = 0; c < 3; ++c) {
+    s->qoffset[c] = offset[c];
+    s->qscale[c] = scale;
+  }
+  compact_encode(s);
+}
+
 /*!\brief charge et fabrique un identifiant pour une texture issue
  * d'un fichier BMP */
 GLuint get_texture_from_BMP(const char * filename) {
-  GLuint id, old_id;
-  /* chargement d'une image dans une surface SDL */
-  SDL_Surface * s = SDL_LoadBMP(filename);
-  assert(s);
+  GLuint id;
+  get_textures_from_BMP(&filename, &id, 1);
+  return id;
+}
+
+/*!\brief une texture en cours de chargement, voir \ref
+ * get_textures_from_BMP */
+typedef struct bmp_load_t bmp_load_t;
+struct bmp_load_t {
+  const char * filename;
+  SDL_Surface * s;        /* l'image convertie en RGBA */
+};
+
+/*!\brief la tâche de \ref get_textures_from_BMP : lit et convertit
+ * les images [\a i0, \a i1[ */
+static void load_BMP_range(void * data, int i0, int i1) {
+  bmp_load_t * b = data;
+  int i;
+  for(i = i0; i < i1; ++i) {
+    /* chargement d'une image dans une surface SDL */
+    SDL_Surface * s = SDL_LoadBMP(b[i].filename);
+    assert(s);
+    b[i].s = SDL_CreateRGBSurface(0, s->w, s->h, 32, R_MASK, G_MASK, B_MASK, A_MASK);
+    assert(b[i].s);
+    SDL_BlitSurface(s, NULL, b[i].s, NULL);
+    SDL_FreeSurface(s);
+  }
+}
+
+/*!\brief charge les \a n textures des fichiers BMP \a filenames et
+ * range leurs identifiants dans \a ids. Les fichiers sont lus et
+ * convertis en parallèle (voir jobs.c) ; les screens GL4Dummies sont
+ * créés ensuite par le thread appelant. */
+void get_textures_from_BMP(const char ** filenames, GLuint * ids, int n) {
+  GLuint old_id;
+  int i;
+  bmp_load_t * b = malloc(n * sizeof *b);
+  assert(b || !n);
+  for(i = 0; i < n; ++i)
+    b[i].filename = filenames[i];
+  jobs_parallel_for(n, 1, load_BMP_range, b);
   old_id = gl4dpGetTextureId(); /* au cas où */
-  /* création d'un screen GL4Dummies aux dimensions de la texture */
-  id = gl4dpInitScreenWithDimensions(s->w, s->h);
-  /* copie de la surface SDL vers le screen en cours */
-  {
-    GLuint * p = gl4dpGetPixels();
-    SDL_Surface * d = SDL_CreateRGBSurface(0, s->w, s->h, 32, R_MASK, G_MASK, B_MASK, A_MASK);
-    SDL_BlitSurface(s, NULL, d, NULL);  
-    memcpy(p, d->pixels, d->w * d->h * sizeof *p);
-    SDL_FreeSurface(d);
+  for(i = 0; i < n; ++i) {
+    /* création d'un screen GL4Dummies aux dimensions de la texture
+       et copie de l'image */
+    ids[i] = gl4dpInitScreenWithDimensions(b[i].s->w, b[i].s->h);
+    memcpy(gl4dpGetPixels(), b[i].s->pixels, b[i].s->w * b[i].s->h * sizeof(GLuint));
+    SDL_FreeSurface(b[i].s);
   }
-  /* libération de la surface SDL */
-  SDL_FreeSurface(s);
   if(old_id)
     gl4dpSetScreen(old_id);
-  return id;
+  free(b);
+}
+
+/*!\brief charge les \a n textures des fichiers BMP \a filenames dans
+ * un seul atlas (voir atlas.c), la i-ème étant atlas_texture(a, i).
+ * Les fichiers sont lus et convertis en parallèle, comme par \ref
+ * get_textures_from_BMP, mais aucun screen GL4Dummies n'est créé. */
+atlas_t * atlas_from_BMP(const char ** filenames, int n) {
+  atlas_t * a;
+  int i, * w, * h;
+  const GLuint ** images;
+  bmp_load_t * b = malloc(n * sizeof *b);
+  w = malloc(n * sizeof *w);
+  h = malloc(n * sizeof *h);
+  images = malloc(n * sizeof *images);
+  assert(b && w && h && images);
+  for(i = 0; i < n; ++i)
+    b[i].filename = filenames[i];
+  jobs_parallel_for(n, 1, load_BMP_range, b);
+  for(i = 0; i < n; ++i) {
+    images[i] = b[i].s->pixels;
+    w[i] = b[i].s->w;
+    h[i] = b[i].s->h;
+  }
+  a = atlas_new(images, w, h, n);
+  for(i = 0; i < n; ++i)
+    SDL_FreeSurface(b[i].s);
+  free(images);
+  free(h);
+  free(w);
+  free(b);
+  return a;
+}
+
+/*!\brief ajoute la lumière \a l à la scène et renvoie son indice, ou
+ * -1 si \ref LIGHTS_MAX lumières sont déjà utilisées */
+int add_light(light_t l) {
+  if(_nlights >= LIGHTS_MAX)
+    return -1;
+  _lights[_nlights] = l;
+  return _nlights++;
+}
+
+/*!\brief remplace la lumière d'indice \a i par \a l */
+void set_light(int i, light_t l) {
+  assert(i >= 0 && i < _nlights);
+  _lights[i] = l;
+}
+
+/*!\brief retire toutes les lumières de la scène */
+void clear_lights(void) {
+  _nlights = 0;
+}
+
+/*!\brief renvoie le nombre de lumières de la scène */
+int get_nlights(void) {
+  return _nlights;
+}
+
+/*!\brief ramène les lumières de la scène dans le repère objet à
+ * l'aide de \a inv_model_view_matrix, l'inverse de la matrice
+ * model-view de la surface, et range le résultat dans \a ol.
+ *
+ * Les positions subissent l'inverse de la model-view ; les
+ * directions aussi car pour une normale transformée par la
+ * transposée de l'inverse, (M^-T n).d = n.(M^-1 d). Le résultat est
+ * exact pour les model-view rigides (rotations, translations) et
+ * approché en cas de mise à l'échelle non uniforme. */
+void lights_to_object_space(olights_t * ol, float * inv_model_view_matrix) {
+  int i;
+  float r[4], o[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+  MMAT4XVEC4(r, inv_model_view_matrix, o);
+  ol->eye.x = r[0] / r[3];
+  ol->eye.y = r[1] / r[3];
+  ol->eye.z = r[2] / r[3];
+  ol->eye.w = 1.0f;
+  ol->np = ol->nd = 0;
+  ol->ambient = 0.0f;
+  for(i = 0; i < _nlights; ++i) {
+    float p[4] = { _lights[i].position.x, _lights[i].position.y, _lights[i].position.z, 1.0f };
+    switch(_lights[i].type) {
+    case LT_POINT:
+      MMAT4XVEC4(r, inv_model_view_matrix, p);
+      ol->p[ol->np].x = r[0] / r[3];
+      ol->p[ol->np].y = r[1] / r[3];
+      ol->p[ol->np].z = r[2] / r[3];
+      ol->p[ol->np++].w = _lights[i].intensity;
+      break;
+    case LT_DIRECTIONAL:
+      p[3] = 0.0f;
+      MMAT4XVEC4(r, inv_model_view_matrix, p);
+      MVEC3NORMALIZE(r);
+      ol->d[ol->nd].x = r[0];
+      ol->d[ol->nd].y = r[1];
+      ol->d[ol->nd].z = r[2];
+      ol->d[ol->nd++].w = _lights[i].intensity;
+      break;
+    case LT_AMBIENT:
+      ol->ambient += _lights[i].intensity;
+      break;
+    }
+  }
 }
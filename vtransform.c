@@ -15,11 +15,14 @@
 
 /* fonctions locale (static) */
 static inline void clip2_unit_cube(triangle_t * t);
+static inline float vlighting(const olights_t * ol, int np, int nd, const vertex_t * v);
+static inline float half_to_float(unsigned short h);
 
 /*!\brief projette le sommet \a v à l'écran (le \a viewport) selon la
-   matrice de model-view \a model_view_matrix et de projection \a projection_matrix. \a
-   ti_model_view_matrix est la transposée de l'inverse de la matrice \a model_view_matrix.*/
-vertex_t vtransform(surface_t * s, vertex_t v, float * model_view_matrix, float * ti_model_view_matrix, float * projection_matrix, float * viewport) {
+   matrice de model-view \a model_view_matrix et de projection \a
+   projection_matrix. L'éclairage utilise les lumières de la surface
+   déjà ramenées dans le repère objet (voir \ref stransform). */
+vertex_t vtransform(surface_t * s, vertex_t v, float * model_view_matrix, float * projection_matrix, float * viewport) {
   float dist = 1.0f;
   vec4 r1, r2;
   v.state = PS_NONE;
@@ -49,25 +52,30 @@ vertex_t vtransform(surface_t * s, vertex_t v, float * model_view_matrix, float
     v.state |= PS_TOO_FAR;
     return v;
   }
-  /* Gouraud */
   if(s->options & SO_USE_LIGHTING) {
-    /* la lumière est positionnelle et fixe dans la scène. \todo dans
-       scene.c la rendre modifiable, voire aussi pouvoir la placer par
-       rapport aux objets (elle subirait la matrice modèle). */
-    const vec4 lp[1] = { {0.0f, 0.0f, 1.0f} };
-    vec4 ld = {lp[0].x - r1.x, lp[0].y - r1.y, lp[0].z - r1.z, lp[0].w - r1.w};
-    float n[4] = {v.normal.x, v.normal.y, v.normal.z, 0.0f}, res[4];
-    MMAT4XVEC4(res, ti_model_view_matrix, n);
-    MVEC3NORMALIZE(res);
-    MVEC3NORMALIZE((float *)&ld);
-    v.li = MVEC3DOT(res, (float *)&ld);
-    v.li = MIN(MAX(0.0f, v.li), 1.0f);
+    const olights_t * ol = &(s->lights);
+    if(s->options & SO_USE_PHONG) {
+      /* Phong : l'éclairage est calculé par pixel à partir de la
+	 normale et de la position (repère objet) interpolées */
+      v.opos.x = v.position.x;
+      v.opos.y = v.position.y;
+      v.opos.z = v.position.z;
+      v.li = 1.0f;
+    } else if(ol->np == 1 && ol->nd == 0)
+      /* Gouraud, cas le plus courant spécialisé : une seule lumière
+	 positionnelle, les boucles de vlighting disparaissent à la
+	 compilation */
+      v.li = vlighting(ol, 1, 0, &v);
+    else /* Gouraud */
+      v.li = vlighting(ol, ol->np, ol->nd, &v);
   } else
     v.li = 1.0f;
   v.icolor = v.color0;
   /* Mapping du cube unitaire vers l'écran */
   v.x = viewport[0] + ((r2.x + 1.0f) * 0.5f) * (viewport[2] - EPSILON);
   v.y = viewport[1] + ((r2.y + 1.0f) * 0.5f) * (viewport[3] - EPSILON);
+  v.fx = (int)lrintf((viewport[0] + (r2.x + 1.0f) * 0.5f * viewport[2]) * SUBPIXEL);
+  v.fy = (int)lrintf((viewport[1] + (r2.y + 1.0f) * 0.5f * viewport[3]) * SUBPIXEL);
   v.z = pow((-r2.z + 1.0f) * 0.5f, 0.5);
   /* sinon pour near = 0.1f et far = 10.0f on peut rendre non linéaire la depth avec */
   /* v.z = 1.0f - (1.0f / r2.z - 1.0f / 0.1f) / (1.0f / 10.0f - 1.0f / 0.1f); */
@@ -86,19 +94,33 @@ vertex_t vtransform(surface_t * s, vertex_t v, float * model_view_matrix, float
  * \see clip2_unit_cube
  */
 void stransform(surface_t * s, float * model_view_matrix, float * projection_matrix, float * viewport) {
+  float inv_model_view_matrix[16];
+  /* plutôt que de transformer chaque normale, les lumières sont
+     ramenées une fois pour toutes dans le repère objet ; le
+     lambertien utilisé par le shading Gouraud dans vtransform se
+     réduit alors à des produits scalaires. */
+  if(s->options & SO_USE_LIGHTING) {
+    memcpy(inv_model_view_matrix, model_view_matrix, sizeof inv_model_view_matrix);
+    MMAT4INVERSE(inv_model_view_matrix);
+    lights_to_object_space(&(s->lights), inv_model_view_matrix);
+  }
+  stransform_vertices(s, model_view_matrix, projection_matrix, viewport);
+}
+
+/*!\brief la partie de \ref stransform qui traite les sommets : les
+ * lumières de \a s doivent déjà être dans le repère objet (voir \ref
+ * transform_n_rasterize_instances). */
+void stransform_vertices(surface_t * s, float * model_view_matrix, float * projection_matrix, float * viewport) {
   int i, j;
-  float ti_model_view_matrix[16];
   triangle_t vcull;
-  /* calcul de la transposée de l'inverse de la matrice model-view
-     pour la transformation des normales et le calcul du lambertien
-     utilisé par le shading Gouraud dans vtransform. */
-  memcpy(ti_model_view_matrix, model_view_matrix, sizeof ti_model_view_matrix);
-  MMAT4INVERSE(ti_model_view_matrix);
-  MMAT4TRANSPOSE(ti_model_view_matrix);
   for(i = 0; i < s->n; ++i) {
     s->t[i].state = PS_NONE;
     for(j = 0; j < 3; ++j) {
-      s->t[i].v[j] = vtransform(s, s->t[i].v[j], model_view_matrix, ti_model_view_matrix, projection_matrix, viewport);
+      /* une surface compacte est décompressée ici, dans son buffer
+	 de travail */
+      if(s->cv)
+	cvertex_decode(s, &(s->cv[3 * i + j]), &(s->t[i].v[j]));
+      s->t[i].v[j] = vtransform(s, s->t[i].v[j], model_view_matrix, projection_matrix, viewport);
       if(s->options & SO_CULL_BACKFACES) {
 	vcull.v[j].position.x = s->t[i].v[j].x;
 	vcull.v[j].position.y = s->t[i].v[j].y;
@@ -112,8 +134,68 @@ void stransform(surface_t * s, float * model_view_matrix, float * projection_mat
 	continue;
       }
     }
+    PROF_BEGIN(PROF_CLIP);
     clip2_unit_cube(&(s->t[i]));
+    PROF_END(PROF_CLIP);
+  }
+}
+
+/*!\brief décompresse dans \a v le sommet compact \a c de la surface
+ * \a s (voir compact_surface) : position, normale, coordonnée de
+ * texture et couleur ; les autres champs sont ceux que remplit
+ * vtransform */
+void cvertex_decode(const surface_t * s, const cvertex_t * c, vertex_t * v) {
+  float x = c->normal[0] * (1.0f / 32767.0f), y = c->normal[1] * (1.0f / 32767.0f), z = 1.0f - fabsf(x) - fabsf(y), n;
+  v->position.x = s->qoffset[0] + c->position[0] * s->qscale[0];
+  v->position.y = s->qoffset[1] + c->position[1] * s->qscale[1];
+  v->position.z = s->qoffset[2] + c->position[2] * s->qscale[2];
+  v->position.w = 1.0f;
+  /* l'hémisphère z < 0 est replié sur les coins de l'octaèdre */
+  if(z < 0.0f) {
+    float ox = x;
+    x = (1.0f - fabsf(y)) * (ox < 0.0f ? -1.0f : 1.0f);
+    y = (1.0f - fabsf(ox)) * (y < 0.0f ? -1.0f : 1.0f);
+  }
+  n = 1.0f / sqrtf(x * x + y * y + z * z);
+  v->normal.x = x * n;
+  v->normal.y = y * n;
+  v->normal.z = z * n;
+  v->texCoord.x = half_to_float(c->texCoord[0]);
+  v->texCoord.y = half_to_float(c->texCoord[1]);
+  v->color0.x = c->color[0] * (1.0f / 255.0f);
+  v->color0.y = c->color[1] * (1.0f / 255.0f);
+  v->color0.z = c->color[2] * (1.0f / 255.0f);
+  v->color0.w = c->color[3] * (1.0f / 255.0f);
+}
+
+/*!\brief convertit le demi-flottant \a h (sans dénormaux, infinis
+ * ni NaN, que compact_surface ne produit pas) en float */
+inline float half_to_float(unsigned short h) {
+  union { unsigned u; float f; } r;
+  r.u = (h & 0x7FFF) ? ((unsigned)(h & 0x8000) << 16) | (((unsigned)(h & 0x7FFF) + ((127 - 15) << 10)) << 13) : (unsigned)(h & 0x8000) << 16;
+  return r.f;
+}
+
+/*!\brief intensité lumineuse (lambertien) au sommet \a v à partir des
+ * \a np lumières positionnelles et \a nd lumières directionnelles de
+ * \a ol, toutes dans le repère objet. La normale du sommet est
+ * supposée normalisée. Appelée avec des constantes pour \a np et \a
+ * nd, le compilateur produit une version dédiée. */
+inline float vlighting(const olights_t * ol, int np, int nd, const vertex_t * v) {
+  int i;
+  float li = ol->ambient, d, l2;
+  for(i = 0; i < np; ++i) {
+    vec3 ld = { ol->p[i].x - v->position.x, ol->p[i].y - v->position.y, ol->p[i].z - v->position.z };
+    d = MVEC3DOT((float *)&(v->normal), (float *)&ld);
+    if(d > 0.0f && (l2 = MVEC3DOT((float *)&ld, (float *)&ld)) > 0.0f)
+      li += ol->p[i].w * d / sqrtf(l2);
+  }
+  for(i = 0; i < nd; ++i) {
+    d = MVEC3DOT((float *)&(v->normal), (float *)&(ol->d[i]));
+    if(d > 0.0f)
+      li += ol->d[i].w * d;
   }
+  return MIN(li, 1.0f);
 }
 
 /*!\brief multiplie deux matrices : \a res = \a res x \a m */
@@ -8,6 +8,8 @@
 #include <GL4D/gl4dp.h>
 /* inclure la bibliothèque de rendu DIY */
 #include "rasterize.h"
+/* la simulation du jeu, à pas de temps fixe */
+#include "game.h"
 
 /* inclusion des entêtes de fonctions de création et de gestion de
  * fenêtres système ouvrant un contexte favorable à GL4dummies. Cette
@@ -17,6 +19,9 @@
 /* protos de fonctions locales (static) */
 static void init(void);
 static void draw(void);
+static void draw_scene(const game_state_t * st, float * model_view_matrix, float * projection_matrix, float a);
+static int  dirty_rects(const game_state_t * st, float * model_view_matrix, float * projection_matrix, int (*rects)[4]);
+static void dirty_add(int (*rects)[4], int * n, const int * r);
 static void key(int keycode);
 static void sortie(void);
 
@@ -30,116 +35,112 @@ static surface_t *_balle = NULL;
 static surface_t *_raquette = NULL;
 
 static surface_t *_sol = NULL;
+/*!\brief les balles supplémentaires (multiballe), dessinées par
+ * instances */
+static surface_t *_mballe = NULL;
+/*!\brief le plateau découpé en chunks pour le rendu */
+static bmesh_t _bmesh;
+/*!\brief l'atlas des textures des surfaces (voir atlas.c) */
+static atlas_t * _atlas = NULL;
+
+/*!\brief nombre maximal de rectangles redessinés par frame en mode
+ * incrémental ; au-delà, les plus proches sont fusionnés */
+#define DIRTY_MAX 16
+/*!\brief mode incrémental (touche 'i') : seuls les rectangles de
+ * l'écran couverts par ce qui a bougé ou changé, à la frame
+ * précédente ou à celle-ci, sont effacés et redessinés */
+static int _incremental = 1;
+/*!\brief force une frame complète (options de rendu changées, ...) */
+static int _full_redraw = 1;
+/*!\brief la caméra, les dimensions de l'écran et les rectangles des
+ * objets mobiles de la frame précédente */
+static float _prev_view[16];
+static int _prev_w = 0, _prev_h = 0;
+static int _prev_rects[DIRTY_MAX][4], _nprev = 0;
 
 
 /* des variable d'états pour activer/désactiver des options de rendu */
-static int _use_tex = 1, _use_color = 1, _use_lighting = 1;
+static int _use_tex = 1, _use_color = 1, _use_lighting = 1, _use_phong = 1;
 
 /*!\brief on peut bouger la caméra vers le haut et vers le bas avec cette variable */
 static float _ycam = 30.0f; // 3.0 de base
-/* Plateau */
-static int _plateau[] = {
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
-    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
-    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
-    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
-    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
-    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
-    1,2,2,2,2,2,2,2,2,2,2,2,2,2,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-};
-
-//hauteu du plateau
-static int _H = 19;
-//largeur du plateau
-static int _W = 15;
-
-// Position de départ de ma balle
-static vec3 _ballePosition = {0, 6, 0.0f};
-// Je positionne la raquette en dessous de la position de départ de ma balle
-static vec3 _raquettePosition = {0, 13, 0.0f};
-// Vitesse de la balle
-static vec2 _vitesseBalle = {0, 0};
-
-void game() {
-  /* on va récupérer le delta-temps */
-  static double t0 = 0.0; // le temps à la frame précédente
-  double t, dt;
-  t = gl4dGetElapsedTime();
-  dt = (t - t0) / 1000.0; // diviser par mille pour avoir des secondes
-  // pour le frame d'après, je mets à jour t0
-  t0 = t;
-
-  //Physique Netwon (souvenir de Godot)
-  _ballePosition.x += _vitesseBalle.x * dt;
-  _ballePosition.y += _vitesseBalle.y * dt;
-
-
-  float md =  _W - 1.5f;
-  float mg = -_W - 1.0f;
-  float mb = _H - 9.0f;
-  float mh = - _H - 7.0f;
-
-  if (_ballePosition.y <= mh) {
-
-    _vitesseBalle.y = -_vitesseBalle.y;
-    _ballePosition.x += 0.2f;
-  } else if(_ballePosition.x >= md) {
-    _vitesseBalle.x = -_vitesseBalle.x;
-    _ballePosition.y -= 0.2f;
-  } else if (_ballePosition.x <= mg)
-  {
-    _vitesseBalle.x = -_vitesseBalle.x;
-    _ballePosition.y -= 0.2f;
-  }
-   else if (_ballePosition.y >= mb) {
-    _ballePosition.x = 0.0;
-    _ballePosition.y = 6.0;
-    _vitesseBalle.y = 0.0;
-    _vitesseBalle.x = 0.0;
-  }
-
-  //délimitation du dessus de la raquette
-  // if (_ballePosition.y >= _raquettePosition.y-6.5f)
-  // {
-  //   printf("Here, on touche !");
-  // }
-
-  //délimitation du coté droit de la raquette
-  // if (_ballePosition.x <= _raquettePosition.x + 2.0f)
-  // {
-  //   printf("Here, on touche !");
-  // }
-  
-  //délimitation du côté gauche de la raquette
-  // if (_ballePosition.x >= _raquettePosition.x - 2.0f)
-  // {
-  //   printf("Here, on touche !");
-  // }
-
-  //J'ai décomposé au-dessus les différentes conditions pour délimiter ma raquette
-  if (_ballePosition.y >= _raquettePosition.y-6.5f && _ballePosition.x <= _raquettePosition.x + 3.5f && _ballePosition.x >= _raquettePosition.x - 4.5f)
-  {
-    _vitesseBalle.y = -_vitesseBalle.y;
-  }
-  
-
-}
-
+/*!\brief la simulation tourne-t-elle dans son propre thread
+ * (option --sim-thread) */
+static int _sim_thread = 0;
+/*!\brief fichier de niveau (option --level fichier, voir level.c) */
+static const char *_level = NULL;
+/*!\brief nombre de balles supplémentaires au départ (option --balls N) */
+static int _nballs = 0;
+/*!\brief fichier où enregistrer la partie (option --record fichier) et
+ * l'enregistrement lui-même */
+static const char *_record = NULL;
+static replay_t _replay;
+/*!\brief rendu en pipeline (options --pipeline, avec une frame de
+ * latence, et --pipeline-sync, sans) : la rastérisation d'une frame
+ * se fait dans son propre thread pendant la transformation de la
+ * suivante (voir pipeline.c) */
+static int _pipeline = 0, _pipeline_latency = 1;
+/*!\brief nombre de threads de l'ordonnanceur de tâches (option
+ * --jobs N) : 0 pour un par cœur, 1 pour tout faire dans le thread
+ * qui soumet les tâches (débogage), voir jobs.c */
+static int _jobs = 0;
+/*!\brief rendu en deux passes par visibility buffer (option
+ * --visibility, touche 'v') : la frame est enregistrée dans une
+ * display list, rastérisée en profondeur seule puis coloriée une fois
+ * par pixel (voir dlist_play) ; sans pipeline, la liste utilisée */
+static int _visibility = 0;
+static dlist_t *_vlist = NULL;
+/*!\brief écarter les segments cachés avant le z-test par un S-buffer
+ * (option --sbuffer, touche 's'), voir set_span_buffer */
+static int _sbuffer = 0;
+/*!\brief pas (en pixels) de l'interpolation exacte des attributs
+ * (option --affine N), 0 pour chaque pixel, voir set_affine_span */
+static int _affine = 0;
+/*!\brief textures compressées en BC1 (option --bc1), voir
+ * atlas_compress */
+static int _bc1 = 0;
+/*!\brief surfaces et chunks du plateau compacts (option --compact),
+ * voir compact_surface */
+static int _compact = 0;
+/*!\brief maillage OBJ de la raquette (option --paddle fichier.obj,
+ * voir load_OBJ), à la place des deux cubes, et de quoi le ramener
+ * dans leur boîte : le centre de sa boîte englobante et une échelle */
+static const char *_paddle = NULL;
+static float _paddle_center[3], _paddle_scale = 1.0f;
 
 /*!\brief paramètre l'application et lance la boucle infinie. */
 int main(int argc, char **argv)
 {
+  for (int i = 1; i < argc; ++i)
+    if (!strcmp(argv[i], "--sim-thread"))
+      _sim_thread = 1;
+    else if (!strcmp(argv[i], "--balls") && i + 1 < argc)
+      _nballs = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+      _record = argv[++i];
+    else if (!strcmp(argv[i], "--level") && i + 1 < argc)
+      _level = argv[++i];
+    else if (!strcmp(argv[i], "--pipeline"))
+      _pipeline = _sim_thread = 1;
+    else if (!strcmp(argv[i], "--pipeline-sync"))
+    {
+      _pipeline = _sim_thread = 1;
+      _pipeline_latency = 0;
+    }
+    else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+      _jobs = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--visibility"))
+      _visibility = 1;
+    else if (!strcmp(argv[i], "--sbuffer"))
+      _sbuffer = 1;
+    else if (!strcmp(argv[i], "--affine") && i + 1 < argc)
+      _affine = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--bc1"))
+      _bc1 = 1;
+    else if (!strcmp(argv[i], "--compact"))
+      _compact = 1;
+    else if (!strcmp(argv[i], "--paddle") && i + 1 < argc)
+      _paddle = argv[++i];
   /* tentative de création d'une fenêtre pour GL4Dummies */
   if (!gl4duwCreateWindow(argc, argv,           /* args du programme */
                           "The DIY Rasterizer", /* titre */
@@ -155,7 +156,9 @@ int main(int argc, char **argv)
   /* mettre en place la fonction d'interception clavier */
   gl4duwKeyDownFunc(key);
 
-  gl4duwIdleFunc(game);
+  /* la simulation avance à pas fixes, au rythme de la boucle ou
+   * dans son propre thread */
+  gl4duwIdleFunc(game_update);
   /* mettre en place la fonction de display */
   gl4duwDisplayFunc(draw);
   /* boucle infinie pour éviter que le programme ne s'arrête et ferme
@@ -168,9 +171,6 @@ int main(int argc, char **argv)
  * utilisées dans ce code */
 void init(void)
 {
-  GLuint id_ball;
-  GLuint id_brick;
-  GLuint id_wall;
   GLuint id;
 
   vec4 r = {1, 0, 0, 1}, g = {0, 1, 0, 1}, b = {0, 0, 1, 1};
@@ -182,13 +182,45 @@ void init(void)
   gl4dpInitScreen();
   /* Pour forcer la désactivation de la synchronisation verticale */
   SDL_GL_SetSwapInterval(1);
+  /* l'ordonnanceur de tâches sert au chargement des textures, au
+   * rendu et à la simulation */
+  jobs_init(_jobs);
 
   /* on créé nos trois type de surfaces */
   _brick = mk_cube();           /* ça fait 2x6 triangles        */
   _wall = mk_cube();           /* ça fait 2x6 triangles      */
-  _balle = mk_sphere(12, 12); /* ça fait 12x12x2 trianles ! */
-  _raquette = mk_cube();       /* ça fait 2x6 triangles      */
+  _balle = mk_sphere_lod(12, 12); /* ça fait 12x12x2 trianles ! (moins de loin) */
+  if (_paddle)
+  {
+    /* le modèle, réordonné, est centré et mis à l'échelle dans la
+     * boîte 4x2x2 des deux cubes qu'il remplace */
+    float bmin[3], bmax[3];
+    if (!(_raquette = load_OBJ(_paddle, OBJ_OPTIMIZE | (_compact ? OBJ_COMPACT : OBJ_NONE), bmin, bmax)))
+      exit(1);
+    for (int c = 0; c < 3; ++c)
+    {
+      float k = (c ? 1.0f : 2.0f) / MAX(0.5f * (bmax[c] - bmin[c]), 1e-6f);
+      _paddle_center[c] = 0.5f * (bmin[c] + bmax[c]);
+      _paddle_scale = c ? MIN(_paddle_scale, k) : k;
+    }
+  }
+  else
+    _raquette = mk_cube();       /* ça fait 2x6 triangles      */
   _sol = mk_cube();
+  _mballe = mk_sphere_lod(6, 6);  /* petites et nombreuses, peu tessellées */
+  /* de loin, un carré à l'écran plutôt que des triangles */
+  set_sphere_impostor(_balle, SPHERE_IMPOSTOR_PX);
+  set_sphere_impostor(_mballe, SPHERE_IMPOSTOR_PX);
+  bmesh_init(&_bmesh);
+  if (_compact)
+  {
+    compact_surface(_balle);
+    if (!_raquette->cv)
+      compact_surface(_raquette);
+    compact_surface(_sol);
+    compact_surface(_mballe);
+    _bmesh.compact = 1;
+  }
 
   /* on change les couleurs de surfaces */
   _brick->dcolor = b;
@@ -196,20 +228,42 @@ void init(void)
   _balle->dcolor = g;  //Balle en verte
   _raquette->dcolor = r; //Raquette en rouge pour l'identifier
   _sol->dcolor = b;
+  _mballe->dcolor = g;
 
-  _vitesseBalle.x = 0.0f;
-  _vitesseBalle.y = 0.0f;
+  if (!game_init(_level, _sim_thread, _nballs))
+    exit(1);
+  if (_record)
+  {
+    replay_init(&_replay, (float)GAME_DT, _nballs);
+    if (_level)
+      snprintf(_replay.level, sizeof _replay.level, "%s", _level);
+    game_record(&_replay);
+  }
 
-  id_wall = get_texture_from_BMP("images/texture_wall.bmp");
-  id_ball = get_texture_from_BMP("images/balle_texture.bmp");
-  id_brick = get_texture_from_BMP("images/brique_Texture.bmp");
+  /* en plus de la lumière positionnelle par défaut, une lumière
+   * rasante venant du haut du plateau et un peu d'ambiante */
+  {
+    light_t rasante = { LT_DIRECTIONAL, { 0.0f, 1.0f, 0.5f, 0.0f }, 0.4f };
+    light_t ambiante = { LT_AMBIENT, { 0.0f, 0.0f, 0.0f, 0.0f }, 0.15f };
+    add_light(rasante);
+    add_light(ambiante);
+  }
 
-  /* on leur rajoute à toutes la même texture */
-  set_texture_id(_wall, id_wall);
-  set_texture_id(_brick, id_brick);
-  set_texture_id(_balle, id_ball);
-  set_texture_id(_raquette, id_wall);
-  set_texture_id(_sol, id_wall);
+  {
+    const char * bmp[] = { "images/texture_wall.bmp", "images/balle_texture.bmp", "images/brique_Texture.bmp" };
+    _atlas = atlas_from_BMP(bmp, 3);
+    if (_bc1)
+      atlas_compress(_atlas);
+  }
+
+  /* chaque surface garde sa texture dans l'atlas : aucun changement
+   * de texture courante entre deux dessins */
+  set_texture_handle(_wall, atlas_texture(_atlas, 0));
+  set_texture_handle(_brick, atlas_texture(_atlas, 2));
+  set_texture_handle(_balle, atlas_texture(_atlas, 1));
+  set_texture_handle(_raquette, atlas_texture(_atlas, 0));
+  set_texture_handle(_sol, atlas_texture(_atlas, 0));
+  set_texture_handle(_mballe, atlas_texture(_atlas, 1));
 
   /* si _use_tex != 0, on active l'utilisation de la texture pour les
    * trois */
@@ -220,6 +274,7 @@ void init(void)
     enable_surface_option(_balle, SO_USE_TEXTURE);
     enable_surface_option(_raquette, SO_USE_TEXTURE);
     enable_surface_option(_sol, SO_USE_TEXTURE);
+    enable_surface_option(_mballe, SO_USE_TEXTURE);
   }
   /* si _use_lighting != 0, on active l'ombrage */
   if (_use_lighting)
@@ -229,23 +284,42 @@ void init(void)
     enable_surface_option(_balle, SO_USE_LIGHTING);
     enable_surface_option(_raquette, SO_USE_LIGHTING);
     enable_surface_option(_sol, SO_USE_LIGHTING);
+    enable_surface_option(_mballe, SO_USE_LIGHTING);
   }
+  /* la balle est peu tessellée, l'éclairage par pixel lui évite un
+   * aspect facetté */
+  if (_use_phong)
+    enable_surface_option(_balle, SO_USE_PHONG);
   /* on désactive le back cull face pour le quadrilatère, ainsi on
    * peut voir son arrière quand le lighting est inactif */
   //disable_surface_option(_brick, SO_CULL_BACKFACES);
+  /* statistiques du pipeline toutes les 120 frames (si compilé avec
+   * make PROFILE=1) */
+  prof_set_dump_interval(120);
+  if (_pipeline)
+    pipeline_init();
+  else
+    _vlist = dlist_new();
   /* mettre en place la fonction à appeler en cas de sortie */
   atexit(sortie);
 }
 
-/*!\brief la fonction appelée à chaque display. */
+/*!\brief la fonction appelée à chaque display. En mode incrémental,
+ * tant que la caméra ne bouge pas, seuls les rectangles des objets
+ * mobiles (à leur position précédente et à la nouvelle) sont
+ * effacés et redessinés, le rendu étant limité à chacun par un
+ * scissor ; sinon toute la frame est redessinée. */
 void draw(void)
 {
-  vec4 r = {1, 0, 0, 1}, b = {0, 0, 1, 1}, g = {0, 1, 0, 1}, y = {1, 0, 1, 1}, gris = {1, 1, 1, 0};
   static float a = 0.0f;
-  float model_view_matrix[16], projection_matrix[16], nmv[16];
-  /* effacer l'écran et le buffer de profondeur */
-  gl4dpClearScreen();
-  clear_depth_map();
+  float model_view_matrix[16], projection_matrix[16];
+  int rects[DIRTY_MAX][4], cur[DIRTY_MAX][4], n, ncur, i, area = 0, full, w = gl4dpGetWidth(), h = gl4dpGetHeight();
+  game_state_t st;
+  const board_t * bd;
+  float cx = 0.0f, cz = 0.0f;
+  /* l'état à afficher, interpolé entre les deux derniers pas */
+  game_get_state(&st);
+  bd = game_board();
   /* des macros facilitant le travail avec des matrices et des
    * vecteurs se trouvent dans la bibliothèque GL4Dummies, dans le
    * fichier gl4dm.h */
@@ -255,92 +329,234 @@ void draw(void)
   MIDENTITY(model_view_matrix);
   /* on positionne la caméra en arrière-haut, elle regarde le centre de la scène */
   //model_view_matrix, x, y, z, etc....)
-  lookAt(model_view_matrix, 0, _ycam, 25, 0, 0, 0, 0, 0, -1);
+  /* sur un grand plateau, la caméra suit la balle */
+  if (bd->w > GAME_VIEW_CELLS || bd->h > GAME_VIEW_CELLS)
+  {
+    cx = st.balle.x;
+    cz = st.balle.y;
+  }
+  lookAt(model_view_matrix, cx, _ycam, cz + 25, cx, 0, cz, 0, 0, -1);
   // lookAt(model_view_matrix, 0, _ycam, 10, 0, 0, 0, 0, 1, 0);
-  /* le quadrilatère est mis à gauche et tourne autour de son axe x */
-  // memcpy(nmv, model_view_matrix, sizeof nmv); /* copie model_view_matrix dans nmv */
 
-  // translate(nmv, -3.0f, 0.0f, 0.0f);
-  // rotate(nmv, a, 1.0f, 0.0f, 0.0f);
-  // transform_n_rasterize(_brick, nmv, projection_matrix);
-  /* le cube est mis à droite et tourne autour de son axe z */
-
-  _brick->dcolor = gris;
-  _wall->dcolor = gris;
-  _balle->dcolor = g;
-  _sol->dcolor = b;
-
-  float cX = -_W * 2.0f / 2;
-  float cZ = -_H * 2.0f / 2;
-  for (int i = 0; i < _H; ++i)
+  /* le plateau, briques détruites comprises, par chunks aux
+   * maillages précalculés (voir boardmesh.c) */
+  bmesh_update(&_bmesh, bd);
+  /* en pipeline, la frame est enregistrée puis rastérisée par un
+     autre thread ; avec le visibility buffer, elle est enregistrée
+     puis rastérisée en deux passes */
+  set_visibility_buffer(_visibility);
+  set_span_buffer(_sbuffer);
+  set_affine_span(_affine);
+  if (_pipeline)
+    pipeline_begin(w, h);
+  else if (_visibility)
+    dlist_record(_vlist, w, h);
+  /* ce qui a bougé ou changé : les rectangles de cette frame et ceux
+   * de la précédente (l'objet y est encore dessiné) */
+  n = ncur = dirty_rects(&st, model_view_matrix, projection_matrix, cur);
+  full = !_incremental || _full_redraw || w != _prev_w || h != _prev_h ||
+    memcmp(model_view_matrix, _prev_view, sizeof _prev_view);
+  memcpy(rects, cur, n * sizeof *rects);
+  for (i = 0; i < _nprev; ++i)
+    dirty_add(rects, &n, _prev_rects[i]);
+  memcpy(_prev_rects, cur, sizeof cur);
+  _nprev = ncur;
+  for (i = 0; i < n; ++i)
+    area += (rects[i][2] - rects[i][0] + 1) * (rects[i][3] - rects[i][1] + 1);
+  /* plus de la moitié de l'écran à refaire : autant tout refaire */
+  if (full || 2 * area > w * h)
   {
-    for (int j = 0; j < _W; ++j)
+    clear_color_map(0);
+    clear_depth_map();
+    draw_scene(&st, model_view_matrix, projection_matrix, a);
+  }
+  else
+    for (i = 0; i < n; ++i)
     {
-      if (_plateau[i * _W + j] == 1)
-      {
-        memcpy(nmv, model_view_matrix, sizeof nmv); /* copie model_view_matrix dans nmv */
-        translate(nmv, 2 * j + cX, 0.0f, 2 * i + cZ);
-        // rotate(nmv, a, 0.0f, 0.0f, 1.0f);
-        transform_n_rasterize(_wall, nmv, projection_matrix);
-      } else if(_plateau[i * _W + j] == 2) {
-        memcpy(nmv, model_view_matrix, sizeof nmv); /* copie model_view_matrix dans nmv */
-        translate(nmv, 2 * j + cX, -1.0f, 2 * i + cZ);
-        // rotate(nmv, a, 0.0f, 0.0f, 1.0f);
-        transform_n_rasterize(_brick, nmv, projection_matrix);
-      }
+      set_scissor(rects[i][0], rects[i][1], rects[i][2], rects[i][3]);
+      clear_color_map(0);
+      clear_depth_map();
+      draw_scene(&st, model_view_matrix, projection_matrix, a);
+      reset_scissor();
     }
+  memcpy(_prev_view, model_view_matrix, sizeof _prev_view);
+  _prev_w = w;
+  _prev_h = h;
+  _full_redraw = 0;
+  if (_pipeline)
+  {
+    pipeline_end();
+    pipeline_present(gl4dpGetPixels(), _pipeline_latency);
+  }
+  else if (_visibility)
+  {
+    dlist_record(NULL, 0, 0);
+    dlist_play(_vlist, gl4dpGetPixels(), w, h);
   }
 
+  /* déclarer qu'on a changé des pixels du screen (en bas niveau) */
+  gl4dpScreenHasChanged();
+  /* fonction permettant de raffraîchir l'ensemble de la fenêtre*/
+  gl4dpUpdateScreen(NULL);
+  prof_frame_end();
+  a += 0.1f;
+}
 
+/*!\brief dessine la scène (état \a st, balle tournée de \a a) ; en
+ * mode incrémental, appelée une fois par rectangle, limitée à lui par
+ * le scissor */
+void draw_scene(const game_state_t * st, float * model_view_matrix, float * projection_matrix, float a)
+{
+  vec4 b = {0, 0, 1, 1}, g = {0, 1, 0, 1}, gris = {1, 1, 1, 0};
+  float nmv[16];
 
-  // balle du casse brique
+  _brick->dcolor = gris;
+  _wall->dcolor = gris;
+  _balle->dcolor = g;
+  _sol->dcolor = b;
+
+  bmesh_draw(&_bmesh, CELL_WALL, _wall, model_view_matrix, projection_matrix);
+  bmesh_draw(&_bmesh, CELL_BRICK, _brick, model_view_matrix, projection_matrix);
+
+  // balle du casse brique, à la hauteur des briques qu'elle percute
   memcpy(nmv, model_view_matrix, sizeof nmv); /* copie model_view_matrix dans nmv */
-  translate(nmv, _ballePosition.x, -8.0f, _ballePosition.y);
+  translate(nmv, st->balle.x, -1.0f, st->balle.y);
   rotate(nmv, a, 0.0f, 1.0f, 0.0f);
   transform_n_rasterize(_balle, nmv, projection_matrix);
 
+  // balles supplémentaires, toutes en un seul appel
+  {
+    int nb;
+    const float * xyz = game_balls(&nb);
+    float mballe_model[16];
+    MIDENTITY(mballe_model);
+    scale(mballe_model, GAME_MBALL_R, GAME_MBALL_R, GAME_MBALL_R);
+    transform_n_rasterize_instances(_mballe, model_view_matrix, mballe_model, projection_matrix, xyz, nb);
+  }
+
+  if (_paddle)
+  {
+    memcpy(nmv, model_view_matrix, sizeof nmv);
+    translate(nmv, st->raquette.x, 1.0f, st->raquette.y);
+    scale(nmv, _paddle_scale, _paddle_scale, _paddle_scale);
+    translate(nmv, -_paddle_center[0], -_paddle_center[1], -_paddle_center[2]);
+    transform_n_rasterize(_raquette, nmv, projection_matrix);
+    return;
+  }
   // raquette du casse brique (J'ai un grand rectangle décomposer en 2 petits)
   memcpy(nmv, model_view_matrix, sizeof nmv);
-  translate(nmv, _raquettePosition.x -1 , 1.0f, _raquettePosition.y);
+  translate(nmv, st->raquette.x -1 , 1.0f, st->raquette.y);
   transform_n_rasterize(_raquette ,nmv, projection_matrix);
 
   memcpy(nmv, model_view_matrix, sizeof nmv);
-  translate(nmv, _raquettePosition.x + 1 , 1.0f, _raquettePosition.y);
+  translate(nmv, st->raquette.x + 1 , 1.0f, st->raquette.y);
   transform_n_rasterize(_raquette ,nmv, projection_matrix);
+}
 
-  /* déclarer qu'on a changé des pixels du screen (en bas niveau) */
-  gl4dpScreenHasChanged();
-  /* fonction permettant de raffraîchir l'ensemble de la fenêtre*/
-  gl4dpUpdateScreen(NULL);
-  a += 0.1f;
+/*!\brief remplit \a rects des rectangles de l'écran couverts par ce
+ * qui bouge ou change à cette frame : la balle, les balles
+ * supplémentaires, la raquette et les chunks du plateau modifiés au
+ * dernier bmesh_update ; renvoie leur nombre (au plus DIRTY_MAX) */
+int dirty_rects(const game_state_t * st, float * model_view_matrix, float * projection_matrix, int (*rects)[4])
+{
+  int n = 0, nb, i, r[4];
+  const float * xyz = game_balls(&nb);
+  float bmin[3], bmax[3];
+  /* la balle (sphère de rayon 1, quelle que soit sa rotation) */
+  bmin[0] = st->balle.x - 1.0f; bmin[1] = -2.0f; bmin[2] = st->balle.y - 1.0f;
+  bmax[0] = st->balle.x + 1.0f; bmax[1] =  0.0f; bmax[2] = st->balle.y + 1.0f;
+  if (box_screen_rect(model_view_matrix, projection_matrix, bmin, bmax, r))
+    dirty_add(rects, &n, r);
+  for (i = 0; i < nb; ++i)
+  {
+    const float * p = &xyz[3 * i];
+    bmin[0] = p[0] - GAME_MBALL_R; bmin[1] = p[1] - GAME_MBALL_R; bmin[2] = p[2] - GAME_MBALL_R;
+    bmax[0] = p[0] + GAME_MBALL_R; bmax[1] = p[1] + GAME_MBALL_R; bmax[2] = p[2] + GAME_MBALL_R;
+    if (box_screen_rect(model_view_matrix, projection_matrix, bmin, bmax, r))
+      dirty_add(rects, &n, r);
+  }
+  /* la raquette : deux cubes côte à côte */
+  bmin[0] = st->raquette.x - 2.0f; bmin[1] = 0.0f; bmin[2] = st->raquette.y - 1.0f;
+  bmax[0] = st->raquette.x + 2.0f; bmax[1] = 2.0f; bmax[2] = st->raquette.y + 1.0f;
+  if (box_screen_rect(model_view_matrix, projection_matrix, bmin, bmax, r))
+    dirty_add(rects, &n, r);
+  /* les chunks modifiés, sur toute leur étendue : leur boîte
+     englobante a pu rétrécir */
+  for (i = 0; i < _bmesh.cw * _bmesh.ch; ++i)
+  {
+    int ci = i / _bmesh.cw, cj = i % _bmesh.cw;
+    if (!_bmesh.chunks[i].changed)
+      continue;
+    bmin[0] = 2.0f * (cj << CHUNK_SHIFT) - _bmesh.w - 1.0f;
+    bmax[0] = 2.0f * MIN((cj + 1) << CHUNK_SHIFT, _bmesh.w) - _bmesh.w - 1.0f;
+    bmin[1] = -2.0f;
+    bmax[1] = 1.0f;
+    bmin[2] = 2.0f * (ci << CHUNK_SHIFT) - _bmesh.h - 1.0f;
+    bmax[2] = 2.0f * MIN((ci + 1) << CHUNK_SHIFT, _bmesh.h) - _bmesh.h - 1.0f;
+    if (box_screen_rect(model_view_matrix, projection_matrix, bmin, bmax, r))
+      dirty_add(rects, &n, r);
+  }
+  return n;
 }
 
-/*!\brief intercepte l'événement clavier pour modifier les options. */
-void key(int keycode)
+/*!\brief ajoute le rectangle \a r aux \a n rectangles de \a rects :
+ * il est fusionné (remplacé par leur union) avec le premier qu'il
+ * touche, sinon ajouté ; s'il y en a déjà DIRTY_MAX, il est fusionné
+ * avec celui dont l'union est la moins étendue */
+void dirty_add(int (*rects)[4], int * n, const int * r)
 {
-  if(keycode == GL4DK_e) {
-    if (_raquettePosition.x <= _W - 6) {   
-      _raquettePosition.x += 0.7;
+  int i, best = -1, cost, bcost = 0, u[4];
+  for (i = 0; i < *n; ++i)
+  {
+    u[0] = MIN(rects[i][0], r[0]); u[1] = MIN(rects[i][1], r[1]);
+    u[2] = MAX(rects[i][2], r[2]); u[3] = MAX(rects[i][3], r[3]);
+    cost = (u[2] - u[0] + 1) * (u[3] - u[1] + 1) - (rects[i][2] - rects[i][0] + 1) * (rects[i][3] - rects[i][1] + 1);
+    if (r[0] <= rects[i][2] + 1 && rects[i][0] <= r[2] + 1 && r[1] <= rects[i][3] + 1 && rects[i][1] <= r[3] + 1)
+    {
+      best = i;
+      break;
     }
-  }
-  if (keycode == GL4DK_a){
-    if(_raquettePosition.x >= -_W + 4) {
-      _raquettePosition.x -= 0.7;
+    if (best < 0 || cost < bcost)
+    {
+      best = i;
+      bcost = cost;
     }
   }
-  if (keycode == GL4DK_SPACE) {
-    _vitesseBalle.x = -15.0f;
-    _vitesseBalle.y = -15.0f;
+  if (best < 0 || (i == *n && *n < DIRTY_MAX))
+  {
+    memcpy(rects[(*n)++], r, 4 * sizeof *r);
+    return;
   }
+  rects[best][0] = MIN(rects[best][0], r[0]);
+  rects[best][1] = MIN(rects[best][1], r[1]);
+  rects[best][2] = MAX(rects[best][2], r[2]);
+  rects[best][3] = MAX(rects[best][3], r[3]);
+}
+
+/*!\brief intercepte l'événement clavier pour modifier les options. */
+void key(int keycode)
+{
+  /* les commandes du jeu sont appliquées au prochain pas de la
+   * simulation */
+  if (keycode == GL4DK_e)
+    game_input(GI_RIGHT);
+  if (keycode == GL4DK_a)
+    game_input(GI_LEFT);
+  if (keycode == GL4DK_SPACE)
+    game_input(GI_LAUNCH);
+  if (keycode == GL4DK_m)
+    game_input(GI_MULTIBALL);
 
   switch (keycode)
   {
+  /* la caméra qui bouge est vue par draw, qui refait alors toute
+   * l'image */
   case GL4DK_UP:
     _ycam += 0.05f;
-    break;
+    return;
   case GL4DK_DOWN:
     _ycam -= 0.05f;
-    break;
+    return;
   case GL4DK_t: /* 't' la texture */
     _use_tex = !_use_tex;
     if (_use_tex)
@@ -386,15 +602,48 @@ void key(int keycode)
       disable_surface_option(_balle, SO_USE_LIGHTING);
     }
     break;
-  default:
+  case GL4DK_i: /* 'i' mode incrémental (voir draw) */
+    _incremental = !_incremental;
+    break;
+  case GL4DK_v: /* 'v' rendu par visibility buffer (voir draw) */
+    _visibility = !_visibility;
+    break;
+  case GL4DK_s: /* 's' S-buffer (voir draw) */
+    _sbuffer = !_sbuffer;
+    break;
+  case GL4DK_p: /* 'p' éclairage par pixel (Phong) de la balle */
+    _use_phong = !_use_phong;
+    if (_use_phong)
+      enable_surface_option(_balle, SO_USE_PHONG);
+    else
+      disable_surface_option(_balle, SO_USE_PHONG);
     break;
+  default:
+    /* les commandes du jeu ne changent que ce que redessine le mode
+     * incrémental */
+    return;
   }
-  
+  /* l'option changée a pu changer l'aspect de tout l'écran */
+  _full_redraw = 1;
 }
 
 /*!\brief à appeler à la sortie du programme. */
 void sortie(void)
 {
+  /* les frames en vol sont rastérisées avant de tout libérer */
+  pipeline_quit();
+  dlist_free(_vlist);
+  _vlist = NULL;
+  /* arrêt de la simulation (et de son thread) */
+  game_quit();
+  /* plus personne ne soumet de tâches */
+  jobs_quit();
+  if (_record)
+  {
+    replay_save(&_replay, _record);
+    replay_free(&_replay);
+    _record = NULL;
+  }
   /* on libère nos trois surfaces */
   if (_brick)
   {
@@ -411,6 +660,14 @@ void sortie(void)
     free_surface(_balle);
     _balle = NULL;
   }
+  if (_mballe)
+  {
+    free_surface(_mballe);
+    _mballe = NULL;
+  }
+  bmesh_free(&_bmesh);
+  atlas_free(_atlas);
+  _atlas = NULL;
   /* libère tous les objets produits par GL4Dummies, ici
    * principalement les screen */
   gl4duClean(GL4DU_ALL);